@@ -3,7 +3,7 @@
 #include <stdlib.h>
 
 static aa_region_t* init_region(aa_region_t* parent, size_t size);
-static void new_region(aa_arena_t* arena);
+static void new_region(aa_arena_t* arena, size_t size);
 
 void* aa_sweeper_alloc(aa_sweeper_t* sweeper, size_t size) {
   return sweeper->alloc(sweeper->sweeper, size);
@@ -15,7 +15,7 @@ void aa_sweeper_sweep(aa_sweeper_t* sweeper) {
 
 aa_arena_t aa_arena_init(size_t region_size) {
   aa_arena_t arena = (aa_arena_t){.head = NULL, .region_size = region_size};
-  new_region(&arena);
+  new_region(&arena, region_size);
   return arena;
 }
 
@@ -28,9 +28,12 @@ void aa_arena_deinit(aa_arena_t* arena) {
 }
 
 void* aa_arena_alloc(aa_arena_t* arena, size_t size) {
-  if (arena->head->ptr + size > arena->head->data + arena->region_size) {
-    new_region(arena);
-    if (arena->head->ptr + size > arena->head->data + arena->region_size) {
+  // keep every allocation pointer aligned
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if (arena->head->ptr + size > arena->head->end) {
+    // oversized allocations get a region of their own
+    new_region(arena, size > arena->region_size ? size : arena->region_size);
+    if (arena->head->ptr + size > arena->head->end) {
       return NULL;
     }
   }
@@ -39,9 +42,19 @@ void* aa_arena_alloc(aa_arena_t* arena, size_t size) {
   return ptr;
 }
 
+// the first region is kept and reused, so sweeping between parses does not go
+// back to malloc
 void aa_arena_sweep(aa_arena_t* arena) {
-  aa_arena_deinit(arena);
-  new_region(arena);
+  while (arena->head != NULL && arena->head->parent != NULL) {
+    aa_region_t* head = arena->head;
+    arena->head = head->parent;
+    free(head);
+  }
+  if (arena->head != NULL) {
+    arena->head->ptr = arena->head->data;
+  } else {
+    new_region(arena, arena->region_size);
+  }
 }
 
 aa_sweeper_t aa_arena_make_sweeper(aa_arena_t* arena) {
@@ -52,13 +65,29 @@ aa_sweeper_t aa_arena_make_sweeper(aa_arena_t* arena) {
   };
 }
 
+size_t aa_arena_used(const aa_arena_t* arena) {
+  size_t used = 0;
+  for (aa_region_t* region = arena->head; region != NULL;
+       region = region->parent) {
+    used += region->ptr - region->data;
+  }
+  return used;
+}
+
 static aa_region_t* init_region(aa_region_t* parent, size_t size) {
-  aa_region_t* region = malloc(size + 8);
+  aa_region_t* region = malloc(sizeof(aa_region_t) + size);
+  if (region == NULL) {
+    return NULL;
+  }
   region->parent = parent;
   region->ptr = region->data;
+  region->end = region->data + size;
   return region;
 }
 
-static void new_region(aa_arena_t* arena) {
-  arena->head = init_region(arena->head, arena->region_size);
+static void new_region(aa_arena_t* arena, size_t size) {
+  aa_region_t* region = init_region(arena->head, size);
+  if (region != NULL) {
+    arena->head = region;
+  }
 }
\ No newline at end of file
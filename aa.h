@@ -31,6 +31,7 @@ typedef struct aa_region aa_region_t;
 struct aa_region {
   aa_region_t* parent;
   char* ptr;
+  char* end;
   char data[];
 };
 
@@ -44,5 +45,7 @@ void aa_arena_deinit(aa_arena_t* arena);
 void* aa_arena_alloc(aa_arena_t* arena, size_t size);
 void aa_arena_sweep(aa_arena_t* arena);
 aa_sweeper_t aa_arena_make_sweeper(aa_arena_t* arena);
+// bytes handed out since the last sweep
+size_t aa_arena_used(const aa_arena_t* arena);
 
 #endif // AA_H
\ No newline at end of file
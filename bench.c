@@ -0,0 +1,2238 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// build: cc -O2 -pthread -o bench bench.c
+//    or: make bench CFLAGS=-O2 LDLIBS=-pthread
+// usage: ./bench [max_bytes] [max_threads]
+//        ./bench suite [max_bytes] [csv]
+//        ./bench verify [num_grammars]
+
+// the library is built into this file so its calls to the system allocator
+// can be counted
+static _Atomic long num_mallocs;
+
+static void* counted(void* ptr) {
+  ++num_mallocs;
+  return ptr;
+}
+
+#define malloc(size) counted(malloc(size))
+#define calloc(n, size) counted(calloc(n, size))
+#define realloc(ptr, size) counted(realloc(ptr, size))
+
+#include "aa.c"
+#include "pp.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+static double now();
+static char* make_input(const char* chunk, size_t size);
+static pp_parser_t* statements_parser();
+static pp_parser_t* sql_identifier_parser();
+static pp_parser_t* sql_keyword_parser(const char* keyword);
+static pp_parser_t* sql_select_parser();
+static pp_parser_t* log_line_parser();
+static pp_parser_t* json_parser();
+static pp_parser_t* csv_parser();
+static pp_parser_t* expr_parser();
+static pp_parser_t* where_atom(pp_parser_t* condition);
+static pp_parser_t* where_symbols(int num_symbols, const char** symbols);
+static pp_parser_t* where_parser();
+static pp_parser_t* where_level(pp_parser_t* operand, pp_parser_t* op);
+static pp_parser_t* where_prefix(pp_parser_t* op, pp_parser_t* operand);
+static pp_parser_t* where_tower_parser();
+static pp_parser_t* cut_script_parser(int cuts);
+static pp_parser_t* cut_clause(const char* keyword, pp_parser_t* rest,
+                               int cuts);
+static unsigned long next_random(unsigned long* seed);
+static int sql_record(char* dst, unsigned long* seed);
+static int json_record(char* dst, unsigned long* seed);
+static int json_value(char* dst, unsigned long* seed, int depth);
+static int csv_record(char* dst, unsigned long* seed);
+static int expr_record(char* dst, unsigned long* seed);
+static int expr_value(char* dst, unsigned long* seed, int depth);
+static int where_record(char* dst, unsigned long* seed);
+static int where_value(char* dst, unsigned long* seed, int depth);
+static int cut_record(char* dst, unsigned long* seed);
+static int cut_malformed_record(char* dst, unsigned long* seed);
+static int cut_statement(char* dst, unsigned long* seed, int malformed);
+static int log_record(char* dst, unsigned long* seed);
+static void bench_suite(size_t max_size, int csv);
+static void bench_optimize(size_t size);
+static void bench_intern(size_t size);
+static void bench_expr(size_t size);
+static void bench_cut(size_t size);
+static void bench_errors(size_t size);
+static pp_parser_t* random_parser(unsigned long* seed, int depth);
+static int check_output(
+  const char* name, pp_parser_t* parser, const char* input,
+  pp_output_t expected, pp_tape_t* tape
+);
+static int check_outputs(pp_tape_t* tape);
+static int check_errors();
+static int check_stream();
+static int verify(int num_grammars);
+static void bench_scaling(size_t max_size);
+static void bench_program(size_t size);
+static void bench_span(size_t size);
+static void bench_arena();
+static void bench_keywords(size_t size);
+static void bench_recognize(size_t size);
+static void count_event(const pp_event_t* event, void* arg);
+static void bench_events(size_t size);
+static long walk_tree(pp_output_t output);
+static void bench_tape(size_t size);
+static void bench_mallocs();
+#ifdef PP_PROFILE
+static void bench_profile(size_t size);
+#endif
+static void* parse_worker(void* arg);
+static void bench_threads(size_t size, int max_threads);
+static void bench_batch(int max_threads);
+static int
+between_rows(const char* from, const char* at, int* quoted, void* arg);
+static void bench_parallel_list(int max_threads);
+static void count_item(pp_output_t output, void* arg);
+static void bench_stream(size_t size);
+static long status_kb(const char* field);
+static void bench_file(size_t size);
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+    pp_init_default_allocator();
+    bench_suite(
+      argc > 2 ? strtoull(argv[2], NULL, 10) : 16 << 20,
+      argc > 3 && strcmp(argv[3], "csv") == 0
+    );
+    pp_deinit_default_allocator();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+    pp_init_default_allocator();
+    const int mismatches = verify(argc > 2 ? atoi(argv[2]) : 10000);
+    pp_deinit_default_allocator();
+    return mismatches > 0;
+  }
+
+  size_t max_size = argc > 1 ? strtoull(argv[1], NULL, 10) : 100 << 20;
+  int max_threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  pp_init_default_allocator();
+  bench_suite(max_size < 16 << 20 ? max_size : 16 << 20, 0);
+  bench_optimize(max_size < 1 << 20 ? max_size : 1 << 20);
+  bench_intern(max_size < 1 << 20 ? max_size : 1 << 20);
+  bench_expr(max_size < 1 << 20 ? max_size : 1 << 20);
+  bench_cut(max_size < 1 << 20 ? max_size : 1 << 20);
+  bench_errors(max_size < 1 << 20 ? max_size : 1 << 20);
+  bench_scaling(max_size);
+  bench_program(max_size < 10 << 20 ? max_size : 10 << 20);
+  bench_span(max_size < 10 << 20 ? max_size : 10 << 20);
+  bench_arena();
+  bench_keywords(max_size < 10 << 20 ? max_size : 10 << 20);
+  bench_recognize(max_size < 10 << 20 ? max_size : 10 << 20);
+  bench_events(max_size < 10 << 20 ? max_size : 10 << 20);
+  bench_tape(max_size < 10 << 20 ? max_size : 10 << 20);
+#ifdef PP_PROFILE
+  bench_profile(max_size < 1 << 20 ? max_size : 1 << 20);
+#endif
+  bench_mallocs();
+  bench_threads(max_size < 1 << 20 ? max_size : 1 << 20, max_threads);
+  bench_batch(max_threads);
+  bench_parallel_list(max_threads);
+  bench_stream(max_size < 10 << 20 ? max_size : 10 << 20);
+  bench_file(max_size);
+  pp_deinit_default_allocator();
+}
+
+static const char* sql_keywords[] = {
+  "ADD",      "ALL",     "ALTER",   "AND",    "ANY",    "AS",      "ASC",
+  "BETWEEN",  "BY",      "CASE",    "CHECK",  "COLUMN", "CREATE",  "DELETE",
+  "DESC",     "DISTINCT", "DROP",   "ELSE",   "END",    "EXISTS",  "FROM",
+  "GROUP",    "HAVING",  "IN",      "INDEX",  "INSERT", "INTO",    "IS",
+  "JOIN",     "LIKE",    "LIMIT",   "NOT",    "NULL",   "OR",      "ORDER",
+  "SELECT",   "SET",     "TABLE",   "UPDATE", "WHERE",
+};
+
+#define NUM_SQL_KEYWORDS (int)(sizeof(sql_keywords) / sizeof(*sql_keywords))
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char* make_input(const char* chunk, size_t size) {
+  const size_t chunk_len = strlen(chunk);
+  char* input = malloc(size);
+  for (size_t i = 0; i < size; i += chunk_len) {
+    size_t n = size - i < chunk_len ? size - i : chunk_len;
+    memcpy(input + i, chunk, n);
+  }
+  return input;
+}
+
+static pp_parser_t* statements_parser() {
+  return pp_many(pp_choice(
+    4,
+    (pp_parser_t*[]){
+      pp_string_no_case("SELECT "),
+      pp_string("id, "),
+      pp_string("name "),
+      pp_string_no_case("FROM t;\n"),
+    }
+  ));
+}
+
+static pp_parser_t* sql_identifier_parser() {
+  return pp_whitespace_delimited(pp_concat_string(
+    2,
+    (pp_parser_t*[]){
+      pp_alpha(),
+      pp_many(pp_alphanumeric_or_underscore()),
+    }
+  ));
+}
+
+static pp_parser_t* sql_keyword_parser(const char* keyword) {
+  return pp_whitespace_delimited(pp_string_no_case(keyword));
+}
+
+static pp_parser_t* sql_select_parser() {
+  return pp_sequence(
+    4,
+    (pp_parser_t*[]){
+      sql_keyword_parser("SELECT"),
+      pp_choice(
+        2,
+        (pp_parser_t*[]){
+          sql_keyword_parser("*"),
+          pp_comma_separated_list(sql_identifier_parser()),
+        }
+      ),
+      sql_keyword_parser("FROM"),
+      sql_identifier_parser(),
+    }
+  );
+}
+
+static pp_parser_t* log_line_parser() {
+  static const char* levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+  return pp_sequence(
+    3,
+    (pp_parser_t*[]){
+      pp_span1(pp_class_of("0123456789-:.T")),
+      pp_whitespace_delimited(pp_keywords(4, levels, PP_KEYWORDS_FIRST)),
+      pp_span(pp_class_complement(pp_class_of("\n"))),
+    }
+  );
+}
+
+#define JSON_MAX_DEPTH 4
+#define EXPR_MAX_DEPTH 4
+#define WHERE_MAX_DEPTH 3
+
+// the depths only bound the records the generators write, the grammars
+// recurse through refs
+static pp_parser_t* json_parser() {
+  pp_parser_t* string = pp_concat_string(
+    3,
+    (pp_parser_t*[]){
+      pp_char('"'),
+      pp_many(pp_choice(
+        2,
+        (pp_parser_t*[]){
+          pp_span1(pp_class_complement(pp_class_of("\"\\"))),
+          pp_concat_string(
+            2,
+            (pp_parser_t*[]){
+              pp_char('\\'),
+              pp_class(pp_class_complement(pp_class_of(""))),
+            }
+          ),
+        }
+      )),
+      pp_char('"'),
+    }
+  );
+  pp_parser_t* digits = pp_span1(pp_class_range('0', '9'));
+  pp_parser_t* number = pp_concat_string(
+    3,
+    (pp_parser_t*[]){
+      pp_optional(pp_char('-')),
+      digits,
+      pp_optional(pp_concat_string(2, (pp_parser_t*[]){pp_char('.'), digits})),
+    }
+  );
+  static const char* literals[] = {"true", "false", "null"};
+  pp_parser_t* literal = pp_keywords(3, literals, PP_KEYWORDS_FIRST);
+
+  pp_parser_t* value = pp_ref();
+  pp_parser_t* member = pp_sequence(
+    3,
+    (pp_parser_t*[]){
+      pp_whitespace_delimited(string),
+      pp_skip(pp_char(':')),
+      value,
+    }
+  );
+  pp_parser_t* object = pp_select(
+    pp_sequence(
+      3,
+      (pp_parser_t*[]){
+        pp_skip(pp_char('{')),
+        pp_optional(pp_comma_separated_list(member)),
+        pp_skip(pp_char('}')),
+      }
+    ),
+    1
+  );
+  pp_parser_t* array = pp_select(
+    pp_sequence(
+      3,
+      (pp_parser_t*[]){
+        pp_skip(pp_char('[')),
+        pp_optional(pp_comma_separated_list(value)),
+        pp_skip(pp_char(']')),
+      }
+    ),
+    1
+  );
+  pp_ref_set(
+    value,
+    pp_whitespace_delimited(pp_choice(
+      5, (pp_parser_t*[]){object, array, string, number, literal}
+    ))
+  );
+  return value;
+}
+
+static pp_parser_t* csv_parser() {
+  pp_parser_t* quoted = pp_select(
+    pp_sequence(
+      3,
+      (pp_parser_t*[]){
+        pp_char('"'),
+        pp_concat_string(
+          1,
+          (pp_parser_t*[]){
+            pp_many(pp_choice(
+              2,
+              (pp_parser_t*[]){
+                pp_span1(pp_class_complement(pp_class_of("\""))),
+                pp_select(pp_string("\"\""), 0),
+              }
+            )),
+          }
+        ),
+        pp_char('"'),
+      }
+    ),
+    1
+  );
+  pp_parser_t* field = pp_choice(
+    2,
+    (pp_parser_t*[]){
+      quoted,
+      pp_span(pp_class_complement(pp_class_of(",\n"))),
+    }
+  );
+  return pp_separated_list(field, pp_char(','));
+}
+
+// operators are kept in the output, so a level is term (op term)*
+static pp_parser_t* expr_parser() {
+  pp_parser_t* number = pp_whitespace_delimited(
+    pp_span1(pp_class_union(pp_class_range('0', '9'), pp_class_of(".")))
+  );
+  pp_parser_t* expr = pp_ref();
+  pp_parser_t* factor = pp_choice(
+    2,
+    (pp_parser_t*[]){
+      number,
+      pp_select(
+        pp_sequence(
+          3,
+          (pp_parser_t*[]){
+            pp_whitespace_delimited(pp_char('(')),
+            expr,
+            pp_whitespace_delimited(pp_char(')')),
+          }
+        ),
+        1
+      ),
+    }
+  );
+  pp_parser_t* term = pp_concat_array(
+    2,
+    (pp_parser_t*[]){
+      factor,
+      pp_many(pp_sequence(
+        2,
+        (pp_parser_t*[]){
+          pp_whitespace_delimited(pp_any_of("*/")),
+          factor,
+        }
+      )),
+    }
+  );
+  pp_ref_set(
+    expr,
+    pp_concat_array(
+      2,
+      (pp_parser_t*[]){
+        term,
+        pp_many(pp_sequence(
+          2,
+          (pp_parser_t*[]){
+            pp_whitespace_delimited(pp_any_of("+-")),
+            term,
+          }
+        )),
+      }
+    )
+  );
+  return expr;
+}
+
+static pp_parser_t* where_atom(pp_parser_t* condition) {
+  return pp_choice(
+    3,
+    (pp_parser_t*[]){
+      pp_whitespace_delimited(pp_span1(pp_class_range('0', '9'))),
+      sql_identifier_parser(),
+      pp_select(
+        pp_sequence(
+          3,
+          (pp_parser_t*[]){
+            pp_whitespace_delimited(pp_char('(')),
+            condition,
+            pp_whitespace_delimited(pp_char(')')),
+          }
+        ),
+        1
+      ),
+    }
+  );
+}
+
+static pp_parser_t* where_symbols(int num_symbols, const char** symbols) {
+  return pp_whitespace_delimited(
+    pp_keywords(num_symbols, symbols, PP_KEYWORDS_LONGEST)
+  );
+}
+
+static const char* where_comparisons[] = {"=", "<>", "<", "<=", ">", ">="};
+static const char* where_sums[] = {"+", "-"};
+static const char* where_products[] = {"*", "/"};
+
+// a WHERE condition with the SQL precedences, loosest first: OR, AND, NOT,
+// comparisons, + -, * / and unary minus
+static pp_parser_t* where_parser() {
+  pp_parser_t* condition = pp_ref();
+  const pp_operator_t operators[] = {
+    {sql_keyword_parser("OR"), PP_INFIX_LEFT, 1},
+    {sql_keyword_parser("AND"), PP_INFIX_LEFT, 2},
+    {sql_keyword_parser("NOT"), PP_PREFIX, 3},
+    {where_symbols(6, where_comparisons), PP_INFIX_LEFT, 4},
+    {where_symbols(2, where_sums), PP_INFIX_LEFT, 5},
+    {where_symbols(2, where_products), PP_INFIX_LEFT, 6},
+    {sql_keyword_parser("-"), PP_PREFIX, 7},
+  };
+  pp_ref_set(condition, pp_expr(where_atom(condition), 7, operators));
+  return condition;
+}
+
+// operand (op operand)*
+static pp_parser_t* where_level(pp_parser_t* operand, pp_parser_t* op) {
+  return pp_concat_array(
+    2,
+    (pp_parser_t*[]){
+      operand,
+      pp_many(pp_sequence(2, (pp_parser_t*[]){op, operand})),
+    }
+  );
+}
+
+// op* operand
+static pp_parser_t* where_prefix(pp_parser_t* op, pp_parser_t* operand) {
+  pp_parser_t* prefixed = pp_ref();
+  pp_ref_set(
+    prefixed,
+    pp_choice(
+      2,
+      (pp_parser_t*[]){
+        pp_sequence(2, (pp_parser_t*[]){op, prefixed}),
+        operand,
+      }
+    )
+  );
+  return prefixed;
+}
+
+// the same condition written the usual way, one level of the grammar per
+// precedence, which every atom has to descend through
+static pp_parser_t* where_tower_parser() {
+  pp_parser_t* condition = pp_ref();
+  pp_parser_t* minus =
+    where_prefix(sql_keyword_parser("-"), where_atom(condition));
+  pp_parser_t* product =
+    where_level(minus, where_symbols(2, where_products));
+  pp_parser_t* sum = where_level(product, where_symbols(2, where_sums));
+  pp_parser_t* comparison =
+    where_level(sum, where_symbols(6, where_comparisons));
+  pp_parser_t* negation =
+    where_prefix(sql_keyword_parser("NOT"), comparison);
+  pp_parser_t* conjunction =
+    where_level(negation, sql_keyword_parser("AND"));
+  pp_ref_set(condition, where_level(conjunction, sql_keyword_parser("OR")));
+  return condition;
+}
+
+// statements that only differ in the clause after a long shared start, so
+// an error in the clause has every alternative after it parse the start
+// again. with cuts, the keyword of a clause commits to its alternative and
+// the semicolon to the statement.
+static pp_parser_t* cut_script_parser(int cuts) {
+  pp_parser_t* start = pp_sequence(
+    3,
+    (pp_parser_t*[]){
+      sql_select_parser(),
+      sql_keyword_parser("WHERE"),
+      where_parser(),
+    }
+  );
+  pp_parser_t* end = sql_keyword_parser(";");
+  pp_parser_t* group_by = cut_clause(
+    "GROUP",
+    pp_sequence(
+      3,
+      (pp_parser_t*[]){
+        sql_keyword_parser("BY"),
+        pp_comma_separated_list(sql_identifier_parser()),
+        end,
+      }
+    ),
+    cuts
+  );
+  pp_parser_t* limit = cut_clause(
+    "LIMIT",
+    pp_sequence(
+      2,
+      (pp_parser_t*[]){
+        pp_whitespace_delimited(pp_span1(pp_class_range('0', '9'))),
+        end,
+      }
+    ),
+    cuts
+  );
+  pp_parser_t* statement = pp_choice(
+    3,
+    (pp_parser_t*[]){
+      pp_sequence(2, (pp_parser_t*[]){start, group_by}),
+      pp_sequence(2, (pp_parser_t*[]){start, limit}),
+      pp_sequence(2, (pp_parser_t*[]){start, end}),
+    }
+  );
+  return pp_many(cuts ? pp_commit(statement) : statement);
+}
+
+static pp_parser_t*
+cut_clause(const char* keyword, pp_parser_t* rest, int cuts) {
+  pp_parser_t* parser = sql_keyword_parser(keyword);
+  return pp_sequence(
+    2, (pp_parser_t*[]){cuts ? pp_commit(parser) : parser, rest}
+  );
+}
+
+// the corpora come from a fixed seed, so every run parses the same bytes
+static unsigned long next_random(unsigned long* seed) {
+  *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+  return *seed >> 33;
+}
+
+static const char* words[] = {
+  "id",    "name",   "created_at", "updated_at", "email", "user_id",
+  "total", "status", "amount",     "country",    "city",  "orders",
+};
+
+#define NUM_WORDS (int)(sizeof(words) / sizeof(*words))
+
+static int sql_record(char* dst, unsigned long* seed) {
+  int len = sprintf(dst, "SELECT ");
+  const int num_columns = next_random(seed) % 6;
+  if (num_columns == 0)
+    len += sprintf(dst + len, "*");
+  for (int i = 0; i < num_columns; ++i) {
+    len += sprintf(
+      dst + len, "%s%s", i > 0 ? ", " : "", words[next_random(seed) % NUM_WORDS]
+    );
+  }
+  return len + sprintf(
+                 dst + len, " FROM %s", words[next_random(seed) % NUM_WORDS]
+               );
+}
+
+static int json_record(char* dst, unsigned long* seed) {
+  return json_value(dst, seed, JSON_MAX_DEPTH);
+}
+
+static int json_value(char* dst, unsigned long* seed, int depth) {
+  const int kind = next_random(seed) % (depth > 0 ? 6 : 4);
+  switch (kind) {
+  case 0:
+    return sprintf(dst, "\"%s\"", words[next_random(seed) % NUM_WORDS]);
+  case 1:
+    return sprintf(
+      dst, "%ld.%02ld", next_random(seed) % 10000, next_random(seed) % 100
+    );
+  case 2:
+    return sprintf(dst, "%s", next_random(seed) % 2 ? "true" : "null");
+  case 3:
+    return sprintf(
+      dst, "\"a \\\"quoted\\\" %s\"", words[next_random(seed) % NUM_WORDS]
+    );
+  case 4: {
+    int len = sprintf(dst, "[");
+    const int n = next_random(seed) % 4;
+    for (int i = 0; i < n; ++i) {
+      len += sprintf(dst + len, i > 0 ? ", " : "");
+      len += json_value(dst + len, seed, depth - 1);
+    }
+    return len + sprintf(dst + len, "]");
+  }
+  default: {
+    int len = sprintf(dst, "{");
+    const int n = 1 + next_random(seed) % 4;
+    for (int i = 0; i < n; ++i) {
+      len += sprintf(
+        dst + len, "%s\"%s\": ", i > 0 ? ", " : "",
+        words[next_random(seed) % NUM_WORDS]
+      );
+      len += json_value(dst + len, seed, depth - 1);
+    }
+    return len + sprintf(dst + len, "}");
+  }
+  }
+}
+
+static int csv_record(char* dst, unsigned long* seed) {
+  return sprintf(
+    dst, "%ld,%s,\"%s, \"\"%s\"\"\",%ld.%02ld,%s",
+    next_random(seed) % 100000, words[next_random(seed) % NUM_WORDS],
+    words[next_random(seed) % NUM_WORDS], words[next_random(seed) % NUM_WORDS],
+    next_random(seed) % 1000, next_random(seed) % 100,
+    words[next_random(seed) % NUM_WORDS]
+  );
+}
+
+static int expr_record(char* dst, unsigned long* seed) {
+  return expr_value(dst, seed, EXPR_MAX_DEPTH);
+}
+
+static int expr_value(char* dst, unsigned long* seed, int depth) {
+  static const char* ops[] = {" + ", " - ", " * ", " / "};
+  int len = 0;
+  const int n = 1 + next_random(seed) % 4;
+  for (int i = 0; i < n; ++i) {
+    if (i > 0)
+      len += sprintf(dst + len, "%s", ops[next_random(seed) % 4]);
+    if (depth > 0 && next_random(seed) % 3 == 0) {
+      len += sprintf(dst + len, "(");
+      len += expr_value(dst + len, seed, depth - 1);
+      len += sprintf(dst + len, ")");
+    } else {
+      len += sprintf(dst + len, "%ld", next_random(seed) % 1000);
+    }
+  }
+  return len;
+}
+
+static int where_record(char* dst, unsigned long* seed) {
+  return where_value(dst, seed, WHERE_MAX_DEPTH);
+}
+
+// NOT only follows AND and OR, the one place the tower grammar takes it
+static int where_value(char* dst, unsigned long* seed, int depth) {
+  static const char* ops[] = {
+    " OR ", " AND ", " = ", " <> ", " <= ", " > ", " + ", " - ", " * ", " / ",
+  };
+  int len = 0;
+  int logical = 1;
+  const int n = 1 + next_random(seed) % 6;
+  for (int i = 0; i < n; ++i) {
+    if (i > 0) {
+      const int op = next_random(seed) % 10;
+      len += sprintf(dst + len, "%s", ops[op]);
+      logical = op < 2;
+    }
+    if (logical && next_random(seed) % 4 == 0)
+      len += sprintf(dst + len, "NOT ");
+    if (next_random(seed) % 6 == 0)
+      len += sprintf(dst + len, "-");
+    if (depth > 0 && next_random(seed) % 4 == 0) {
+      len += sprintf(dst + len, "(");
+      len += where_value(dst + len, seed, depth - 1);
+      len += sprintf(dst + len, ")");
+    } else if (next_random(seed) % 2) {
+      len += sprintf(dst + len, "%ld", next_random(seed) % 1000);
+    } else {
+      len += sprintf(dst + len, "%s", words[next_random(seed) % NUM_WORDS]);
+    }
+  }
+  return len;
+}
+
+static int cut_record(char* dst, unsigned long* seed) {
+  return cut_statement(dst, seed, 0);
+}
+
+static int cut_malformed_record(char* dst, unsigned long* seed) {
+  return cut_statement(dst, seed, 1);
+}
+
+// a malformed statement goes wrong at the end of its clause
+static int cut_statement(char* dst, unsigned long* seed, int malformed) {
+  int len = sql_record(dst, seed);
+  len += sprintf(dst + len, " WHERE ");
+  len += where_value(dst + len, seed, WHERE_MAX_DEPTH);
+  switch (next_random(seed) % 3) {
+  case 0:
+    len += sprintf(
+      dst + len, " GROUP BY %s", words[next_random(seed) % NUM_WORDS]
+    );
+    for (int i = next_random(seed) % 3; i > 0; --i) {
+      len +=
+        sprintf(dst + len, ", %s", words[next_random(seed) % NUM_WORDS]);
+    }
+    return len + sprintf(dst + len, malformed ? ", 1;" : ";");
+  case 1:
+    return len + sprintf(
+                   dst + len, " LIMIT %s;", malformed ? "all" : "100"
+                 );
+  default:
+    return len + sprintf(dst + len, malformed ? " )" : ";");
+  }
+}
+
+static int log_record(char* dst, unsigned long* seed) {
+  static const char* levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+  return sprintf(
+    dst, "2024-03-%02ldT%02ld:%02ld:%02ld.%03ld %s %s %s request took %ldms",
+    1 + next_random(seed) % 28, next_random(seed) % 24, next_random(seed) % 60,
+    next_random(seed) % 60, next_random(seed) % 1000,
+    levels[next_random(seed) % 4], words[next_random(seed) % NUM_WORDS],
+    words[next_random(seed) % NUM_WORDS], next_random(seed) % 5000
+  );
+}
+
+// the input is not null terminated, so this also checks that nothing reads
+// past len
+static void bench_scaling(size_t max_size) {
+  const char* chunk = "SELECT id, id, name FROM t;\n";
+
+  printf("%12s %12s %12s %10s\n", "bytes", "consumed", "seconds", "MB/s");
+  for (size_t size = 1 << 10; size <= max_size; size *= 10) {
+    char* input = make_input(chunk, size);
+    pp_parser_t* parser = statements_parser();
+
+    const double start = now();
+    const pp_result_t result = pp_parse_n(parser, input, size);
+    const double elapsed = now() - start;
+
+    printf(
+      "%12zu %12d %12.6f %10.1f\n", size, result.pos, elapsed,
+      size / elapsed / (1 << 20)
+    );
+
+    pp_sweep();
+    free(input);
+  }
+}
+
+// MB/s of the reference parser against the compiled program
+static void bench_program(size_t size) {
+  char* input = make_input("SELECT id, id, name FROM t;\n", size);
+  pp_parser_t* parser = statements_parser();
+
+  double start = now();
+  pp_parse_n(parser, input, size);
+  const double tree = now() - start;
+  pp_sweep();
+
+  parser = statements_parser();
+  pp_program_t* program = pp_compile(parser);
+  start = now();
+  pp_run(program, input, size);
+  const double vm = now() - start;
+
+  printf("\n%12s %12s %12s\n", "bytes", "pp_parse_n", "pp_run");
+  printf(
+    "%12zu %11.1fM %11.1fM\n", size, size / tree / (1 << 20),
+    size / vm / (1 << 20)
+  );
+
+  pp_sweep();
+  free(input);
+}
+
+// whitespace separated identifiers, every token is a span
+static void bench_span(size_t size) {
+  char* input = make_input(
+    "select_list    column_name\t\tanother_identifier_that_is_long \n", size
+  );
+  pp_parser_t* parser = pp_many(pp_sequence(
+    2,
+    (pp_parser_t*[]){
+      pp_many(pp_alphanumeric_or_underscore()),
+      pp_skip_whitespace(),
+    }
+  ));
+
+  const double start = now();
+  const pp_result_t result = pp_parse_n(parser, input, size);
+  const double elapsed = now() - start;
+
+  printf("\n%12s %12s %12s\n", "bytes", "consumed", "span MB/s");
+  printf(
+    "%12zu %12d %11.1fM\n", size, result.pos, size / elapsed / (1 << 20)
+  );
+
+  pp_sweep();
+  free(input);
+}
+
+// arena bytes used by the outputs of one README style statement
+static void bench_arena() {
+  const char* query =
+    "SELECT id, name, data, created_at, updated_at FROM some_table";
+  aa_arena_t arena = aa_arena_init(1 << 16);
+  pp_parser_t* parser = sql_select_parser();
+
+  pp_set_allocator(aa_arena_make_sweeper(&arena));
+  pp_parse(parser, query);
+  pp_set_default_allocator();
+
+  printf("\n%12s %12s\n", "statement", "arena bytes");
+  printf("%12zu %12zu\n", strlen(query), aa_arena_used(&arena));
+
+  aa_arena_deinit(&arena);
+  pp_sweep();
+}
+
+// NUM_SQL_KEYWORDS keywords as a choice of strings and as one trie. most
+// tokens start with a byte that rules out all but a few choice alternatives.
+static void bench_keywords(size_t size) {
+  char* input = make_input(
+    "select name from users where id in limit order by desc having ", size
+  );
+
+  printf("\n%12s %12s %12s\n", "bytes", "choice MB/s", "trie MB/s");
+  printf("%12zu", size);
+  for (int trie = 0; trie < 2; ++trie) {
+    pp_parser_t* keywords;
+    if (trie) {
+      keywords = pp_whitespace_delimited(
+        pp_keywords(NUM_SQL_KEYWORDS, sql_keywords, PP_KEYWORDS_NO_CASE)
+      );
+    } else {
+      pp_parser_t* strings[NUM_SQL_KEYWORDS];
+      for (int i = 0; i < NUM_SQL_KEYWORDS; ++i) {
+        strings[i] = sql_keyword_parser(sql_keywords[i]);
+      }
+      keywords = pp_choice(NUM_SQL_KEYWORDS, strings);
+    }
+    pp_parser_t* parser = pp_many(pp_choice(
+      2,
+      (pp_parser_t*[]){
+        keywords,
+        sql_identifier_parser(),
+      }
+    ));
+
+    const double start = now();
+    pp_parse_n(parser, input, size);
+    const double elapsed = now() - start;
+    printf(" %11.1fM", size / elapsed / (1 << 20));
+
+    pp_sweep();
+  }
+  printf("\n");
+
+  free(input);
+}
+
+// README style statements parsed into outputs and only recognized. the arena
+// column is the memory the outputs needed.
+static void bench_recognize(size_t size) {
+  char* input = make_input("SELECT id, name, created_at FROM users;\n", size);
+  pp_parser_t* parser = pp_many(pp_sequence(
+    2,
+    (pp_parser_t*[]){
+      sql_select_parser(),
+      pp_whitespace_delimited(pp_char(';')),
+    }
+  ));
+
+  printf(
+    "\n%12s %12s %12s %12s\n", "bytes", "mode", "MB/s", "arena bytes"
+  );
+  for (int recognize = 0; recognize < 2; ++recognize) {
+    aa_arena_t arena = aa_arena_init(1 << 20);
+    pp_set_allocator(aa_arena_make_sweeper(&arena));
+
+    const double start = now();
+    if (recognize) {
+      pp_recognize(parser, input, size);
+    } else {
+      pp_parse_n(parser, input, size);
+    }
+    const double elapsed = now() - start;
+
+    pp_set_default_allocator();
+    printf(
+      "%12zu %12s %11.1fM %12zu\n", size,
+      recognize ? "recognize" : "parse", size / elapsed / (1 << 20),
+      aa_arena_used(&arena)
+    );
+    aa_arena_deinit(&arena);
+  }
+
+  pp_sweep();
+  free(input);
+}
+
+static void count_event(const pp_event_t* event, void* arg) {
+  ++*(long*)arg;
+}
+
+// a tree of every statement against events for the same nodes. the event log
+// only holds the statement being parsed.
+static void bench_events(size_t size) {
+  enum { STATEMENT, COLUMN, TABLE };
+  char* input = make_input("SELECT id, name, created_at FROM users;\n", size);
+  pp_parser_t* parser = pp_many(pp_node(
+    pp_sequence(
+      5,
+      (pp_parser_t*[]){
+        sql_keyword_parser("SELECT"),
+        pp_comma_separated_list(pp_token(sql_identifier_parser(), COLUMN)),
+        sql_keyword_parser("FROM"),
+        pp_token(sql_identifier_parser(), TABLE),
+        pp_whitespace_delimited(pp_char(';')),
+      }
+    ),
+    STATEMENT
+  ));
+
+  printf(
+    "\n%12s %12s %12s %12s %12s\n", "bytes", "mode", "MB/s", "events",
+    "arena bytes"
+  );
+  for (int events = 0; events < 2; ++events) {
+    aa_arena_t arena = aa_arena_init(1 << 20);
+    pp_set_allocator(aa_arena_make_sweeper(&arena));
+
+    long num_events = 0;
+    const double start = now();
+    if (events) {
+      pp_parse_events(parser, input, size, count_event, &num_events);
+    } else {
+      pp_parse_n(parser, input, size);
+    }
+    const double elapsed = now() - start;
+
+    pp_set_default_allocator();
+    printf(
+      "%12zu %12s %11.1fM %12ld %12zu\n", size, events ? "events" : "parse",
+      size / elapsed / (1 << 20), num_events, aa_arena_used(&arena)
+    );
+    aa_arena_deinit(&arena);
+  }
+
+  pp_sweep();
+  free(input);
+}
+
+// generous for any record the generators above write
+#define SUITE_RECORD_MAX (1 << 14)
+
+typedef struct {
+  const char* name;
+  pp_parser_t* (*parser)();
+  int (*record)(char* dst, unsigned long* seed);
+} suite_grammar_t;
+
+static const suite_grammar_t suite_grammars[] = {
+  {"sql", sql_select_parser, sql_record},
+  {"json", json_parser, json_record},
+  {"csv", csv_parser, csv_record},
+  {"expr", expr_parser, expr_record},
+  {"log", log_line_parser, log_record},
+  {"where", where_parser, where_record},
+};
+
+#define NUM_SUITE_GRAMMARS                                                     \
+  (int)(sizeof(suite_grammars) / sizeof(*suite_grammars))
+
+// newline separated records of grammar, at least size bytes of them
+typedef struct {
+  char* text;
+  size_t bytes;
+  int num_records;
+  int* starts;
+  int* lens;
+} suite_corpus_t;
+
+static suite_corpus_t
+suite_corpus(const suite_grammar_t* grammar, size_t size) {
+  unsigned long seed = 42;
+  suite_corpus_t corpus = {.text = malloc(size + SUITE_RECORD_MAX)};
+  int cap = 1024;
+  corpus.starts = malloc(cap * sizeof(int));
+  corpus.lens = malloc(cap * sizeof(int));
+  for (size_t len = 0; len < size;) {
+    if (corpus.num_records == cap) {
+      cap *= 2;
+      corpus.starts = realloc(corpus.starts, cap * sizeof(int));
+      corpus.lens = realloc(corpus.lens, cap * sizeof(int));
+    }
+    corpus.starts[corpus.num_records] = len;
+    corpus.lens[corpus.num_records] =
+      grammar->record(corpus.text + len, &seed);
+    len += corpus.lens[corpus.num_records] + 1;
+    corpus.text[len - 1] = '\n';
+    corpus.num_records++;
+  }
+  corpus.bytes = corpus.starts[corpus.num_records - 1] +
+                 corpus.lens[corpus.num_records - 1];
+  return corpus;
+}
+
+static void suite_corpus_free(suite_corpus_t* corpus) {
+  free(corpus->lens);
+  free(corpus->starts);
+  free(corpus->text);
+}
+
+// every grammar over corpora of 64 KB, 1 MB and 16 MB of newline separated
+// records, each record parsed on its own and swept after. csv prints one
+// machine readable line per run for tracking regressions.
+static void bench_suite(size_t max_size, int csv) {
+  if (csv) {
+    printf(
+      "grammar,bytes,records,failures,mb_per_s,parses_per_s,"
+      "arena_bytes_per_parse,mallocs_per_parse\n"
+    );
+  } else {
+    printf(
+      "\n%8s %12s %10s %10s %12s %14s %12s\n", "grammar", "bytes", "records",
+      "MB/s", "parses/s", "arena/parse", "mallocs/parse"
+    );
+  }
+
+  for (int g = 0; g < NUM_SUITE_GRAMMARS; ++g) {
+    const suite_grammar_t* grammar = &suite_grammars[g];
+    pp_parser_t* parser = grammar->parser();
+    for (size_t size = 1 << 16; size <= max_size && size <= 16 << 20;
+         size <<= 4) {
+      suite_corpus_t corpus = suite_corpus(grammar, size);
+      const int num_records = corpus.num_records;
+
+      aa_arena_t arena = aa_arena_init(1 << 16);
+      pp_set_allocator(aa_arena_make_sweeper(&arena));
+      pp_parse_n(parser, corpus.text + corpus.starts[0], corpus.lens[0]);
+      pp_sweep();
+
+      int failures = 0;
+      size_t arena_bytes = 0;
+      const long mallocs = num_mallocs;
+      const double start = now();
+      for (int i = 0; i < num_records; ++i) {
+        const pp_result_t result = pp_parse_n(
+          parser, corpus.text + corpus.starts[i], corpus.lens[i]
+        );
+        failures += result.status != PP_OK || result.pos != corpus.lens[i];
+        arena_bytes += aa_arena_used(&arena);
+        pp_sweep();
+      }
+      const double elapsed = now() - start;
+      const double mallocs_per_parse =
+        (double)(num_mallocs - mallocs) / num_records;
+      pp_set_default_allocator();
+      aa_arena_deinit(&arena);
+
+      if (csv) {
+        printf(
+          "%s,%zu,%d,%d,%.1f,%.0f,%.1f,%.2f\n", grammar->name, corpus.bytes,
+          num_records, failures, corpus.bytes / elapsed / (1 << 20),
+          num_records / elapsed, (double)arena_bytes / num_records,
+          mallocs_per_parse
+        );
+      } else {
+        printf(
+          "%8s %12zu %10d %9.1fM %12.0f %14.1f %12.2f\n", grammar->name,
+          corpus.bytes, num_records, corpus.bytes / elapsed / (1 << 20),
+          num_records / elapsed, (double)arena_bytes / num_records,
+          mallocs_per_parse
+        );
+      }
+      if (failures > 0) {
+        fprintf(
+          stderr, "%s: %d records failed to parse\n", grammar->name, failures
+        );
+      }
+
+      suite_corpus_free(&corpus);
+    }
+  }
+  pp_sweep();
+}
+
+// the suite grammars as written and after pp_optimize, over the same records
+static void bench_optimize(size_t size) {
+  printf(
+    "\n%8s %12s %12s %12s %12s\n", "grammar", "bytes", "mode", "parse MB/s",
+    "recognize MB/s"
+  );
+  for (int g = 0; g < NUM_SUITE_GRAMMARS; ++g) {
+    const suite_grammar_t* grammar = &suite_grammars[g];
+    suite_corpus_t corpus = suite_corpus(grammar, size);
+    pp_parser_t* parsers[] = {grammar->parser(), NULL};
+    parsers[1] = pp_optimize(parsers[0]);
+
+    for (int optimized = 0; optimized < 2; ++optimized) {
+      double rates[2];
+      for (int recognize = 0; recognize < 2; ++recognize) {
+        aa_arena_t arena = aa_arena_init(1 << 16);
+        pp_set_allocator(aa_arena_make_sweeper(&arena));
+        const double start = now();
+        for (int i = 0; i < corpus.num_records; ++i) {
+          const char* record = corpus.text + corpus.starts[i];
+          if (recognize) {
+            pp_recognize(parsers[optimized], record, corpus.lens[i]);
+          } else {
+            pp_parse_n(parsers[optimized], record, corpus.lens[i]);
+          }
+          pp_sweep();
+        }
+        rates[recognize] = corpus.bytes / (now() - start) / (1 << 20);
+        pp_set_default_allocator();
+        aa_arena_deinit(&arena);
+      }
+      printf(
+        "%8s %12zu %12s %11.1fM %13.1fM\n", grammar->name, corpus.bytes,
+        optimized ? "optimized" : "as written", rates[0], rates[1]
+      );
+    }
+
+    suite_corpus_free(&corpus);
+  }
+  pp_sweep();
+}
+
+// the suite grammars built as usual and with pp_intern, which shares the
+// nodes the helpers build over and over. sql is the grammar from the README.
+static void bench_intern(size_t size) {
+  printf(
+    "\n%8s %12s %12s %12s %12s\n", "grammar", "nodes", "interned", "MB/s",
+    "interned MB/s"
+  );
+  for (int g = 0; g < NUM_SUITE_GRAMMARS; ++g) {
+    const suite_grammar_t* grammar = &suite_grammars[g];
+    suite_corpus_t corpus = suite_corpus(grammar, size);
+    int nodes[2];
+    double rates[2];
+    for (int intern = 0; intern < 2; ++intern) {
+      pp_intern(intern);
+      pp_parser_t* parser = grammar->parser();
+      pp_intern(0);
+      nodes[intern] = pp_count_nodes(parser);
+
+      aa_arena_t arena = aa_arena_init(1 << 16);
+      pp_set_allocator(aa_arena_make_sweeper(&arena));
+      const double start = now();
+      for (int i = 0; i < corpus.num_records; ++i) {
+        pp_parse_n(parser, corpus.text + corpus.starts[i], corpus.lens[i]);
+        pp_sweep();
+      }
+      rates[intern] = corpus.bytes / (now() - start) / (1 << 20);
+      pp_set_default_allocator();
+      aa_arena_deinit(&arena);
+    }
+    printf(
+      "%8s %12d %12d %11.1fM %12.1fM\n", grammar->name, nodes[0], nodes[1],
+      rates[0], rates[1]
+    );
+    suite_corpus_free(&corpus);
+  }
+  pp_sweep();
+}
+
+// the WHERE condition as one pp_expr and as a tower of precedence levels,
+// over the same records
+static void bench_expr(size_t size) {
+  printf(
+    "\n%8s %12s %12s %12s %12s\n", "grammar", "bytes", "mode", "parse MB/s",
+    "recognize MB/s"
+  );
+  const suite_grammar_t grammar = {"where", where_parser, where_record};
+  suite_corpus_t corpus = suite_corpus(&grammar, size);
+  pp_parser_t* parsers[] = {where_tower_parser(), where_parser()};
+
+  for (int expr = 0; expr < 2; ++expr) {
+    double rates[2];
+    int failures = 0;
+    for (int recognize = 0; recognize < 2; ++recognize) {
+      aa_arena_t arena = aa_arena_init(1 << 16);
+      pp_set_allocator(aa_arena_make_sweeper(&arena));
+      const double start = now();
+      for (int i = 0; i < corpus.num_records; ++i) {
+        const char* record = corpus.text + corpus.starts[i];
+        const pp_result_t result =
+          recognize ? pp_recognize(parsers[expr], record, corpus.lens[i])
+                    : pp_parse_n(parsers[expr], record, corpus.lens[i]);
+        failures += result.status != PP_OK || result.pos != corpus.lens[i];
+        pp_sweep();
+      }
+      rates[recognize] = corpus.bytes / (now() - start) / (1 << 20);
+      pp_set_default_allocator();
+      aa_arena_deinit(&arena);
+    }
+    printf(
+      "%8s %12zu %12s %11.1fM %13.1fM\n", grammar.name, corpus.bytes,
+      expr ? "pp_expr" : "tower", rates[0], rates[1]
+    );
+    if (failures > 0) {
+      fprintf(stderr, "where: %d records failed to parse\n", failures);
+    }
+  }
+
+  suite_corpus_free(&corpus);
+  pp_sweep();
+}
+
+// the same statements with and without cuts: valid and malformed records
+// parsed one by one, then an eighth as many valid ones as one script with
+// every parser memoized, where a cut lets the memo table start over
+static void bench_cut(size_t size) {
+  printf(
+    "\n%8s %12s %12s %12s %15s %12s\n", "grammar", "bytes", "cuts",
+    "valid MB/s", "malformed MB/s", "memo arena"
+  );
+  const suite_grammar_t grammars[] = {
+    {"select", NULL, cut_record},
+    {"select", NULL, cut_malformed_record},
+  };
+  suite_corpus_t corpora[2];
+  for (int i = 0; i < 2; ++i) {
+    corpora[i] = suite_corpus(&grammars[i], size);
+  }
+  suite_corpus_t script = suite_corpus(&grammars[0], size >> 3);
+
+  for (int cuts = 0; cuts < 2; ++cuts) {
+    pp_parser_t* parser = cut_script_parser(cuts);
+    double rates[2];
+    int failures = 0;
+    for (int malformed = 0; malformed < 2; ++malformed) {
+      const suite_corpus_t* corpus = &corpora[malformed];
+      aa_arena_t arena = aa_arena_init(1 << 16);
+      pp_set_allocator(aa_arena_make_sweeper(&arena));
+      const double start = now();
+      for (int i = 0; i < corpus->num_records; ++i) {
+        const pp_result_t result = pp_parse_n(
+          parser, corpus->text + corpus->starts[i], corpus->lens[i]
+        );
+        failures += malformed ? result.status == PP_OK &&
+                                  result.pos == corpus->lens[i]
+                              : result.status != PP_OK ||
+                                  result.pos != corpus->lens[i];
+        pp_sweep();
+      }
+      rates[malformed] = corpus->bytes / (now() - start) / (1 << 20);
+      pp_set_default_allocator();
+      aa_arena_deinit(&arena);
+    }
+
+    aa_arena_t arena = aa_arena_init(1 << 16);
+    pp_set_allocator(aa_arena_make_sweeper(&arena));
+    pp_memo_all(1);
+    const pp_result_t result = pp_parse_n(parser, script.text, script.bytes);
+    failures += result.status != PP_OK || result.pos != script.bytes;
+    const size_t memo_bytes = aa_arena_used(&arena);
+    pp_memo_all(0);
+    pp_sweep();
+    pp_set_default_allocator();
+    aa_arena_deinit(&arena);
+
+    printf(
+      "%8s %12zu %12s %11.1fM %14.1fM %11zuK\n", grammars[0].name,
+      corpora[0].bytes, cuts ? "on" : "off", rates[0], rates[1],
+      memo_bytes >> 10
+    );
+    if (failures > 0) {
+      fprintf(stderr, "select: %d records parsed wrong\n", failures);
+    }
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    suite_corpus_free(&corpora[i]);
+  }
+  suite_corpus_free(&script);
+  pp_sweep();
+}
+
+// MB/s of malformed statements, parsed alone and then with their errors
+// worked out and formatted, by the parser and by its program
+static void bench_errors(size_t size) {
+  const suite_grammar_t grammar = {"select", NULL, cut_malformed_record};
+  suite_corpus_t corpus = suite_corpus(&grammar, size);
+  pp_parser_t* parser = cut_script_parser(1);
+  pp_program_t* program = pp_compile(parser);
+  char message[256] = "";
+
+  printf(
+    "\n%10s %12s %12s %12s\n", "runner", "bytes", "parse MB/s", "error MB/s"
+  );
+  for (int vm = 0; vm < 2; ++vm) {
+    double rates[2];
+    for (int errors = 0; errors < 2; ++errors) {
+      aa_arena_t arena = aa_arena_init(1 << 16);
+      pp_set_allocator(aa_arena_make_sweeper(&arena));
+      const double start = now();
+      for (int i = 0; i < corpus.num_records; ++i) {
+        const char* record = corpus.text + corpus.starts[i];
+        if (vm)
+          pp_run(program, record, corpus.lens[i]);
+        else
+          pp_parse_n(parser, record, corpus.lens[i]);
+        if (errors) {
+          const pp_error_t error = pp_error();
+          pp_error_message(&error, message, sizeof(message));
+        }
+        pp_sweep();
+      }
+      rates[errors] = corpus.bytes / (now() - start) / (1 << 20);
+      pp_set_default_allocator();
+      aa_arena_deinit(&arena);
+    }
+    printf(
+      "%10s %12zu %11.1fM %11.1fM\n", vm ? "pp_run" : "pp_parse_n",
+      corpus.bytes, rates[0], rates[1]
+    );
+  }
+  printf("last: %s\n", message);
+
+  suite_corpus_free(&corpus);
+  pp_sweep();
+}
+
+// bytes the random grammars and their inputs are made of
+static const char verify_bytes[] = "abAB ,x";
+
+#define NUM_VERIFY_BYTES (int)(sizeof(verify_bytes) - 1)
+
+// a grammar mixing the parsers pp_optimize rewrites, nested up to depth
+static pp_parser_t* random_parser(unsigned long* seed, int depth) {
+  char text[3] = {0};
+  for (int i = next_random(seed) % 3; i > 0; --i)
+    text[i - 1] = verify_bytes[next_random(seed) % NUM_VERIFY_BYTES];
+  const char c = verify_bytes[next_random(seed) % NUM_VERIFY_BYTES];
+
+  pp_parser_t* parsers[4];
+  const int num_parsers = 1 + next_random(seed) % 4;
+  switch (next_random(seed) % (depth > 0 ? 16 : 7)) {
+  case 0:
+    return pp_char(c);
+  case 1:
+    return pp_string(text);
+  case 2:
+    return pp_string_no_case(text);
+  case 3:
+    return text[0] ? pp_any_of(text) : pp_none_of((char[]){c, '\0'});
+  case 4:
+    return pp_span(pp_class_of(text));
+  case 5:
+    return next_random(seed) % 2 ? pp_eof() : pp_pure();
+  case 6:
+    return pp_expect(c);
+  case 7:
+    return pp_optional(random_parser(seed, depth - 1));
+  case 8:
+    return pp_many(random_parser(seed, depth - 1));
+  case 9:
+    return pp_skip(random_parser(seed, depth - 1));
+  case 10:
+    return pp_whitespace_delimited(random_parser(seed, depth - 1));
+  }
+
+  // alternatives sharing a first parser are what hoisting looks for
+  pp_parser_t* first = random_parser(seed, depth - 1);
+  for (int i = 0; i < num_parsers; ++i) {
+    parsers[i] = random_parser(seed, depth - 1);
+  }
+  switch (next_random(seed) % 7) {
+  case 0:
+    return pp_sequence(num_parsers, parsers);
+  case 1:
+    return pp_concat_string(num_parsers, parsers);
+  case 2:
+    return pp_concat_array(num_parsers, parsers);
+  case 3:
+    return pp_choice(num_parsers, parsers);
+  case 4: {
+    pp_operator_t operators[4];
+    for (int i = 0; i < num_parsers; ++i) {
+      operators[i] = (pp_operator_t){
+        .parser = parsers[i],
+        .fixity = next_random(seed) % 4,
+        .precedence = next_random(seed) % 3,
+      };
+    }
+    return pp_expr(first, num_parsers, operators);
+  }
+  // alternatives sharing a first parser that commit to it, which hoisting
+  // has to leave alone
+  case 5:
+    for (int i = 0; i < num_parsers; ++i) {
+      parsers[i] =
+        pp_sequence(2, (pp_parser_t*[]){pp_commit(first), parsers[i]});
+    }
+    return pp_choice(num_parsers, parsers);
+  default:
+    for (int i = 0; i < num_parsers; ++i) {
+      parsers[i] = pp_sequence(2, (pp_parser_t*[]){first, parsers[i]});
+    }
+    return pp_choice(num_parsers, parsers);
+  }
+}
+
+static int same_result(pp_result_t a, pp_result_t b) {
+  return a.status == b.status &&
+         (a.status != PP_OK ||
+          (a.pos == b.pos && pp_output_equal(a.output, b.output)));
+}
+
+// parser against its optimized graph, through the tree, recognizer, tape and
+// compiled program. prints and returns the number of modes that disagree.
+static int verify_input(
+  pp_parser_t* parser, pp_parser_t* optimized, pp_program_t* program,
+  pp_tape_t* tape, const char* input, int len
+) {
+  const pp_result_t expected = pp_parse_n(parser, input, len);
+  pp_result_t recognized = pp_recognize(optimized, input, len);
+  recognized.output = expected.output;
+  pp_result_t taped = pp_parse_tape(optimized, input, len, tape);
+  if (taped.status == PP_OK)
+    taped.output = pp_tape_output(tape, 0);
+
+  const struct {
+    const char* mode;
+    pp_result_t result;
+  } modes[] = {
+    {"parse", pp_parse_n(optimized, input, len)},
+    {"recognize", recognized},
+    {"tape", taped},
+    {"program", pp_run(program, input, len)},
+  };
+  int mismatches = 0;
+  for (int i = 0; i < (int)(sizeof(modes) / sizeof(*modes)); ++i) {
+    if (!same_result(expected, modes[i].result)) {
+      printf("%s differs on \"%.*s\"\n", modes[i].mode, len, input);
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+// the output of parser on input through the tree, tape and compiled program,
+// which has to be expected down to its type. returns the number of modes
+// that differ.
+static int check_output(
+  const char* name, pp_parser_t* parser, const char* input,
+  pp_output_t expected, pp_tape_t* tape
+) {
+  const int len = strlen(input);
+  pp_result_t taped = pp_parse_tape(parser, input, len, tape);
+  if (taped.status == PP_OK)
+    taped.output = pp_tape_output(tape, 0);
+
+  const struct {
+    const char* mode;
+    pp_result_t result;
+  } modes[] = {
+    {"parse", pp_parse_n(parser, input, len)},
+    {"tape", taped},
+    {"program", pp_run(pp_compile(parser), input, len)},
+  };
+  int mismatches = 0;
+  for (int i = 0; i < (int)(sizeof(modes) / sizeof(*modes)); ++i) {
+    if (modes[i].result.status != PP_OK ||
+        !pp_output_equal(modes[i].result.output, expected)) {
+      printf("%s: %s differs on \"%.40s\"\n", name, modes[i].mode, input);
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+// outputs the library promises for a few grammars. bench.c includes pp.c, so
+// the expected outputs are built with its own constructors.
+static int check_outputs(pp_tape_t* tape) {
+  int mismatches = 0;
+
+  const char* identifier = "hello_1";
+  mismatches += check_output(
+    "identifier",
+    pp_concat_string(
+      2, (pp_parser_t*[]){pp_alpha(), pp_many(pp_alphanumeric_or_underscore())}
+    ),
+    identifier, slice(strlen(identifier), identifier), tape
+  );
+
+  pp_parser_t* a = pp_char('a');
+  pp_parser_t* b = pp_char('b');
+  pp_parser_t* c = pp_char('c');
+  mismatches += check_output(
+    "select", pp_select(pp_sequence(3, (pp_parser_t*[]){a, b, c}), 2), "abc",
+    chr('c'), tape
+  );
+  mismatches += check_output(
+    "concat array",
+    pp_concat_array(
+      3, (pp_parser_t*[]){a, pp_sequence(2, (pp_parser_t*[]){b, c}), a}
+    ),
+    "abca", array(4, (pp_output_t[]){chr('a'), chr('b'), chr('c'), chr('a')}),
+    tape
+  );
+  const pp_output_t row = array(2, (pp_output_t[]){chr('a'), chr('b')});
+  mismatches += check_output(
+    "separated list",
+    pp_separated_list(pp_sequence(2, (pp_parser_t*[]){a, b}), pp_char(',')),
+    "ab,ab", array(2, (pp_output_t[]){row, row}), tape
+  );
+
+  // a choice over a set ref dispatches on its parser, which cannot change
+  pp_parser_t* ref = pp_ref();
+  pp_ref_set(ref, a);
+  pp_parser_t* over_ref = pp_choice(2, (pp_parser_t*[]){ref, c});
+  if (pp_ref_set(ref, b) != PP_ERROR_REF_SET) {
+    printf("ref: set twice\n");
+    mismatches++;
+  }
+  mismatches += check_output("ref", over_ref, "a", chr('a'), tape);
+
+  // items holding the split char, so that some cuts fall inside an item
+  const int list_len = (1 << 19) + 1;
+  char* list = malloc(list_len + 1);
+  for (int i = 0; i < list_len; ++i) {
+    list[i] = "x,y,"[i % 4];
+  }
+  list[list_len] = '\0';
+  pp_parser_t* item = pp_choice(
+    2, (pp_parser_t*[]){pp_string("x,y"), pp_span1(pp_class_range('a', 'z'))}
+  );
+  mismatches += check_output(
+    "parallel list",
+    pp_parallel_separated_list(item, pp_char(','), ',', NULL, NULL, 4), list,
+    pp_parse(pp_separated_list(item, pp_char(',')), list).output, tape
+  );
+  free(list);
+
+  pp_sweep();
+  return mismatches;
+}
+
+// the errors batches and streams record against those of pp_error after
+// parsing the same input alone
+static int check_errors() {
+  int mismatches = 0;
+  char want[256], got[256];
+  pp_parser_t* item = pp_sequence(
+    2,
+    (pp_parser_t*[]){
+      pp_name(pp_span1(pp_class_range('a', 'z')), "word"),
+      pp_char(';'),
+    }
+  );
+
+  const char* inputs[] = {"ab;", "ab,", "", "a\nb;"};
+  const int lens[] = {3, 3, 0, 4};
+  pp_result_t results[4];
+  pp_batch_t* batch = pp_parse_batch(item, inputs, lens, 4, results, 2);
+  for (int i = 0; i < 4; ++i) {
+    const pp_result_t alone = pp_parse_n(item, inputs[i], lens[i]);
+    const pp_error_t error = pp_error();
+    pp_error_message(&error, want, sizeof(want));
+    if ((alone.status == PP_OK) != (batch->errors[i] == NULL)) {
+      printf("batch error: input %d\n", i);
+      mismatches++;
+    } else if (batch->errors[i] != NULL) {
+      pp_error_message(batch->errors[i], got, sizeof(got));
+      if (strcmp(want, got) != 0) {
+        printf("batch error: %s instead of %s\n", got, want);
+        mismatches++;
+      }
+    }
+  }
+  pp_batch_sweep(batch);
+
+  // naming one of two interned leaves leaves the other as it was
+  pp_intern(1);
+  pp_parser_t* letter = pp_alpha();
+  pp_parser_t* other = pp_alpha();
+  pp_parse_n(other, "1", 1);
+  const pp_error_t unnamed = pp_error();
+  pp_error_message(&unnamed, want, sizeof(want));
+  pp_parser_t* named = pp_name(letter, "letter");
+  pp_parse_n(other, "1", 1);
+  const pp_error_t shared = pp_error();
+  pp_error_message(&shared, got, sizeof(got));
+  pp_intern(0);
+  if (letter != other || strcmp(want, got) != 0) {
+    printf("name error: %s instead of %s\n", got, want);
+    mismatches++;
+  }
+  pp_parse_n(named, "1", 1);
+  const pp_error_t renamed = pp_error();
+  pp_error_message(&renamed, got, sizeof(got));
+  if (strcmp(got, "line 1, column 1: expected letter") != 0) {
+    printf("name error: %s\n", got);
+    mismatches++;
+  }
+
+  // a long list that goes wrong at its end, where only its last piece gets
+  const int list_len = 1 << 19;
+  char* list = malloc(list_len);
+  for (int i = 0; i < list_len; ++i) {
+    list[i] = "ab,"[i % 3];
+  }
+  list[list_len - 1] = '!';
+  pp_parser_t* word = pp_span1(pp_class_range('a', 'z'));
+  pp_parser_t* lists[] = {
+    pp_separated_list(word, pp_char(',')),
+    pp_parallel_separated_list(word, pp_char(','), ',', NULL, NULL, 4),
+  };
+  for (int i = 0; i < 2; ++i) {
+    pp_parse_n(
+      pp_sequence(2, (pp_parser_t*[]){lists[i], pp_eof()}),
+      list, list_len
+    );
+    const pp_error_t error = pp_error();
+    pp_error_message(&error, i ? got : want, sizeof(want));
+  }
+  if (strcmp(want, got) != 0) {
+    printf("parallel list error: %s instead of %s\n", got, want);
+    mismatches++;
+  }
+  free(list);
+
+  // the third item starts 7 bytes into the stream and fails on its second
+  // line, which the error counts from the item
+  pp_parser_t* line = pp_sequence(
+    3,
+    (pp_parser_t*[]){
+      pp_skip_whitespace(),
+      pp_name(pp_span1(pp_class_range('a', 'z')), "word"),
+      pp_char(';'),
+    }
+  );
+  pp_stream_t stream;
+  pp_stream_begin(&stream, pp_many(line), NULL, NULL);
+  pp_stream_feed(&stream, "ab;\ncd", 6);
+  pp_stream_feed(&stream, ";\ne!f;", 6);
+  const int consumed = stream.consumed;
+  pp_stream_end(&stream);
+  pp_parse_n(line, "\ne!f;", 5);
+  const pp_error_t alone = pp_error();
+  pp_error_message(&alone, want, sizeof(want));
+  pp_error_message(&stream.error, got, sizeof(got));
+  if (consumed != 7 || stream.error.pos != alone.pos ||
+      strcmp(want, got) != 0) {
+    printf("stream error: %s at %d of %d\n", got, stream.error.pos, consumed);
+    mismatches++;
+  }
+
+  pp_sweep();
+  return mismatches;
+}
+
+// a stream fed one byte at a time emits each item with the byte that ends it
+static int check_stream() {
+  int mismatches = 0;
+  const char* input = "ab;c;def;";
+  pp_parser_t* item = pp_sequence(
+    2, (pp_parser_t*[]){pp_span1(pp_class_range('a', 'z')), pp_char(';')}
+  );
+  long emitted = 0;
+  long want = 0;
+  pp_stream_t stream;
+  pp_stream_begin(&stream, pp_many(item), count_item, &emitted);
+  for (int i = 0; input[i] != '\0'; ++i) {
+    pp_stream_feed(&stream, &input[i], 1);
+    want += input[i] == ';';
+    if (emitted != want) {
+      printf("stream: %ld items emitted after byte %d\n", emitted, i);
+      mismatches++;
+    }
+  }
+  pp_stream_end(&stream);
+
+  pp_sweep();
+  return mismatches;
+}
+
+// pp_optimize checked against the graphs it rewrites: num_grammars random
+// grammars over short inputs, then the suite grammars over their records and
+// truncated copies of them. last the outputs of check_outputs and the errors
+// of check_errors and check_stream. returns the number of mismatches.
+static int verify(int num_grammars) {
+  pp_tape_t tape;
+  pp_tape_init(&tape);
+  unsigned long seed = 42;
+  int mismatches = 0;
+  int num_inputs = 0;
+
+  for (int g = 0; g < num_grammars; ++g) {
+    pp_parser_t* parser = random_parser(&seed, 4);
+    pp_parser_t* optimized = pp_optimize(parser);
+    pp_program_t* program = pp_compile(optimized);
+    for (int i = 0; i < 16; ++i) {
+      char input[12];
+      const int len = next_random(&seed) % sizeof(input);
+      for (int j = 0; j < len; ++j) {
+        input[j] = verify_bytes[next_random(&seed) % NUM_VERIFY_BYTES];
+      }
+      const int found =
+        verify_input(parser, optimized, program, &tape, input, len);
+      if (found > 0)
+        printf("  in random grammar %d\n", g);
+      mismatches += found;
+      num_inputs++;
+    }
+    pp_sweep();
+  }
+
+  for (int g = 0; g < NUM_SUITE_GRAMMARS; ++g) {
+    const suite_grammar_t* grammar = &suite_grammars[g];
+    suite_corpus_t corpus = suite_corpus(grammar, 1 << 16);
+    pp_parser_t* parser = grammar->parser();
+    pp_parser_t* optimized = pp_optimize(parser);
+    pp_program_t* program = pp_compile(optimized);
+    for (int i = 0; i < corpus.num_records; ++i) {
+      const char* record = corpus.text + corpus.starts[i];
+      const int cut = next_random(&seed) % (corpus.lens[i] + 1);
+      const int found = verify_input(
+                          parser, optimized, program, &tape, record,
+                          corpus.lens[i]
+                        ) +
+                        verify_input(
+                          parser, optimized, program, &tape, record, cut
+                        );
+      if (found > 0)
+        printf("  in %s record %d\n", grammar->name, i);
+      mismatches += found;
+      num_inputs += 2;
+    }
+    suite_corpus_free(&corpus);
+    pp_sweep();
+  }
+
+  mismatches += check_outputs(&tape);
+  mismatches += check_errors();
+  mismatches += check_stream();
+  pp_tape_deinit(&tape);
+  printf(
+    "%d grammars, %d inputs, %d mismatches\n",
+    num_grammars + NUM_SUITE_GRAMMARS, num_inputs, mismatches
+  );
+  return mismatches;
+}
+
+// bytes of text under output
+static long walk_tree(pp_output_t output) {
+  if (output.type != PP_OUTPUT_ARRAY)
+    return output.type == PP_OUTPUT_SLICE ? output.output.slice.len : 0;
+  long len = 0;
+  for (int i = 0; i < output.output.array.len; ++i) {
+    len += walk_tree(output.output.array.values[i]);
+  }
+  return len;
+}
+
+// the same statements parsed to a tree and to a tape, and the time it takes
+// to visit every output of each
+static void bench_tape(size_t size) {
+  char* input = make_input("SELECT id, name, created_at FROM users;\n", size);
+  pp_parser_t* parser = pp_many(pp_sequence(
+    2,
+    (pp_parser_t*[]){
+      sql_select_parser(),
+      pp_whitespace_delimited(pp_char(';')),
+    }
+  ));
+
+  printf(
+    "\n%12s %12s %12s %12s %12s\n", "bytes", "output", "MB/s", "walk ms",
+    "bytes used"
+  );
+
+  aa_arena_t arena = aa_arena_init(1 << 20);
+  pp_set_allocator(aa_arena_make_sweeper(&arena));
+  double start = now();
+  const pp_result_t result = pp_parse_n(parser, input, size);
+  double parsed = now();
+  const long tree_text = walk_tree(result.output);
+  double walked = now();
+  pp_set_default_allocator();
+  printf(
+    "%12zu %12s %11.1fM %12.2f %12zu\n", size, "tree",
+    size / (parsed - start) / (1 << 20), (walked - parsed) * 1e3,
+    aa_arena_used(&arena)
+  );
+  aa_arena_deinit(&arena);
+
+  pp_tape_t tape;
+  pp_tape_init(&tape);
+  start = now();
+  pp_parse_tape(parser, input, size, &tape);
+  parsed = now();
+  long tape_text = 0;
+  for (int i = 0; i < tape.len; ++i) {
+    if (tape.entries[i].type == PP_OUTPUT_SLICE)
+      tape_text += tape.entries[i].len;
+  }
+  walked = now();
+  printf(
+    "%12zu %12s %11.1fM %12.2f %12zu\n", size, "tape",
+    size / (parsed - start) / (1 << 20), (walked - parsed) * 1e3,
+    tape.len * sizeof(pp_tape_entry_t) + tape.strings_len
+  );
+  if (tape_text != tree_text)
+    printf("tape and tree text differ: %ld %ld\n", tape_text, tree_text);
+  pp_tape_deinit(&tape);
+
+  pp_sweep();
+  free(input);
+}
+
+#ifdef PP_PROFILE
+// where a parse of the select statements spends its time, per node
+static void bench_profile(size_t size) {
+  char* input = make_input("SELECT id, name, created_at FROM users;\n", size);
+  pp_parser_t* parser = pp_name(
+    pp_many(pp_sequence(
+      4,
+      (pp_parser_t*[]){
+        pp_name(sql_keyword_parser("SELECT"), "select"),
+        pp_name(
+          pp_choice(
+            2,
+            (pp_parser_t*[]){
+              sql_keyword_parser("*"),
+              pp_comma_separated_list(
+                pp_name(sql_identifier_parser(), "column")
+              ),
+            }
+          ),
+          "select_list"
+        ),
+        pp_name(sql_keyword_parser("FROM"), "from"),
+        pp_name(
+          pp_sequence(
+            2,
+            (pp_parser_t*[]){
+              pp_name(sql_identifier_parser(), "table"),
+              pp_whitespace_delimited(pp_char(';')),
+            }
+          ),
+          "table_end"
+        ),
+      }
+    )),
+    "statements"
+  );
+
+  aa_arena_t arena = aa_arena_init(1 << 20);
+  pp_set_allocator(aa_arena_make_sweeper(&arena));
+  pp_parse_n(parser, input, size);
+  pp_set_default_allocator();
+  aa_arena_deinit(&arena);
+
+  printf("\n");
+  pp_profile_report(parser, stdout);
+  pp_sweep();
+  free(input);
+}
+#endif
+
+// system allocator calls per parse once the arena and scratch stack are warm
+static void bench_mallocs() {
+  const char* query =
+    "SELECT id, name, data, created_at, updated_at FROM some_table";
+  const int num_parses = 10000;
+  aa_arena_t arena = aa_arena_init(1 << 16);
+  pp_parser_t* parser = sql_select_parser();
+
+  pp_set_allocator(aa_arena_make_sweeper(&arena));
+  pp_parse(parser, query);
+  pp_sweep();
+
+  const long before = num_mallocs;
+  for (int i = 0; i < num_parses; ++i) {
+    pp_parse(parser, query);
+    pp_sweep();
+  }
+  const long mallocs = num_mallocs - before;
+  pp_set_default_allocator();
+
+  printf("\n%12s %12s\n", "parses", "mallocs");
+  printf("%12d %12.2f\n", num_parses, (double)mallocs / num_parses);
+
+  aa_arena_deinit(&arena);
+  pp_sweep();
+}
+
+typedef struct {
+  pp_parser_t* parser;
+  const char* input;
+  size_t size;
+  int reps;
+} worker_t;
+
+static void* parse_worker(void* arg) {
+  const worker_t* worker = arg;
+  pp_ctx_t ctx;
+  pp_ctx_init(&ctx);
+  for (int i = 0; i < worker->reps; ++i) {
+    pp_ctx_parse(&ctx, worker->parser, worker->input, worker->size);
+    pp_ctx_sweep(&ctx);
+  }
+  pp_ctx_deinit(&ctx);
+  return NULL;
+}
+
+// one grammar shared by every thread, each parsing with its own context
+static void bench_threads(size_t size, int max_threads) {
+  const int reps = 8;
+  char* input = make_input("SELECT id, name, created_at FROM users;\n", size);
+  pp_parser_t* parser = pp_many(pp_sequence(
+    2,
+    (pp_parser_t*[]){
+      sql_select_parser(),
+      pp_whitespace_delimited(pp_char(';')),
+    }
+  ));
+  worker_t worker = {
+    .parser = parser,
+    .input = input,
+    .size = size,
+    .reps = reps,
+  };
+
+  printf("\n%12s %12s %12s\n", "threads", "MB/s", "speedup");
+  double base = 0;
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    pthread_t threads[num_threads];
+
+    const double start = now();
+    for (int i = 0; i < num_threads; ++i) {
+      pthread_create(&threads[i], NULL, parse_worker, &worker);
+    }
+    for (int i = 0; i < num_threads; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    const double elapsed = now() - start;
+
+    const double mbs = size * reps * num_threads / elapsed / (1 << 20);
+    if (num_threads == 1)
+      base = mbs;
+    printf("%12d %11.1fM %11.2fx\n", num_threads, mbs, mbs / base);
+  }
+
+  pp_sweep();
+  free(input);
+}
+
+// a corpus of independent SQL statements and log lines of varying length
+static void bench_batch(int max_threads) {
+  const int n = 200000;
+  const char* columns[] = {"id", "id, name", "id, name, email, created_at"};
+  const char* levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+  char* corpus = malloc((size_t)n * 96);
+  const char** inputs = malloc(n * sizeof(char*));
+  int* lens = malloc(n * sizeof(int));
+  pp_result_t* results = malloc(n * sizeof(pp_result_t));
+  size_t size = 0;
+  for (int i = 0; i < n; ++i) {
+    inputs[i] = corpus + size;
+    if (i % 2) {
+      lens[i] =
+        sprintf(corpus + size, "SELECT %s FROM t%d", columns[i % 3], i % 97);
+    } else {
+      lens[i] = sprintf(
+        corpus + size, "2024-05-01T12:%02d:%02d.%03d %s request %d took %dms",
+        i / 60 % 60, i % 60, i % 1000, levels[i % 4], i, i % 250
+      );
+    }
+    size += lens[i];
+  }
+
+  pp_parser_t* parser = pp_choice(
+    2,
+    (pp_parser_t*[]){
+      sql_select_parser(),
+      log_line_parser(),
+    }
+  );
+
+  printf("\n%12s %12s %12s %12s\n", "threads", "records/s", "MB/s", "failed");
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    const double start = now();
+    pp_batch_t* batch =
+      pp_parse_batch(parser, inputs, lens, n, results, num_threads);
+    const double elapsed = now() - start;
+
+    int failed = 0;
+    for (int i = 0; i < n; ++i) {
+      failed += results[i].status != PP_OK || results[i].pos != lens[i];
+    }
+    printf(
+      "%12d %12.0f %11.1fM %12d\n", num_threads, n / elapsed,
+      size / elapsed / (1 << 20), failed
+    );
+    pp_batch_sweep(batch);
+  }
+
+  pp_sweep();
+  free(results);
+  free(lens);
+  free(inputs);
+  free(corpus);
+}
+
+// a comma outside quotes right after a closing parenthesis
+static int
+between_rows(const char* from, const char* at, int* quoted, void* arg) {
+  for (const char* c = from; c < at; ++c) {
+    if (*c == '\'')
+      *quoted = !*quoted;
+  }
+  return !*quoted && at[-1] == ')';
+}
+
+// the VALUES list of a bulk INSERT with 100k rows
+static void bench_parallel_list(int max_threads) {
+  const int num_rows = 100000;
+  char* input = malloc((size_t)num_rows * 64);
+  size_t size = 0;
+  for (int i = 0; i < num_rows; ++i) {
+    size += sprintf(
+      input + size, "%s(%d, 'user, %d', %d)", i ? ", " : "", i, i % 977,
+      i * 31 % 1000
+    );
+  }
+
+  pp_parser_t* number = pp_span1(pp_class_range('0', '9'));
+  pp_parser_t* string = pp_sequence(
+    3,
+    (pp_parser_t*[]){
+      pp_char('\''),
+      pp_span(pp_class_complement(pp_class_of("'"))),
+      pp_char('\''),
+    }
+  );
+  pp_parser_t* row = pp_whitespace_delimited(pp_sequence(
+    7,
+    (pp_parser_t*[]){
+      pp_char('('),
+      number,
+      pp_whitespace_delimited(pp_char(',')),
+      string,
+      pp_whitespace_delimited(pp_char(',')),
+      number,
+      pp_char(')'),
+    }
+  ));
+
+  printf("\n%12s %12s %12s %12s\n", "rows", "threads", "ms", "items");
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    pp_parser_t* values =
+      num_threads == 1
+        ? pp_separated_list(row, pp_char(','))
+        : pp_parallel_separated_list(
+            row, pp_char(','), ',', between_rows, NULL, num_threads
+          );
+
+    const double start = now();
+    const pp_result_t result = pp_parse_n(values, input, size);
+    const double elapsed = now() - start;
+
+    printf(
+      "%12d %12d %12.2f %12d\n", num_rows, num_threads, elapsed * 1e3,
+      result.output.output.array.len
+    );
+  }
+
+  pp_sweep();
+  free(input);
+}
+
+static void count_item(pp_output_t output, void* arg) {
+  ++*(long*)arg;
+}
+
+// statements fed in network sized chunks. the buffer only ever holds the
+// statement that is cut off by the end of a chunk.
+static void bench_stream(size_t size) {
+  const int chunk = 1 << 12;
+  char* input = make_input("SELECT id, name, created_at FROM users;\n", size);
+  pp_parser_t* parser = pp_many(pp_sequence(
+    2,
+    (pp_parser_t*[]){
+      sql_select_parser(),
+      pp_whitespace_delimited(pp_char(';')),
+    }
+  ));
+
+  long items = 0;
+  int max_buffer = 0;
+  pp_stream_t stream;
+  pp_stream_begin(&stream, parser, count_item, &items);
+
+  const double start = now();
+  for (size_t i = 0; i < size; i += chunk) {
+    pp_stream_feed(&stream, input + i, size - i < chunk ? size - i : chunk);
+    if (stream.cap > max_buffer)
+      max_buffer = stream.cap;
+  }
+  const pp_result_t result = pp_stream_end(&stream);
+  const double elapsed = now() - start;
+
+  printf(
+    "\n%12s %12s %12s %12s %12s\n", "bytes", "consumed", "items", "MB/s",
+    "max buffer"
+  );
+  printf(
+    "%12zu %12d %12ld %11.1fM %12d\n", size, result.pos, items,
+    size / elapsed / (1 << 20), max_buffer
+  );
+
+  pp_sweep();
+  free(input);
+}
+
+// kilobytes of the given field of /proc/self/status, or -1 where there is no
+// such file
+static long status_kb(const char* field) {
+  FILE* status = fopen("/proc/self/status", "r");
+  if (status == NULL) {
+    return -1;
+  }
+  char line[256];
+  long kb = -1;
+  const size_t len = strlen(field);
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (strncmp(line, field, len) == 0 && line[len] == ':') {
+      kb = strtol(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(status);
+  return kb;
+}
+
+// a log file parsed after reading it into memory and over a mapping. anon is
+// the private memory of the process, which holds the copy made by read, and
+// file the pages of the mapping, which belong to the page cache and can be
+// dropped under memory pressure. each mode runs in a child process so they
+// start from the same memory.
+static void bench_file(size_t size) {
+  const char* line =
+    "2024-05-01T12:00:00.000 INFO request 123456 took 42ms from 10.0.0.1\n";
+  char path[] = "/tmp/pp_bench_XXXXXX";
+  const int fd = mkstemp(path);
+  const size_t chunk = 1 << 20;
+  char* input = make_input(line, chunk);
+  for (size_t i = 0; fd >= 0 && i < size; i += chunk) {
+    const size_t n = size - i < chunk ? size - i : chunk;
+    if (write(fd, input, n) != (ssize_t)n) {
+      printf("\ncould not write %s\n", path);
+      break;
+    }
+  }
+  close(fd);
+  free(input);
+
+  static const char* levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+  pp_parser_t* parser = pp_many(pp_select(
+    pp_sequence(
+      4,
+      (pp_parser_t*[]){
+        pp_span1(pp_class_of("0123456789-:.T")),
+        pp_whitespace_delimited(pp_keywords(4, levels, PP_KEYWORDS_FIRST)),
+        pp_skip(pp_span(pp_class_complement(pp_class_of("\n")))),
+        pp_skip(pp_char('\n')),
+      }
+    ),
+    1
+  ));
+
+  printf(
+    "\n%12s %12s %12s %12s %12s %12s\n", "bytes", "mode", "consumed", "MB/s",
+    "anon rss", "file rss"
+  );
+  fflush(stdout);
+  for (int mapped = 0; mapped < 2; ++mapped) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      pp_ctx_t ctx;
+      pp_ctx_init(&ctx);
+      pp_ctx_use(&ctx);
+
+      const double start = now();
+      pp_result_t result;
+      long anon, file_backed;
+      if (mapped) {
+        pp_file_t file;
+        result = pp_parse_file(parser, path, &file);
+        anon = status_kb("RssAnon");
+        file_backed = status_kb("RssFile");
+        pp_file_close(&file);
+      } else {
+        char* data = malloc(size);
+        const int in = open(path, O_RDONLY);
+        size_t len = 0;
+        for (ssize_t n; (n = read(in, data + len, size - len)) > 0;) {
+          len += n;
+        }
+        close(in);
+        result = pp_parse_n(parser, data, len);
+        anon = status_kb("RssAnon");
+        file_backed = status_kb("RssFile");
+        free(data);
+      }
+      const double elapsed = now() - start;
+
+      printf(
+        "%12zu %12s %12d %11.1fM %11ldK %11ldK\n", size,
+        mapped ? "mmap" : "read", result.pos, size / elapsed / (1 << 20), anon,
+        file_backed
+      );
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+  }
+
+  unlink(path);
+}
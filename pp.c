@@ -1,55 +1,639 @@
 #include "pp.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
 
 #define ARENA_REGION_SIZE 8192
 
-static aa_sweeper_t allocator;
-static aa_sweeper_t default_allocator;
-static aa_arena_t default_arena;
+// used by threads that have not picked a context of their own. it is not
+// locked, so only one thread at a time may use it.
+static pp_ctx_t default_ctx;
+static _Thread_local pp_ctx_t* current;
+
+#define VM_STACK_SIZE 64
+#define MEMO_INIT_CAP 1024
+#define INTERN_INIT_CAP 256
+#define SCRATCH_INIT_CAP 256
+#define BATCH_CHUNK 8
+#define PARALLEL_LIST_MIN_LEN (1 << 16)
+#define STREAM_INIT_CAP 4096
+#define NAMES_INIT_CAP 16
+// how far into the grammar pp_error looks for what a node starts with
+#define EXPECTED_MAX_DEPTH 16
+
+#if defined(__GNUC__)
+#define VM_THREADED
+#endif
+
+// a ref compiled as a subroutine. calls to it made before body is known are
+// chained through their args, like the commits of a choice.
+typedef struct {
+  const pp_parser_t* ref;
+  int body;
+  int calls;
+} compiler_ref_t;
+
+typedef struct {
+  int len;
+  int cap;
+  pp_inst_t* code;
+  int num_refs;
+  int refs_cap;
+  compiler_ref_t* refs;
+} compiler_t;
+
+typedef struct {
+  const pp_inst_t* ip;
+  int pos;
+  int num_values;
+  int num_marks;
+  int num_calls;
+  int num_names;
+  // set by a cut, after which failing goes on past the entry
+  int cut;
+} backtrack_t;
+
 
 static pp_result_t parse(pp_parser_t* parser, pp_state_t state);
+static pp_result_t parse_node(pp_parser_t* parser, pp_state_t state);
+static pp_result_t parse_named(pp_parser_t* parser, pp_state_t state);
+static inline pp_result_t parse_mode(pp_parser_t* parser, pp_state_t state);
+static pp_result_t parse_op(pp_parser_t* parser, pp_state_t state);
+static pp_result_t parse_memo(pp_parser_t* parser, pp_state_t state);
+static pp_result_t parse_expr_node(pp_parser_t* parser, pp_state_t state);
+static pp_result_t parse_expr(const pp_expr_t* expr, pp_state_t state, int min);
+static pp_result_t parse_operand(const pp_expr_t* expr, pp_state_t state);
+static int match_operator(
+  const pp_expr_t* expr, pp_state_t state, int prefix, pp_result_t* result
+);
+static pp_output_t expr_output(pp_state_t state, int len, pp_output_t* values);
+
+// every node reachable from a parser, each once
+typedef struct {
+  int len;
+  int cap;
+  pp_parser_t** nodes;
+  // open addressing set of the same nodes
+  int num_slots;
+  pp_parser_t** slots;
+} node_list_t;
+
+// how the output of a node is used, which decides what a rewrite has to keep
+typedef enum {
+  USE_OUTPUT,
+  // only its text, as under pp_concat_string
+  USE_TEXT,
+  // nothing, as under pp_skip
+  USE_NOTHING,
+} opt_use_t;
+
+typedef struct {
+  const pp_parser_t* parser;
+  opt_use_t use;
+  pp_parser_t* result;
+} opt_entry_t;
+
+// the rewritten node for every node and use seen so far, so shared nodes stay
+// shared
+typedef struct {
+  int len;
+  int num_slots;
+  opt_entry_t* slots;
+  // whether the graph has cuts, which some rewrites have to look for
+  int cuts;
+  // the nodes of the original graph, which keep their own names
+  node_list_t nodes;
+} optimizer_t;
+
+#ifdef PP_PROFILE
+typedef struct {
+  pp_parser_t* parser;
+  const char* label;
+} profile_row_t;
+#endif
+
+// inputs not yet taken from one worker's share
+typedef struct {
+  pthread_mutex_t lock;
+  int begin;
+  int end;
+} batch_queue_t;
+
+typedef struct {
+  pp_parser_t* parser;
+  const char** inputs;
+  const int* lens;
+  pp_result_t* results;
+  pp_batch_t* batch;
+  batch_queue_t* queues;
+} batch_job_t;
+
+typedef struct {
+  batch_job_t* job;
+  int id;
+} batch_worker_t;
+
+// one piece of a parallel list, parsed with a context of its own
+typedef struct {
+  pp_parser_t* parser;
+  pp_state_t state;
+  pp_ctx_t ctx;
+  pp_result_t result;
+  // where the last item starts, or -1, and whether it ran out of input. an
+  // item that ran out before the last one makes the piece unusable.
+  int last;
+  int last_hit_end;
+  int cut_short;
+} list_chunk_t;
+
+static pp_ctx_t* current_ctx();
+static pp_result_t parse_with(
+  pp_ctx_t* ctx, pp_parser_t* parser, const char* input, int len, int flags
+);
+
+static void memo_begin(pp_ctx_t* ctx);
+static void memo_drop(pp_memo_table_t* memo);
+static pp_result_t
+memoized(pp_parser_t* parser, pp_state_t state, pp_memo_stats_t* stats);
+static pp_memo_entry_t* memo_slot(
+  pp_memo_table_t* memo, const pp_parser_t* parser, int pos, int flags
+);
+static void memo_grow(pp_ctx_t* ctx);
+
+static void failure_begin(pp_ctx_t* ctx, const char* input, int len);
+static inline void
+note_failure(pp_ctx_t* ctx, int pos, const pp_parser_t* parser);
+static void note_farthest(pp_ctx_t* ctx, int pos, const pp_parser_t* parser);
+static void note_held(pp_ctx_t* ctx, int pos, const pp_parser_t* parser);
+static void name_push(pp_ctx_t* ctx, const pp_parser_t* parser, int pos);
+static void
+add_expected(pp_error_t* error, const pp_parser_t* parser, int depth);
+static int may_match_empty(const pp_parser_t* parser, int depth);
+static void add_item(pp_error_t* error, pp_expected_t item);
+static int append(char* buf, int size, int len, const char* format, ...);
+static int append_char(
+  char* buf, int size, int len, unsigned char c, const char* special
+);
+static int
+append_expected(char* buf, int size, int len, const pp_expected_t* item);
+
+static pp_parser_t* make_node(const pp_parser_t* node);
+static int is_interned(const pp_parser_t* node);
+static pp_parser_t**
+intern_slot(pp_intern_table_t* intern, const pp_parser_t* node);
+static void intern_grow(pp_ctx_t* ctx);
+static unsigned long node_hash(const pp_parser_t* node);
+static int node_equal(const pp_parser_t* a, const pp_parser_t* b);
+static pp_parser_t* tagged(pp_parser_t* parser, int tag, int token);
+
+static int scratch_reserve(pp_scratch_t* scratch, int n);
+
+static inline int scope_begin(pp_ctx_t* ctx);
+static inline int scope_end(pp_ctx_t* ctx, int outer);
+static void pass_cut(pp_ctx_t* ctx);
+
+static inline int events_mark(pp_state_t state);
+static inline void events_release(pp_state_t state, int mark, int keep);
+static void event_push(
+  pp_state_t state, pp_event_type_t type, int tag, int pos, int len
+);
+static void events_flush(pp_event_log_t* log);
+
+static pp_result_t parse_tape(pp_parser_t* parser, pp_state_t state);
+static int tape_push(
+  pp_tape_t* tape, pp_output_type_t type, int offset, int len, int skip
+);
+static int tape_reserve_string(pp_tape_t* tape, int len);
+static void
+tape_map(pp_tape_t* tape, int at, const pp_map_t* map, int begin, int end);
+static void tape_select(pp_tape_t* tape, int at, int pos);
+static void tape_concat_array(pp_tape_t* tape, int at);
+static void tape_prepend_item(pp_tape_t* tape, int at);
+static void
+tape_concat_string(pp_tape_t* tape, int at, int begin, int limit);
+
+static void* batch_worker(void* arg);
+static int batch_take(batch_job_t* job, int id, int* begin, int* end);
+
+static pp_result_t
+parallel_list(const pp_parallel_list_t* list, pp_state_t state);
+static int find_cuts(
+  const pp_parallel_list_t* list, pp_state_t state, int from, int num_chunks,
+  int* cuts
+);
+static void* parse_chunk(void* arg);
+static int seam_holds(
+  const pp_parallel_list_t* list, pp_state_t state, const list_chunk_t* chunk,
+  int cut
+);
+static void release_chunk(pp_ctx_t* ctx, list_chunk_t* chunk, int keep);
+static void release_retained(pp_ctx_t* ctx);
+
+static void stream_parse(pp_stream_t* stream, int final);
+static void stream_error(pp_stream_t* stream, int pos);
+
+static pp_parser_t** children(pp_parser_t* parser, int* num);
+static void collect_nodes(node_list_t* list, pp_parser_t* parser);
+static int node_list_add(node_list_t* list, pp_parser_t* parser);
+static void node_list_free(node_list_t* list);
+static int node_list_has(const node_list_t* list, const pp_parser_t* parser);
+static int has_taps(pp_parser_t* parser);
+static int has_cut(pp_parser_t* parser);
+static int reaches_cut(pp_parser_t* parser, node_list_t* seen);
+
+static void nullable_nodes(node_list_t* nullable, pp_parser_t* parser);
+static int is_nullable(pp_parser_t* parser, const node_list_t* nullable);
+static int left_reaches(
+  pp_parser_t* parser, const pp_parser_t* ref, const node_list_t* nullable,
+  node_list_t* seen
+);
+static void refresh_dispatch(node_list_t* seen, pp_parser_t* parser);
+
+static pp_parser_t*
+optimize(optimizer_t* opt, pp_parser_t* parser, opt_use_t use);
+static pp_parser_t*
+optimize_node(optimizer_t* opt, pp_parser_t* parser, opt_use_t use);
+static opt_entry_t*
+opt_slot(optimizer_t* opt, const pp_parser_t* parser, opt_use_t use);
+static pp_parser_t*
+optimize_choice(optimizer_t* opt, pp_parser_t* parser, opt_use_t use);
+static int splices(const optimizer_t* opt, pp_parser_t* child);
+static pp_parser_t* make_choice(
+  const optimizer_t* opt, int num_parsers, pp_parser_t** parsers,
+  opt_use_t use
+);
+static pp_parser_t*
+optimize_sequence(optimizer_t* opt, pp_parser_t* parser, opt_use_t use);
+static int fuse_literals(pp_parser_t** parsers, int num_parsers, opt_use_t use);
+static int same_node(const pp_parser_t* a, const pp_parser_t* b);
+static int is_byte_class(const pp_parser_t* parser);
+static int hoistable(const optimizer_t* opt, pp_parser_t* parser);
+static pp_class_t byte_class(const pp_parser_t* parser);
+static pp_parser_t* many_node(pp_parser_t* parser, opt_use_t use);
+static pp_parser_t* recognize_node(pp_parser_t* parser);
+
+#ifdef PP_PROFILE
+static pp_result_t profiled(pp_parser_t* parser, pp_state_t state);
+static long profile_now();
+static void profile_label(
+  pp_parser_t* parser, const char* outer, const char** labels,
+  node_list_t* list, char* buffer, int len
+);
+static int by_self_time(const void* a, const void* b);
+#endif
+
+static int map_file(const char* path, pp_file_t* file);
+
+static inline int class_has(const pp_class_t* cls, unsigned char c);
+static int class_is_full(const pp_class_t* cls);
+static int class_ranges(const pp_class_t* cls, pp_byte_range_t* ranges);
+
+static pp_parser_t* span(pp_class_t cls, int min);
+static const pp_trie_t*
+build_trie(int num_words, const char** words, int flags);
+static int match_keywords(
+  const pp_keywords_t* keywords, const char* ptr, const char* end, int* index,
+  int* at_end
+);
+static void
+first_set(const pp_parser_t* parser, pp_class_t* first, int* nullable);
+static void build_dispatch(pp_choice_t* choice);
+static void build_operators(pp_expr_t* expr);
+static const char*
+scan_span(const pp_span_t* span, const char* ptr, const char* end);
+static const char*
+scan_span_scalar(const pp_span_t* span, const char* ptr, const char* end);
+#ifdef SIMD_X86
+static const char*
+scan_span_sse2(const pp_span_t* span, const char* ptr, const char* end);
+static const char*
+scan_span_avx2(const pp_span_t* span, const char* ptr, const char* end);
+#endif
+
+static void compile(compiler_t* compiler, const pp_parser_t* parser);
+static int
+emit(compiler_t* compiler, pp_opcode_t op, int arg, const pp_parser_t* parser);
+static int emit_test(compiler_t* compiler, const pp_class_t* cls);
+static void patch(compiler_t* compiler, int at);
+static void* grow(void* data, int* cap, size_t size, void* inline_data);
 
 static pp_output_t none();
 static pp_output_t chr(char chr);
-static pp_output_t string(int len, const char* string);
+static pp_output_t slice(int len, const char* ptr);
+static pp_output_t keyword(int index, int len, const char* ptr);
 static pp_output_t array(int len, pp_output_t* values);
 
 static pp_result_t ok(int pos, pp_output_t output, const char* rest);
 static pp_result_t err(int pos, pp_status_t status);
 
 static pp_output_t skip(pp_output_t output, void* arg);
+static const pp_parser_t skip_parser = {
+  .op = PP_OP_MAP,
+  .data.map = {.map = skip},
+};
 static pp_output_t concat_string(pp_output_t output, void* arg);
+static pp_output_t
+concat_text(pp_output_t output, const char* begin, const char* limit);
+static int text_len(pp_output_t output);
+static char* write_text(pp_output_t output, char* dst);
+static int contiguous_text(
+  pp_output_t output, const char* begin, const char* limit, const char** start,
+  const char** end
+);
 static pp_output_t concat_array(pp_output_t output, void* arg);
-static pp_output_t select(pp_output_t output, void* arg);
+static pp_output_t prepend_item(pp_output_t output, void* arg);
+static pp_output_t select_item(pp_output_t output, void* arg);
 static void copy_string_ref(pp_output_t output, void* arg);
 static void copy_string_array_ref(pp_output_t output, void* arg);
 
+void pp_ctx_init(pp_ctx_t* ctx) {
+  *ctx = (pp_ctx_t){.arena = aa_arena_init(ARENA_REGION_SIZE)};
+  ctx->default_allocator = aa_arena_make_sweeper(&ctx->arena);
+  ctx->allocator = ctx->default_allocator;
+}
+
+void pp_ctx_init_allocator(pp_ctx_t* ctx, aa_sweeper_t sweeper) {
+  *ctx = (pp_ctx_t){.allocator = sweeper, .default_allocator = sweeper};
+}
+
+void pp_ctx_deinit(pp_ctx_t* ctx) {
+  release_retained(ctx);
+  aa_arena_deinit(&ctx->arena);
+  free(ctx->scratch.values);
+  ctx->scratch = (pp_scratch_t){0};
+  free(ctx->events.events);
+  ctx->events = (pp_event_log_t){0};
+  free(ctx->names.frames);
+  ctx->names = (pp_name_stack_t){0};
+  ctx->memo = (pp_memo_table_t){0};
+  ctx->intern = (pp_intern_table_t){0};
+}
+
+pp_ctx_t* pp_ctx_use(pp_ctx_t* ctx) {
+  pp_ctx_t* previous = current;
+  current = ctx;
+  return previous;
+}
+
+void pp_ctx_sweep(pp_ctx_t* ctx) {
+  if (ctx->memo.owner == ctx->allocator.sweeper) {
+    ctx->memo.entries = NULL;
+    ctx->memo.cap = 0;
+    ctx->memo.len = 0;
+  }
+  if (ctx->intern.owner == ctx->allocator.sweeper) {
+    ctx->intern.entries = NULL;
+    ctx->intern.cap = 0;
+    ctx->intern.len = 0;
+  }
+  release_retained(ctx);
+  aa_sweeper_sweep(&ctx->allocator);
+}
+
+pp_result_t
+pp_ctx_parse(pp_ctx_t* ctx, pp_parser_t* parser, const char* input, int len) {
+  return parse_with(ctx, parser, input, len, 0);
+}
+
+pp_result_t pp_ctx_recognize(
+  pp_ctx_t* ctx, pp_parser_t* parser, const char* input, int len
+) {
+  return parse_with(ctx, parser, input, len, PP_RECOGNIZE);
+}
+
+pp_batch_t* pp_parse_batch(
+  pp_parser_t* parser, const char** inputs, const int* lens, int n,
+  pp_result_t* results, int num_threads
+) {
+  if (num_threads <= 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads > n) {
+    num_threads = n > 0 ? n : 1;
+  }
+
+  pp_batch_t* batch = malloc(sizeof(pp_batch_t));
+  batch->num_workers = num_threads;
+  batch->ctxs = malloc(num_threads * sizeof(pp_ctx_t));
+  batch->errors = calloc(n > 0 ? n : 1, sizeof(pp_error_t*));
+
+  batch_queue_t* queues = malloc(num_threads * sizeof(batch_queue_t));
+  batch_worker_t* workers = malloc(num_threads * sizeof(batch_worker_t));
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  batch_job_t job = {
+    .parser = parser,
+    .inputs = inputs,
+    .lens = lens,
+    .results = results,
+    .batch = batch,
+    .queues = queues,
+  };
+
+  const int all = current_ctx()->memo.all;
+  for (int i = 0; i < num_threads; ++i) {
+    pp_ctx_init(&batch->ctxs[i]);
+    batch->ctxs[i].memo.all = all;
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].begin = (long)n * i / num_threads;
+    queues[i].end = (long)n * (i + 1) / num_threads;
+    workers[i] = (batch_worker_t){.job = &job, .id = i};
+  }
+
+  // the calling thread is worker 0. the queue of a worker whose thread could
+  // not be created is emptied by the others, since they steal from it.
+  int* started = calloc(num_threads, sizeof(int));
+  for (int i = 1; i < num_threads; ++i) {
+    started[i] =
+      pthread_create(&threads[i], NULL, batch_worker, &workers[i]) == 0;
+  }
+  batch_worker(&workers[0]);
+  for (int i = 1; i < num_threads; ++i) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_mutex_destroy(&queues[i].lock);
+  }
+  free(started);
+  free(threads);
+  free(workers);
+  free(queues);
+  return batch;
+}
+
+void pp_batch_sweep(pp_batch_t* batch) {
+  for (int i = 0; i < batch->num_workers; ++i) {
+    pp_ctx_deinit(&batch->ctxs[i]);
+  }
+  free(batch->ctxs);
+  free(batch->errors);
+  free(batch);
+}
+
+void pp_stream_begin(
+  pp_stream_t* stream, pp_parser_t* parser, pp_emit_t emit, void* arg
+) {
+  *stream = (pp_stream_t){
+    .item = parser->op == PP_OP_MANY ? parser->data.many.parser : parser,
+    .many = parser->op == PP_OP_MANY,
+    .emit = emit,
+    .arg = arg,
+    .buffer = malloc(STREAM_INIT_CAP),
+    .cap = STREAM_INIT_CAP,
+    .status = PP_NEED_MORE,
+  };
+  pp_ctx_init(&stream->ctx);
+  stream->ctx.memo.all = current_ctx()->memo.all;
+}
+
+pp_status_t pp_stream_feed(pp_stream_t* stream, const char* chunk, int len) {
+  if (stream->status != PP_NEED_MORE) {
+    return stream->status;
+  }
+
+  if (stream->len + len > stream->cap) {
+    int cap = stream->cap;
+    while (cap < stream->len + len) {
+      cap *= 2;
+    }
+    stream->buffer = realloc(stream->buffer, cap);
+    stream->cap = cap;
+  }
+  memcpy(stream->buffer + stream->len, chunk, len);
+  stream->len += len;
+
+  // an item cut off by the last chunk stopped at the end of the buffer, so
+  // any new byte may finish it
+  if (len > 0) {
+    stream_parse(stream, 0);
+  }
+  return stream->status;
+}
+
+pp_result_t pp_stream_end(pp_stream_t* stream) {
+  if (stream->status == PP_NEED_MORE) {
+    stream_parse(stream, 1);
+  }
+
+  // like pp_many, a stream of items never fails
+  const pp_status_t status = stream->many ? PP_OK : stream->status;
+  const pp_error_t error = stream->error;
+  const pp_result_t result = {
+    .pos = stream->consumed,
+    .status = status,
+    .output = none(),
+    .rest = NULL,
+  };
+
+  free(stream->buffer);
+  pp_ctx_deinit(&stream->ctx);
+  *stream = (pp_stream_t){.error = error};
+  return result;
+}
+
+pp_result_t
+pp_parse_file(pp_parser_t* parser, const char* path, pp_file_t* file) {
+  if (!map_file(path, file)) {
+    return err(0, PP_ERROR_IO);
+  }
+  if (file->size >= INT_MAX) {
+    pp_file_close(file);
+    return err(0, PP_ERROR_IO);
+  }
+  return pp_parse_n(parser, file->data, file->size);
+}
+
+pp_status_t pp_parse_file_records(
+  pp_parser_t* parser, const char* path, char separator, int num_threads,
+  pp_file_t* file
+) {
+  if (!map_file(path, file)) {
+    return PP_ERROR_IO;
+  }
+
+  const char* ptr = file->data;
+  const char* end = file->data + file->size;
+  int cap = 1024;
+  file->records = malloc(cap * sizeof(char*));
+  file->lens = malloc(cap * sizeof(int));
+  while (ptr < end) {
+    const char* sep = memchr(ptr, separator, end - ptr);
+    const char* record_end = sep != NULL ? sep : end;
+    if (record_end - ptr >= INT_MAX) {
+      pp_file_close(file);
+      return PP_ERROR_IO;
+    }
+    if (file->num_records == cap) {
+      cap *= 2;
+      file->records = realloc(file->records, cap * sizeof(char*));
+      file->lens = realloc(file->lens, cap * sizeof(int));
+    }
+    file->records[file->num_records] = ptr;
+    file->lens[file->num_records] = record_end - ptr;
+    file->num_records++;
+    ptr = record_end + 1;
+  }
+
+  file->results = malloc(file->num_records * sizeof(pp_result_t));
+  file->batch = pp_parse_batch(
+    parser, file->records, file->lens, file->num_records, file->results,
+    num_threads
+  );
+  return PP_OK;
+}
+
+void pp_file_close(pp_file_t* file) {
+  if (file->batch != NULL) {
+    pp_batch_sweep(file->batch);
+  }
+  free(file->records);
+  free(file->lens);
+  free(file->results);
+  if (file->size > 0) {
+    munmap((void*)file->data, file->size);
+  }
+  *file = (pp_file_t){0};
+}
+
 void pp_init_default_allocator() {
-  default_arena = aa_arena_init(ARENA_REGION_SIZE);
-  default_allocator = aa_arena_make_sweeper(&default_arena);
-  pp_set_default_allocator();
+  pp_ctx_init(&default_ctx);
 }
 
 void pp_deinit_default_allocator() {
-  aa_arena_deinit(&default_arena);
+  pp_ctx_deinit(&default_ctx);
 }
 
 void pp_set_default_allocator() {
-  allocator = default_allocator;
+  pp_ctx_t* ctx = current_ctx();
+  ctx->allocator = ctx->default_allocator;
 }
 
 void pp_set_allocator(aa_sweeper_t new_allocator) {
-  allocator = new_allocator;
+  current_ctx()->allocator = new_allocator;
 }
 
 void* pp_alloc(size_t size) {
-  return aa_sweeper_alloc(&allocator, size);
+  return aa_sweeper_alloc(&current_ctx()->allocator, size);
 }
 
 void pp_sweep() {
-  aa_sweeper_sweep(&allocator);
+  pp_ctx_sweep(current_ctx());
 }
 
 char* pp_strdup(const char* str) {
@@ -66,361 +650,4597 @@ char* pp_strndup(const char* str, size_t len) {
   return new_str;
 }
 
-pp_result_t pp_parse(pp_parser_t* parser, const char* input) {
-  const pp_state_t state = pp_init_state(input, 0);
-  return parse(parser, state);
+const char* pp_materialize_string(pp_output_t output) {
+  if (output.type == PP_OUTPUT_STRING) {
+    return output.output.string;
+  }
+  char* str = pp_alloc(text_len(output) + 1);
+  *write_text(output, str) = '\0';
+  return str;
 }
 
-pp_parser_t* pp_init_parser() {
-  pp_parser_t* p = pp_alloc(sizeof(pp_parser_t));
-  if (p == NULL) {
-    // idgaf honestly.
+int pp_output_equal(pp_output_t a, pp_output_t b) {
+  if (a.type != b.type) {
+    return 0;
+  }
+  switch (a.type) {
+  case PP_OUTPUT_CHAR:
+    return a.output.chr == b.output.chr;
+  case PP_OUTPUT_STRING:
+    return strcmp(a.output.string, b.output.string) == 0;
+  case PP_OUTPUT_KEYWORD:
+    if (a.output.keyword.index != b.output.keyword.index)
+      return 0;
+    // fallthrough
+  case PP_OUTPUT_SLICE:
+    return a.output.slice.len == b.output.slice.len &&
+           memcmp(a.output.slice.ptr, b.output.slice.ptr, a.output.slice.len) ==
+             0;
+  case PP_OUTPUT_ARRAY:
+    if (a.output.array.len != b.output.array.len)
+      return 0;
+    for (int i = 0; i < a.output.array.len; ++i) {
+      if (!pp_output_equal(a.output.array.values[i], b.output.array.values[i]))
+        return 0;
+    }
+    return 1;
+  default:
+    return 1;
   }
-  return p;
 }
 
-pp_state_t pp_init_state(const char* input, int pos) {
-  return (pp_state_t){.input = input, .pos = pos};
+pp_result_t pp_parse(pp_parser_t* parser, const char* input) {
+  return pp_parse_n(parser, input, strlen(input));
 }
 
-pp_parser_t* pp_pure() {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_PURE;
-  return p;
+pp_result_t pp_parse_n(pp_parser_t* parser, const char* input, int len) {
+  return parse_with(current_ctx(), parser, input, len, 0);
 }
 
-pp_parser_t* pp_fail() {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_FAIL;
-  return p;
+pp_result_t pp_recognize(pp_parser_t* parser, const char* input, int len) {
+  return parse_with(current_ctx(), parser, input, len, PP_RECOGNIZE);
 }
 
-pp_parser_t* pp_eof() {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_EOF;
-  return p;
+pp_result_t
+pp_recognize_taps(pp_parser_t* parser, const char* input, int len) {
+  return parse_with(
+    current_ctx(), parser, input, len, PP_RECOGNIZE | PP_RECOGNIZE_TAPS
+  );
 }
 
-pp_parser_t* pp_expect(char c) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_EXPECT;
-  p->data.expect.c = c;
-  return p;
+pp_result_t pp_parse_events(
+  pp_parser_t* parser, const char* input, int len, pp_handler_t handler,
+  void* arg
+) {
+  pp_ctx_t* ctx = current_ctx();
+  pp_event_log_t* log = &ctx->events;
+  log->len = 0;
+  log->depth = 0;
+  log->handler = handler;
+  log->arg = arg;
+  const pp_result_t result =
+    parse_with(ctx, parser, input, len, PP_RECOGNIZE | PP_EVENTS);
+  log->len = 0;
+  return result;
 }
 
-pp_parser_t* pp_char(char c) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_STRING;
-  p->data.chr.c = c;
-  return p;
+void pp_tape_init(pp_tape_t* tape) {
+  *tape = (pp_tape_t){0};
 }
 
-pp_parser_t* pp_string(const char* tag) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_STRING;
-  p->data.string.string = pp_strdup(tag);
-  return p;
+void pp_tape_deinit(pp_tape_t* tape) {
+  free(tape->entries);
+  free(tape->strings);
+  *tape = (pp_tape_t){0};
 }
 
-pp_parser_t* pp_string_no_case(const char* tag) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_STRING_NO_CASE;
-  p->data.string.string = pp_strdup(tag);
-  return p;
+pp_result_t pp_parse_tape(
+  pp_parser_t* parser, const char* input, int len, pp_tape_t* tape
+) {
+  pp_ctx_t* ctx = current_ctx();
+  tape->input = input;
+  tape->input_len = len;
+  tape->len = 0;
+  tape->strings_len = 0;
+  ctx->tape = tape;
+  const pp_result_t result = parse_with(ctx, parser, input, len, PP_TAPE);
+  ctx->tape = NULL;
+  return result;
 }
 
-pp_parser_t* pp_any_of(const char* chars) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_ANY_OF;
-  p->data.any_of.chars = pp_strdup(chars);
-  return p;
+void pp_tape_push_output(pp_tape_t* tape, pp_output_t output) {
+  switch (output.type) {
+  case PP_OUTPUT_CHAR:
+    tape_push(tape, PP_OUTPUT_CHAR, (unsigned char)output.output.chr, 1, 0);
+    break;
+
+  case PP_OUTPUT_SLICE:
+  case PP_OUTPUT_KEYWORD: {
+    const char* ptr = output.output.slice.ptr;
+    const int len = output.output.slice.len;
+    const int index =
+      output.type == PP_OUTPUT_KEYWORD ? output.output.keyword.index : 0;
+    // an empty slice has no text to keep, wherever it points
+    if (len == 0) {
+      tape_push(tape, output.type, 0, 0, index);
+      break;
+    }
+    if (ptr >= tape->input && ptr + len <= tape->input + tape->input_len) {
+      tape_push(tape, output.type, ptr - tape->input, len, index);
+      break;
+    }
+    const int offset = tape_reserve_string(tape, len);
+    memcpy(tape->strings + offset, ptr, len);
+    tape_push(tape, PP_OUTPUT_STRING, offset, len, 0);
+    break;
+  }
+
+  case PP_OUTPUT_STRING: {
+    const int len = strlen(output.output.string);
+    const int offset = tape_reserve_string(tape, len);
+    memcpy(tape->strings + offset, output.output.string, len);
+    tape_push(tape, PP_OUTPUT_STRING, offset, len, 0);
+    break;
+  }
+
+  // the header is written once the size of the children is known
+  case PP_OUTPUT_ARRAY: {
+    const int at = tape_push(tape, PP_OUTPUT_ARRAY, 0, 0, 0);
+    for (int i = 0; i < output.output.array.len; ++i) {
+      pp_tape_push_output(tape, output.output.array.values[i]);
+    }
+    tape->entries[at].len = output.output.array.len;
+    tape->entries[at].skip = tape->len - at - 1;
+    break;
+  }
+
+  default:
+    tape_push(tape, PP_OUTPUT_NONE, 0, 0, 0);
+    break;
+  }
 }
 
-pp_parser_t* pp_none_of(const char* chars) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_NONE_OF;
-  p->data.none_of.chars = pp_strdup(chars);
-  return p;
+pp_output_t pp_tape_output(const pp_tape_t* tape, int entry) {
+  const pp_tape_entry_t* e = &tape->entries[entry];
+  switch (e->type) {
+  case PP_OUTPUT_CHAR:
+    return chr(e->offset);
+  case PP_OUTPUT_STRING:
+    return (pp_output_t){
+      .type = PP_OUTPUT_STRING,
+      .output.string = pp_strndup(tape->strings + e->offset, e->len),
+    };
+  case PP_OUTPUT_SLICE:
+    return slice(e->len, tape->input + e->offset);
+  case PP_OUTPUT_KEYWORD:
+    return keyword(e->skip, e->len, tape->input + e->offset);
+  case PP_OUTPUT_ARRAY: {
+    pp_output_t* values = pp_alloc(e->len * sizeof(pp_output_t));
+    int i = 0;
+    for (pp_tape_iter_t it = pp_tape_children(tape, entry); pp_tape_next(&it);)
+      values[i++] = pp_tape_output(tape, it.at);
+    return (pp_output_t){
+      .type = PP_OUTPUT_ARRAY,
+      .output.array = {.len = e->len, .values = values},
+    };
+  }
+  default:
+    return none();
+  }
 }
 
-pp_parser_t* pp_optional(pp_parser_t* parser) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_OPTIONAL;
-  p->data.optional.parser = parser;
-  return p;
+int pp_tape_skip(const pp_tape_t* tape, int entry) {
+  const pp_tape_entry_t* e = &tape->entries[entry];
+  return e->type == PP_OUTPUT_ARRAY ? entry + e->skip + 1 : entry + 1;
 }
 
-pp_parser_t* pp_choice(int num_parsers, pp_parser_t** parsers) {
-  pp_parser_t* p = pp_init_parser();
-  pp_parser_t** parsers_copy = pp_alloc(num_parsers * sizeof(void*));
-  memcpy(parsers_copy, parsers, num_parsers * sizeof(void*));
-  p->op = PP_OP_CHOICE;
-  p->data.choice.num_parsers = num_parsers;
-  p->data.choice.parsers = parsers_copy;
-  return p;
+const char* pp_tape_text(const pp_tape_t* tape, int entry) {
+  const pp_tape_entry_t* e = &tape->entries[entry];
+  switch (e->type) {
+  case PP_OUTPUT_STRING:
+    return tape->strings + e->offset;
+  case PP_OUTPUT_SLICE:
+  case PP_OUTPUT_KEYWORD:
+    return tape->input + e->offset;
+  default:
+    return NULL;
+  }
 }
 
-pp_parser_t* pp_many(pp_parser_t* parser) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_MANY;
-  p->data.many.parser = parser;
-  return p;
+pp_tape_iter_t pp_tape_children(const pp_tape_t* tape, int entry) {
+  return (pp_tape_iter_t){
+    .tape = tape,
+    .at = entry,
+    .next = entry + 1,
+    .end = pp_tape_skip(tape, entry),
+  };
 }
 
-pp_parser_t* pp_sequence(int num_parsers, pp_parser_t** parsers) {
-  pp_parser_t* p = pp_init_parser();
-  pp_parser_t** parsers_copy = pp_alloc(num_parsers * sizeof(void*));
-  memcpy(parsers_copy, parsers, num_parsers * sizeof(void*));
-  p->op = PP_OP_SEQUENCE;
-  p->data.sequence.num_parsers = num_parsers;
-  p->data.sequence.parsers = parsers_copy;
-  return p;
+int pp_tape_next(pp_tape_iter_t* iter) {
+  if (iter->next >= iter->end)
+    return 0;
+  iter->at = iter->next;
+  iter->next = pp_tape_skip(iter->tape, iter->at);
+  return 1;
 }
 
-pp_parser_t*
-pp_map(pp_parser_t* parser, pp_output_t (*map)(pp_output_t, void*), void* arg) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_MAP;
-  p->data.map.parser = parser;
-  p->data.map.map = map;
-  p->data.map.arg = arg;
+pp_parser_t* pp_init_parser() {
+  pp_parser_t* p = pp_alloc(sizeof(pp_parser_t));
+  if (p == NULL) {
+    // idgaf honestly.
+  }
+  *p = (pp_parser_t){0};
   return p;
 }
 
-pp_parser_t*
-pp_tap(pp_parser_t* parser, void (*tap)(pp_output_t, void*), void* arg) {
-  pp_parser_t* p = pp_init_parser();
-  p->op = PP_OP_TAP;
-  p->data.tap.parser = parser;
-  p->data.tap.tap = tap;
-  p->data.tap.arg = arg;
-  return p;
-}
+pp_error_t pp_error() {
+  return pp_ctx_error(current_ctx());
+}
+
+pp_error_t pp_ctx_error(pp_ctx_t* ctx) {
+  const pp_failure_t* failure = &ctx->failure;
+  pp_error_t error = {.pos = failure->pos, .line = 1, .column = 1};
+  const char* ptr = failure->input;
+  const char* end = ptr + failure->pos;
+  while (ptr < end) {
+    const char* newline = memchr(ptr, '\n', end - ptr);
+    if (newline == NULL) {
+      error.column += end - ptr;
+      break;
+    }
+    error.line++;
+    ptr = newline + 1;
+  }
+
+  for (int i = 0; i < failure->num_expected; ++i) {
+    add_expected(&error, failure->expected[i], 0);
+  }
+  return error;
+}
+
+int pp_error_message(const pp_error_t* error, char* buf, int size) {
+  int len =
+    append(buf, size, 0, "line %d, column %d: ", error->line, error->column);
+  if (error->num_expected == 0)
+    return append(buf, size, len, "unexpected input");
+
+  len = append(buf, size, len, "expected ");
+  for (int i = 0; i < error->num_expected; ++i) {
+    if (i > 0)
+      len = append(buf, size, len, i < error->num_expected - 1 ? ", " : " or ");
+    len = append_expected(buf, size, len, &error->expected[i]);
+  }
+  return len;
+}
+
+pp_program_t* pp_compile(pp_parser_t* parser) {
+  compiler_t compiler = {.len = 0, .cap = 0, .code = NULL};
+  compile(&compiler, parser);
+  emit(&compiler, PP_I_HALT, 0, parser);
+
+  // ref bodies go after the program, and may call refs not compiled yet
+  for (int i = 0; i < compiler.num_refs; ++i) {
+    compiler.refs[i].body = compiler.len;
+    compile(&compiler, compiler.refs[i].ref->data.ref.parser);
+    emit(&compiler, PP_I_RETURN, 0, compiler.refs[i].ref);
+    for (int call = compiler.refs[i].calls; call != -1;) {
+      const int next = compiler.code[call].arg;
+      compiler.code[call].arg = compiler.refs[i].body;
+      call = next;
+    }
+  }
+  free(compiler.refs);
+
+  pp_program_t* program = pp_alloc(sizeof(pp_program_t));
+  program->len = compiler.len;
+  program->code = pp_alloc(compiler.len * sizeof(pp_inst_t));
+  memcpy(program->code, compiler.code, compiler.len * sizeof(pp_inst_t));
+  free(compiler.code);
+  return program;
+}
+
+pp_result_t pp_run(pp_program_t* program, const char* input, int len) {
+  return pp_ctx_run(current_ctx(), program, input, len);
+}
+
+// the dispatch loop keeps its stacks on the C stack and only moves them to the
+// heap when a parse nests deeper than VM_STACK_SIZE
+pp_result_t
+pp_ctx_run(pp_ctx_t* ctx, pp_program_t* program, const char* input, int len) {
+  pp_output_t values_inline[VM_STACK_SIZE];
+  backtrack_t backtracks_inline[VM_STACK_SIZE];
+  int marks_inline[VM_STACK_SIZE];
+  int calls_inline[VM_STACK_SIZE];
+
+  pp_output_t* values = values_inline;
+  backtrack_t* backtracks = backtracks_inline;
+  int* marks = marks_inline;
+  int* calls = calls_inline;
+  int num_values = 0, num_backtracks = 0, num_marks = 0, num_calls = 0;
+  int values_cap = VM_STACK_SIZE, backtracks_cap = VM_STACK_SIZE,
+      marks_cap = VM_STACK_SIZE, calls_cap = VM_STACK_SIZE;
+
+  const pp_inst_t* code = program->code;
+  const pp_inst_t* ip = code;
+  pp_ctx_t* const previous = pp_ctx_use(ctx);
+  memo_begin(ctx);
+  failure_begin(ctx, input, len);
+  int pos = 0;
+  // the last failure, held back from ctx->failure while nothing else is noted
+  // at its position. one behind it is dropped and one past it replaces it,
+  // since the farthest failure ends up past it either way.
+  int held_pos = 0;
+  const pp_parser_t* held = NULL;
+  pp_status_t status = PP_ERROR_UNEXPECTED_TOK;
+  pp_result_t result;
+
+#define HOLD_FAILURE(parser)                                                   \
+  do {                                                                         \
+    if (pos > held_pos) {                                                      \
+      held_pos = pos;                                                          \
+      held = (parser);                                                         \
+    } else if (pos == held_pos && held != (parser)) {                          \
+      note_held(ctx, held_pos, held);                                          \
+      held = (parser);                                                         \
+    }                                                                          \
+  } while (0)
+
+#define FLUSH_FAILURE()                                                        \
+  do {                                                                         \
+    note_held(ctx, held_pos, held);                                            \
+    held = NULL;                                                               \
+  } while (0)
+
+#define PUSH_VALUE(value)                                                      \
+  do {                                                                         \
+    if (num_values >= values_cap)                                              \
+      values =                                                                 \
+        grow(values, &values_cap, sizeof(pp_output_t), values_inline);        \
+    values[num_values++] = (value);                                            \
+  } while (0)
+
+#ifdef VM_THREADED
+  static const void* labels[] = {
+    [PP_I_HALT] = &&L_PP_I_HALT,
+    [PP_I_FAIL] = &&L_PP_I_FAIL,
+    [PP_I_PURE] = &&L_PP_I_PURE,
+    [PP_I_EOF] = &&L_PP_I_EOF,
+    [PP_I_EXPECT] = &&L_PP_I_EXPECT,
+    [PP_I_CHAR] = &&L_PP_I_CHAR,
+    [PP_I_STRING] = &&L_PP_I_STRING,
+    [PP_I_STRING_NO_CASE] = &&L_PP_I_STRING_NO_CASE,
+    [PP_I_CLASS] = &&L_PP_I_CLASS,
+    [PP_I_SPAN] = &&L_PP_I_SPAN,
+    [PP_I_KEYWORDS] = &&L_PP_I_KEYWORDS,
+    [PP_I_TEST] = &&L_PP_I_TEST,
+    [PP_I_CHOICE] = &&L_PP_I_CHOICE,
+    [PP_I_COMMIT] = &&L_PP_I_COMMIT,
+    [PP_I_PARTIAL_COMMIT] = &&L_PP_I_PARTIAL_COMMIT,
+    [PP_I_NOT_AT_END] = &&L_PP_I_NOT_AT_END,
+    [PP_I_MARK] = &&L_PP_I_MARK,
+    [PP_I_COLLECT] = &&L_PP_I_COLLECT,
+    [PP_I_ARRAY] = &&L_PP_I_ARRAY,
+    [PP_I_MAP] = &&L_PP_I_MAP,
+    [PP_I_POSITION] = &&L_PP_I_POSITION,
+    [PP_I_CONCAT_STRING] = &&L_PP_I_CONCAT_STRING,
+    [PP_I_TAP] = &&L_PP_I_TAP,
+    [PP_I_TREE] = &&L_PP_I_TREE,
+    [PP_I_CALL] = &&L_PP_I_CALL,
+    [PP_I_RETURN] = &&L_PP_I_RETURN,
+    [PP_I_CUT] = &&L_PP_I_CUT,
+    [PP_I_ENTER] = &&L_PP_I_ENTER,
+    [PP_I_LEAVE] = &&L_PP_I_LEAVE,
+  };
+#define VM_DISPATCH goto* labels[ip->op];
+#define VM_CASE(op) L_##op:
+#define VM_NEXT() goto* labels[ip->op]
+#else
+#define VM_DISPATCH switch (ip->op)
+#define VM_CASE(op) case op:
+#define VM_NEXT() continue
+#endif
+
+  for (;;) {
+    VM_DISPATCH {
+      VM_CASE(PP_I_HALT) {
+        result = ok(pos, values[num_values - 1], input + pos);
+        goto done;
+      }
+
+      VM_CASE(PP_I_FAIL) {
+        goto fail;
+      }
+
+      VM_CASE(PP_I_PURE) {
+        PUSH_VALUE(none());
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_EOF) {
+        if (pos < len)
+          goto expected;
+        PUSH_VALUE(none());
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_EXPECT) {
+        if (pos >= len || input[pos] != (char)ip->arg)
+          goto expected;
+        PUSH_VALUE(none());
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_CHAR) {
+        if (pos >= len || input[pos] != (char)ip->arg)
+          goto expected;
+        PUSH_VALUE(chr(input[pos]));
+        pos++;
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_STRING) {
+        const char* str = ip->parser->data.string.string;
+        const int str_len = ip->parser->data.string.len;
+        if (str_len > len - pos || memcmp(input + pos, str, str_len) != 0)
+          goto expected;
+        PUSH_VALUE(slice(str_len, input + pos));
+        pos += str_len;
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_STRING_NO_CASE) {
+        const char* str = ip->parser->data.string_no_case.string;
+        const int str_len = ip->parser->data.string_no_case.len;
+        if (str_len > len - pos || strncasecmp(input + pos, str, str_len) != 0)
+          goto expected;
+        PUSH_VALUE(slice(str_len, input + pos));
+        pos += str_len;
+        ip++;
+        VM_NEXT();
+      }
+
+      // any_of and none_of share a layout, none_of stores the complement
+      VM_CASE(PP_I_CLASS) {
+        const pp_class_t* cls = &ip->parser->data.any_of.cls;
+        if (pos >= len || !class_has(cls, input[pos]))
+          goto expected;
+        PUSH_VALUE(chr(input[pos]));
+        pos++;
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_SPAN) {
+        const pp_span_t* span = &ip->parser->data.span;
+        const int span_len =
+          scan_span(span, input + pos, input + len) - (input + pos);
+        if (span_len < span->min)
+          goto expected;
+        PUSH_VALUE(slice(span_len, input + pos));
+        pos += span_len;
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_KEYWORDS) {
+        int index;
+        const int keyword_len = match_keywords(
+          &ip->parser->data.keywords, input + pos, input + len, &index, NULL
+        );
+        if (keyword_len < 0)
+          goto expected;
+        PUSH_VALUE(keyword(index, keyword_len, input + pos));
+        pos += keyword_len;
+        ip++;
+        VM_NEXT();
+      }
+
+      // skips an alternative that cannot start with the next byte. only
+      // alternatives that have to consume input are tested, so the end of
+      // the input skips them all. the choice after the test is expected here
+      // for it.
+      VM_CASE(PP_I_TEST) {
+        if (pos >= len || !class_has(ip->cls, input[pos])) {
+          HOLD_FAILURE(ip[1].parser);
+          ip = code + ip->arg;
+        } else {
+          ip++;
+        }
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_CHOICE) {
+        if (num_backtracks >= backtracks_cap)
+          backtracks = grow(
+            backtracks, &backtracks_cap, sizeof(backtrack_t), backtracks_inline
+          );
+        backtracks[num_backtracks++] = (backtrack_t){
+          .ip = code + ip->arg,
+          .pos = pos,
+          .num_values = num_values,
+          .num_marks = num_marks,
+          .num_calls = num_calls,
+          .num_names = ctx->names.len,
+        };
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_COMMIT) {
+        num_backtracks--;
+        ip = code + ip->arg;
+        VM_NEXT();
+      }
+
+      // loops that stop consuming input are treated as a failed iteration,
+      // which ends the loop even when it was cut
+      VM_CASE(PP_I_PARTIAL_COMMIT) {
+        backtrack_t* top = &backtracks[num_backtracks - 1];
+        top->cut = 0;
+        if (top->pos == pos)
+          goto fail;
+        top->pos = pos;
+        top->num_values = num_values;
+        top->num_marks = num_marks;
+        ip = code + ip->arg;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_NOT_AT_END) {
+        if (pos >= len)
+          goto fail;
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_MARK) {
+        if (num_marks >= marks_cap)
+          marks = grow(marks, &marks_cap, sizeof(int), marks_inline);
+        marks[num_marks++] = num_values;
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_COLLECT) {
+        const int mark = marks[--num_marks];
+        const pp_output_t output =
+          array(num_values - mark, &values[mark]);
+        num_values = mark;
+        PUSH_VALUE(output);
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_ARRAY) {
+        num_values -= ip->arg;
+        values[num_values] = array(ip->arg, &values[num_values]);
+        num_values++;
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_MAP) {
+        const pp_map_t* map = &ip->parser->data.map;
+        values[num_values - 1] = map->map(values[num_values - 1], map->arg);
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_POSITION) {
+        PUSH_VALUE(slice(0, input + pos));
+        ip++;
+        VM_NEXT();
+      }
+
+      // the text and below it the position it started at
+      VM_CASE(PP_I_CONCAT_STRING) {
+        num_values--;
+        values[num_values - 1] = concat_text(
+          values[num_values], values[num_values - 1].output.slice.ptr,
+          input + pos
+        );
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_TAP) {
+        const pp_tap_t* tap = &ip->parser->data.tap;
+        tap->tap(values[num_values - 1], tap->arg);
+        ip++;
+        VM_NEXT();
+      }
+
+      // ops without a lowering run through the reference parser
+      VM_CASE(PP_I_TREE) {
+        pp_state_t state = pp_init_state_n(input, len, pos);
+        state.ctx = ctx;
+        ctx->cut = 0;
+        ctx->backtracks = num_backtracks;
+        FLUSH_FAILURE();
+        const pp_result_t tree = parse((pp_parser_t*)ip->parser, state);
+        if (ctx->cut && num_backtracks > 0)
+          backtracks[num_backtracks - 1].cut = 1;
+        if (tree.status != PP_OK) {
+          status = tree.status;
+          goto fail;
+        }
+        PUSH_VALUE(tree.output);
+        pos = tree.pos;
+        ip++;
+        VM_NEXT();
+      }
+
+      // refs are subroutines, so recursion in the grammar only grows the
+      // call stack
+      VM_CASE(PP_I_CALL) {
+        if (num_calls >= calls_cap)
+          calls = grow(calls, &calls_cap, sizeof(int), calls_inline);
+        calls[num_calls++] = ip + 1 - code;
+        ip = code + ip->arg;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_RETURN) {
+        ip = code + calls[--num_calls];
+        VM_NEXT();
+      }
+
+      // the innermost alternative, optional or many iteration is the one
+      // on top, since the last alternative of a choice that can pass a cut
+      // gets an entry too
+      VM_CASE(PP_I_CUT) {
+        if (num_backtracks > 0)
+          backtracks[num_backtracks - 1].cut = 1;
+        PUSH_VALUE(none());
+        ip++;
+        VM_NEXT();
+      }
+
+      // a held failure is noted under the names it was held under
+      VM_CASE(PP_I_ENTER) {
+        FLUSH_FAILURE();
+        name_push(ctx, ip->parser, pos);
+        ip++;
+        VM_NEXT();
+      }
+
+      VM_CASE(PP_I_LEAVE) {
+        FLUSH_FAILURE();
+        ctx->names.len--;
+        ip++;
+        VM_NEXT();
+      }
+    }
+
+  // a leaf failed
+  expected:
+    HOLD_FAILURE(ip->parser);
+  fail:
+    while (num_backtracks > 0 && backtracks[num_backtracks - 1].cut)
+      num_backtracks--;
+    if (num_backtracks == 0) {
+      result = err(pos, status);
+      goto done;
+    }
+    if (ctx->names.len != backtracks[num_backtracks - 1].num_names)
+      FLUSH_FAILURE();
+    const backtrack_t backtrack = backtracks[--num_backtracks];
+    ip = backtrack.ip;
+    pos = backtrack.pos;
+    num_values = backtrack.num_values;
+    num_marks = backtrack.num_marks;
+    num_calls = backtrack.num_calls;
+    ctx->names.len = backtrack.num_names;
+    status = PP_ERROR_UNEXPECTED_TOK;
+  }
+
+#undef HOLD_FAILURE
+#undef FLUSH_FAILURE
+#undef PUSH_VALUE
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef VM_NEXT
+
+done:
+  note_held(ctx, held_pos, held);
+  if (values != values_inline)
+    free(values);
+  if (backtracks != backtracks_inline)
+    free(backtracks);
+  if (marks != marks_inline)
+    free(marks);
+  if (calls != calls_inline)
+    free(calls);
+  pp_ctx_use(previous);
+  return result;
+}
+
+pp_state_t pp_init_state(const char* input, int pos) {
+  return pp_init_state_n(input, strlen(input), pos);
+}
+
+pp_state_t pp_init_state_n(const char* input, int len, int pos) {
+  return (pp_state_t){
+    .input = input,
+    .end = input + len,
+    .pos = pos,
+    .len = len,
+    .flags = 0,
+    .ctx = current_ctx(),
+  };
+}
+
+pp_class_t pp_class_of(const char* chars) {
+  pp_class_t cls = {0};
+  for (const unsigned char* c = (const unsigned char*)chars; *c; ++c) {
+    cls.bits[*c >> 5] |= 1u << (*c & 31);
+  }
+  return cls;
+}
+
+pp_class_t pp_class_range(char lo, char hi) {
+  pp_class_t cls = {0};
+  for (int c = (unsigned char)lo; c <= (unsigned char)hi; ++c) {
+    cls.bits[c >> 5] |= 1u << (c & 31);
+  }
+  return cls;
+}
+
+pp_class_t pp_class_union(pp_class_t a, pp_class_t b) {
+  for (int i = 0; i < 8; ++i) {
+    a.bits[i] |= b.bits[i];
+  }
+  return a;
+}
+
+pp_class_t pp_class_complement(pp_class_t cls) {
+  for (int i = 0; i < 8; ++i) {
+    cls.bits[i] = ~cls.bits[i];
+  }
+  return cls;
+}
+
+int pp_class_has(const pp_class_t* cls, char c) {
+  return class_has(cls, c);
+}
+
+pp_parser_t* pp_pure() {
+  return make_node(&(pp_parser_t){.op = PP_OP_PURE});
+}
+
+pp_parser_t* pp_fail() {
+  return make_node(&(pp_parser_t){.op = PP_OP_FAIL});
+}
+
+pp_parser_t* pp_eof() {
+  return make_node(&(pp_parser_t){.op = PP_OP_EOF});
+}
+
+pp_parser_t* pp_expect(char c) {
+  return make_node(&(pp_parser_t){.op = PP_OP_EXPECT, .data.expect.c = c});
+}
+
+pp_parser_t* pp_char(char c) {
+  return make_node(&(pp_parser_t){.op = PP_OP_CHAR, .data.chr.c = c});
+}
+
+pp_parser_t* pp_string(const char* tag) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_STRING,
+    .data.string = {.string = tag, .len = strlen(tag)},
+  });
+}
+
+pp_parser_t* pp_string_no_case(const char* tag) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_STRING_NO_CASE,
+    .data.string_no_case = {.string = tag, .len = strlen(tag)},
+  });
+}
+
+pp_parser_t* pp_any_of(const char* chars) {
+  return pp_class(pp_class_of(chars));
+}
+
+pp_parser_t* pp_none_of(const char* chars) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_NONE_OF,
+    .data.none_of.cls = pp_class_complement(pp_class_of(chars)),
+  });
+}
+
+pp_parser_t* pp_class(pp_class_t cls) {
+  return make_node(&(pp_parser_t){.op = PP_OP_ANY_OF, .data.any_of.cls = cls});
+}
+
+pp_parser_t* pp_range(char lo, char hi) {
+  return pp_class(pp_class_range(lo, hi));
+}
+
+pp_parser_t* pp_span(pp_class_t cls) {
+  return span(cls, 0);
+}
+
+pp_parser_t* pp_span1(pp_class_t cls) {
+  return span(cls, 1);
+}
+
+pp_parser_t* pp_keywords(int num_words, const char** words, int flags) {
+  pp_parser_t* p = pp_init_parser();
+  p->op = PP_OP_KEYWORDS;
+  p->data.keywords.num_words = num_words;
+  p->data.keywords.flags = flags;
+  p->data.keywords.trie = build_trie(num_words, words, flags);
+  return p;
+}
+
+pp_parser_t* pp_optional(pp_parser_t* parser) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_OPTIONAL,
+    .data.optional.parser = parser,
+  });
+}
+
+pp_parser_t* pp_choice(int num_parsers, pp_parser_t** parsers) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_CHOICE,
+    .data.choice = {.num_parsers = num_parsers, .parsers = parsers},
+  });
+}
+
+pp_parser_t* pp_many(pp_parser_t* parser) {
+  switch (parser->op) {
+  case PP_OP_CHAR:
+    return pp_span(pp_class_range(parser->data.chr.c, parser->data.chr.c));
+  case PP_OP_ANY_OF:
+    return pp_span(parser->data.any_of.cls);
+  case PP_OP_NONE_OF:
+    return pp_span(parser->data.none_of.cls);
+  default:
+    break;
+  }
+
+  return make_node(
+    &(pp_parser_t){.op = PP_OP_MANY, .data.many.parser = parser}
+  );
+}
+
+pp_parser_t* pp_sequence(int num_parsers, pp_parser_t** parsers) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_SEQUENCE,
+    .data.sequence = {.num_parsers = num_parsers, .parsers = parsers},
+  });
+}
+
+pp_parser_t*
+pp_map(pp_parser_t* parser, pp_output_t (*map)(pp_output_t, void*), void* arg) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_MAP,
+    .data.map = {.parser = parser, .map = map, .arg = arg},
+  });
+}
+
+pp_parser_t*
+pp_tap(pp_parser_t* parser, void (*tap)(pp_output_t, void*), void* arg) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_TAP,
+    .data.tap = {.parser = parser, .tap = tap, .arg = arg},
+  });
+}
+
+pp_parser_t* pp_node(pp_parser_t* parser, int tag) {
+  return tagged(parser, tag, 0);
+}
+
+pp_parser_t* pp_token(pp_parser_t* parser, int tag) {
+  return tagged(parser, tag, 1);
+}
+
+// an interned node may stand for structurally equal nodes all over the
+// grammar, so it is named as a copy that is never shared
+pp_parser_t* pp_name(pp_parser_t* parser, const char* name) {
+  if (is_interned(parser)) {
+    pp_parser_t* p = pp_init_parser();
+    *p = *parser;
+    parser = p;
+  }
+  parser->name = name;
+  return parser;
+}
+
+pp_parser_t* pp_ref() {
+  pp_parser_t* p = pp_init_parser();
+  p->op = PP_OP_REF;
+  return p;
+}
+
+// choices built over a ref once it is set dispatch on what its parser starts
+// with, so setting it again would leave them stale
+pp_status_t pp_ref_set(pp_parser_t* ref, pp_parser_t* parser) {
+  if (ref->data.ref.parser != NULL) {
+    return PP_ERROR_REF_SET;
+  }
+
+  node_list_t nullable = {0};
+  node_list_t seen = {0};
+  nullable_nodes(&nullable, parser);
+  const int left_recursive = left_reaches(parser, ref, &nullable, &seen);
+  node_list_free(&seen);
+  node_list_free(&nullable);
+  if (left_recursive) {
+    return PP_ERROR_LEFT_RECURSION;
+  }
+
+  ref->data.ref.parser = parser;
+  refresh_dispatch(&seen, parser);
+  node_list_free(&seen);
+  return PP_OK;
+}
+
+// the operators are copied, and the atom goes in front of their parsers so
+// the children of the node are one array
+pp_parser_t*
+pp_expr(pp_parser_t* atom, int num_operators, const pp_operator_t* operators) {
+  pp_parser_t* p = pp_init_parser();
+  p->op = PP_OP_EXPR;
+  pp_expr_t* expr = &p->data.expr;
+  expr->num_operators = num_operators;
+  expr->parsers = pp_alloc((num_operators + 1) * sizeof(pp_parser_t*));
+  expr->operators = pp_alloc(num_operators * sizeof(pp_operator_t));
+  expr->parsers[0] = atom;
+  for (int i = 0; i < num_operators; ++i) {
+    expr->operators[i] = operators[i];
+    expr->parsers[i + 1] = operators[i].parser;
+  }
+  build_operators(expr);
+  return p;
+}
+
+pp_parser_t* pp_cut() {
+  return make_node(&(pp_parser_t){.op = PP_OP_CUT});
+}
+
+pp_parser_t* pp_commit(pp_parser_t* parser) {
+  return pp_select(pp_sequence(2, (pp_parser_t*[]){parser, pp_cut()}), 0);
+}
+
+pp_parser_t* pp_memo(pp_parser_t* parser) {
+  return make_node(
+    &(pp_parser_t){.op = PP_OP_MEMO, .data.memo.parser = parser}
+  );
+}
+
+void pp_memo_all(int enabled) {
+  current_ctx()->memo.all = enabled;
+}
+
+pp_memo_stats_t pp_memo_stats() {
+  return current_ctx()->memo.stats;
+}
+
+void pp_memo_reset_stats() {
+  current_ctx()->memo.stats = (pp_memo_stats_t){0};
+}
+
+void pp_intern(int enabled) {
+  current_ctx()->intern.enabled = enabled;
+}
+
+int pp_count_nodes(pp_parser_t* parser) {
+  node_list_t list = {0};
+  collect_nodes(&list, parser);
+  const int len = list.len;
+  node_list_free(&list);
+  return len;
+}
+
+pp_parser_t* pp_optimize(pp_parser_t* parser) {
+  optimizer_t opt = {0};
+  collect_nodes(&opt.nodes, parser);
+  for (int i = 0; i < opt.nodes.len && !opt.cuts; ++i) {
+    opt.cuts = opt.nodes.nodes[i]->op == PP_OP_CUT;
+  }
+  pp_parser_t* result = optimize(&opt, parser, USE_OUTPUT);
+  node_list_free(&opt.nodes);
+  free(opt.slots);
+  return result;
+}
+
+#ifdef PP_PROFILE
+
+void pp_profile_reset(pp_parser_t* parser) {
+  node_list_t list = {0};
+  collect_nodes(&list, parser);
+  for (int i = 0; i < list.len; ++i) {
+    list.nodes[i]->profile = (pp_profile_t){0};
+  }
+  node_list_free(&list);
+}
+
+void pp_profile_report(pp_parser_t* parser, FILE* out) {
+  node_list_t list = {0};
+  collect_nodes(&list, parser);
+  const int len = 64;
+  const char** labels = malloc(list.len * sizeof(char*));
+  char* buffer = malloc(list.len * len);
+
+  // found in the same order as the list
+  node_list_t labelled = {0};
+  profile_label(parser, NULL, labels, &labelled, buffer, len);
+  profile_row_t* rows = malloc(list.len * sizeof(profile_row_t));
+  for (int i = 0; i < list.len; ++i) {
+    rows[i] = (profile_row_t){.parser = list.nodes[i], .label = labels[i]};
+  }
+  qsort(rows, list.len, sizeof(profile_row_t), by_self_time);
+
+  fprintf(
+    out, "%10s %10s %10s %10s %10s %12s %12s  %s\n", "self ms", "total ms",
+    "calls", "successes", "failures", "bytes", "backtracked", "parser"
+  );
+  for (int i = 0; i < list.len; ++i) {
+    const pp_profile_t* profile = &rows[i].parser->profile;
+    if (profile->calls == 0)
+      continue;
+    fprintf(
+      out, "%10.3f %10.3f %10ld %10ld %10ld %12ld %12ld  %s\n",
+      profile->self_ns * 1e-6, profile->total_ns * 1e-6, profile->calls,
+      profile->successes, profile->failures, profile->bytes,
+      profile->backtracked, rows[i].label
+    );
+  }
+
+  free(rows);
+  free(buffer);
+  free(labels);
+  node_list_free(&labelled);
+  node_list_free(&list);
+}
+
+#endif
+
+pp_parser_t* pp_skip(pp_parser_t* parser) {
+  return pp_map(parser, skip, NULL);
+}
+
+pp_parser_t* pp_concat_string(int num_parsers, pp_parser_t** parsers) {
+  return pp_map(pp_sequence(num_parsers, parsers), concat_string, NULL);
+}
+
+pp_parser_t* pp_concat_array(int num_parsers, pp_parser_t** parsers) {
+  return pp_map(pp_sequence(num_parsers, parsers), concat_array, NULL);
+}
+
+pp_parser_t* pp_select(pp_parser_t* parser, int pos) {
+  return pp_map(parser, select_item, (void*)(long long)pos);
+}
+
+pp_parser_t* pp_whitespace() {
+  return pp_many(pp_any_of(" \t\n\r"));
+}
+
+pp_parser_t* pp_alpha() {
+  return pp_class(
+    pp_class_union(pp_class_range('A', 'Z'), pp_class_range('a', 'z'))
+  );
+}
+
+pp_parser_t* pp_alphanumeric_or_underscore() {
+  pp_class_t cls =
+    pp_class_union(pp_class_range('A', 'Z'), pp_class_range('a', 'z'));
+  cls = pp_class_union(cls, pp_class_range('0', '9'));
+  return pp_class(pp_class_union(cls, pp_class_of("_")));
+}
+
+pp_parser_t* pp_skip_whitespace() {
+  return pp_map(pp_whitespace(), skip, NULL);
+}
+
+pp_parser_t* pp_whitespace_delimited(pp_parser_t* parser) {
+  return pp_select(
+    pp_sequence(
+      3,
+      (pp_parser_t*[]){
+        pp_skip_whitespace(),
+        parser,
+        pp_skip_whitespace(),
+      }
+    ),
+    1
+  );
+}
+
+pp_parser_t* pp_separated_list(pp_parser_t* item, pp_parser_t* separator) {
+  return pp_map(
+    pp_sequence(
+      2,
+      (pp_parser_t*[]){
+        item,
+        pp_many(pp_select(
+          pp_sequence(
+            2,
+            (pp_parser_t*[]){
+              separator,
+              item,
+            }
+          ),
+          1
+        )),
+      }
+    ),
+    prepend_item, NULL
+  );
+}
+
+pp_parser_t* pp_comma_separated_list(pp_parser_t* parser) {
+  return pp_separated_list(parser, pp_string(","));
+}
+
+pp_parser_t* pp_parallel_separated_list(
+  pp_parser_t* item, pp_parser_t* separator, char split_char, pp_split_t split,
+  void* arg, int num_threads
+) {
+  pp_parser_t* next = pp_select(
+    pp_sequence(
+      2,
+      (pp_parser_t*[]){
+        separator,
+        item,
+      }
+    ),
+    1
+  );
+
+  pp_parser_t* p = pp_init_parser();
+  p->op = PP_OP_PARALLEL_LIST;
+  p->data.parallel_list.item = item;
+  p->data.parallel_list.next = next;
+  p->data.parallel_list.list = pp_map(
+    pp_sequence(
+      2,
+      (pp_parser_t*[]){
+        item,
+        pp_many(next),
+      }
+    ),
+    prepend_item, NULL
+  );
+  p->data.parallel_list.split_char = split_char;
+  p->data.parallel_list.split = split;
+  p->data.parallel_list.arg = arg;
+  p->data.parallel_list.num_threads = num_threads;
+  return p;
+}
+
+pp_parser_t* pp_copy_string_ref(pp_parser_t* parser, const char** str_ref) {
+  return pp_tap(parser, copy_string_ref, (void*)str_ref);
+}
+
+pp_parser_t* pp_copy_string_array_ref(pp_parser_t* parser, void* len_arr_ref) {
+  return pp_tap(parser, copy_string_array_ref, (void*)len_arr_ref);
+}
+
+static pp_ctx_t* current_ctx() {
+  return current != NULL ? current : &default_ctx;
+}
+
+// ctx is current for the length of the parse, so maps and taps that allocate
+// get its allocator
+static pp_result_t parse_with(
+  pp_ctx_t* ctx, pp_parser_t* parser, const char* input, int len, int flags
+) {
+  pp_ctx_t* const previous = pp_ctx_use(ctx);
+  pp_state_t state = pp_init_state_n(input, len, 0);
+  state.flags = flags;
+  memo_begin(ctx);
+  failure_begin(ctx, input, len);
+  const pp_result_t result = parse(parser, state);
+  pp_ctx_use(previous);
+  return result;
+}
+
+static pp_result_t parse(pp_parser_t* parser, pp_state_t state) {
+#ifdef PP_PROFILE
+  return profiled(parser, state);
+#else
+  return parse_node(parser, state);
+#endif
+}
+
+// plain nodes go straight to their op, the rest take the way through
+// parse_named
+static pp_result_t parse_node(pp_parser_t* parser, pp_state_t state) {
+  if (parser->name == NULL && !(state.flags & PP_TAPE) &&
+      !state.ctx->memo.all)
+    return parse_op(parser, state);
+  return parse_named(parser, state);
+}
+
+// failures at the start of a named node are reported as the node failing.
+// out of line, so parse_node stays as cheap for plain nodes as it was.
+__attribute__((noinline)) static pp_result_t
+parse_named(pp_parser_t* parser, pp_state_t state) {
+  if (parser->name == NULL)
+    return parse_mode(parser, state);
+  name_push(state.ctx, parser, state.pos);
+  const pp_result_t result = parse_mode(parser, state);
+  state.ctx->names.len--;
+  return result;
+}
+
+static inline pp_result_t parse_mode(pp_parser_t* parser, pp_state_t state) {
+  if (state.flags & PP_TAPE)
+    return parse_tape(parser, state);
+  if (state.ctx->memo.all && parser->op >= PP_OP_OPTIONAL &&
+      parser->op <= PP_OP_TAP && !(state.flags & PP_EVENTS))
+    return memoized(parser, state, NULL);
+  return parse_op(parser, state);
+}
+
+static pp_result_t parse_op(pp_parser_t* parser, pp_state_t state) {
+  const char* input = state.input;
+  const int pos = state.pos;
+  const int input_len = state.len;
+
+  switch (parser->op) {
+  case PP_OP_PURE:
+    return ok(pos, none(), input + pos);
+
+  // leaves that run out of input set hit_end, since more input could change
+  // their result
+  case PP_OP_EOF:
+    if (pos >= input_len) {
+      state.ctx->hit_end = 1;
+      return ok(pos, none(), input + pos);
+    }
+    break;
+
+  case PP_OP_EXPECT:
+    if (pos < input_len && input[pos] == parser->data.expect.c)
+      return ok(pos, none(), input + pos + 1);
+    state.ctx->hit_end |= pos >= input_len;
+    break;
+
+  case PP_OP_CHAR:
+    if (pos < input_len && input[pos] == parser->data.chr.c)
+      return ok(pos + 1, chr(input[pos]), input + pos + 1);
+    state.ctx->hit_end |= pos >= input_len;
+    break;
+
+  case PP_OP_STRING: {
+    const char* str = parser->data.string.string;
+    const int len = parser->data.string.len;
+    if (len <= input_len - pos && memcmp(input + pos, str, len) == 0)
+      return ok(pos + len, slice(len, &input[pos]), input + pos + len);
+    state.ctx->hit_end |= len > input_len - pos;
+    break;
+  }
+
+  case PP_OP_STRING_NO_CASE: {
+    const char* str = parser->data.string_no_case.string;
+    const int len = parser->data.string_no_case.len;
+    if (len <= input_len - pos && strncasecmp(input + pos, str, len) == 0)
+      return ok(pos + len, slice(len, &input[pos]), input + pos + len);
+    state.ctx->hit_end |= len > input_len - pos;
+    break;
+  }
+
+  case PP_OP_ANY_OF:
+    if (pos < input_len && class_has(&parser->data.any_of.cls, input[pos]))
+      return ok(pos + 1, chr(input[pos]), input + pos + 1);
+    state.ctx->hit_end |= pos >= input_len;
+    break;
+
+  case PP_OP_NONE_OF:
+    if (pos < input_len && class_has(&parser->data.none_of.cls, input[pos]))
+      return ok(pos + 1, chr(input[pos]), input + pos + 1);
+    state.ctx->hit_end |= pos >= input_len;
+    break;
+
+  case PP_OP_SPAN: {
+    const pp_span_t* span = &parser->data.span;
+    const int len = scan_span(span, input + pos, state.end) - (input + pos);
+    state.ctx->hit_end |= pos + len >= input_len;
+    if (len >= span->min)
+      return ok(pos + len, slice(len, &input[pos]), input + pos + len);
+    break;
+  }
+
+  case PP_OP_KEYWORDS: {
+    int index, at_end;
+    const int len = match_keywords(
+      &parser->data.keywords, input + pos, state.end, &index, &at_end
+    );
+    state.ctx->hit_end |= at_end;
+    if (len >= 0)
+      return ok(pos + len, keyword(index, len, &input[pos]), input + pos + len);
+    break;
+  }
+
+  case PP_OP_CUT:
+    pass_cut(state.ctx);
+    return ok(pos, none(), input + pos);
+
+  case PP_OP_OPTIONAL: {
+    const int mark = events_mark(state);
+    const int outer = scope_begin(state.ctx);
+    pp_result_t result = parse(parser->data.optional.parser, state);
+    const int cut = scope_end(state.ctx, outer);
+    events_release(state, mark, result.status == PP_OK);
+    if (result.status == PP_ERROR_UNEXPECTED_TOK && !cut)
+      return ok(pos, none(), input + pos);
+    else
+      return result;
+  }
+
+  // only the alternatives that can start with the next byte are tried. the
+  // ones skipped on the way are expected here, as with the tests of a
+  // program, which only the last alternative does not get.
+  case PP_OP_CHOICE: {
+    const pp_choice_t* choice = &parser->data.choice;
+    const int c = pos < input_len ? (unsigned char)input[pos] : 256;
+    state.ctx->hit_end |= c == 256;
+    int next = 0;
+    for (int i = choice->dispatch[c]; i < choice->dispatch[c + 1]; ++i) {
+      const int alternative = choice->alternatives[i];
+      if (alternative > next)
+        note_failure(state.ctx, pos, parser);
+      next = alternative + 1;
+      pp_parser_t* p = choice->parsers[alternative];
+      const int mark = events_mark(state);
+      const int outer = scope_begin(state.ctx);
+      pp_result_t result = parse(p, state);
+      const int cut = scope_end(state.ctx, outer);
+      events_release(state, mark, result.status == PP_OK);
+      if (result.status == PP_OK) {
+        return result;
+      }
+      if (cut)
+        return err(pos, PP_ERROR_UNEXPECTED_TOK);
+    }
+    if (next < choice->num_parsers - 1)
+      note_failure(state.ctx, pos, parser);
+    else if (next == choice->num_parsers - 1)
+      note_failure(state.ctx, pos, choice->parsers[next]);
+    return err(pos, PP_ERROR_UNEXPECTED_TOK);
+  }
+
+  case PP_OP_MANY: {
+    if (state.flags & PP_RECOGNIZE) {
+      while (state.pos < input_len) {
+        const int mark = events_mark(state);
+        const int outer = scope_begin(state.ctx);
+        const pp_result_t result = parse(parser->data.many.parser, state);
+        const int cut = scope_end(state.ctx, outer);
+        events_release(
+          state, mark, result.status == PP_OK && result.pos != state.pos
+        );
+        if (result.status != PP_OK && cut)
+          return err(state.pos, result.status);
+        if (result.status != PP_OK || result.pos == state.pos) {
+          break;
+        }
+        state.pos = result.pos;
+      }
+      state.ctx->hit_end |= state.pos >= input_len;
+      return ok(state.pos, none(), input + state.pos);
+    }
+
+    // items go on the scratch stack and are copied to the arena once
+    pp_scratch_t* scratch = &state.ctx->scratch;
+    const int base = scratch_reserve(scratch, 0);
+
+    while (state.pos < input_len) {
+      const int outer = scope_begin(state.ctx);
+      const pp_result_t result = parse(parser->data.many.parser, state);
+      if (scope_end(state.ctx, outer) && result.status != PP_OK) {
+        scratch->len = base;
+        return err(state.pos, result.status);
+      }
+      if (result.status != PP_OK || result.pos == state.pos) {
+        break;
+      }
+
+      const int at = scratch_reserve(scratch, 1);
+      scratch->values[at] = result.output;
+      state.pos = result.pos;
+    }
+    state.ctx->hit_end |= state.pos >= input_len;
+
+    const pp_output_t output =
+      array(scratch->len - base, scratch->values + base);
+    scratch->len = base;
+    return ok(state.pos, output, input + pos);
+  }
+
+  case PP_OP_SEQUENCE: {
+    int num_parsers = parser->data.sequence.num_parsers;
+    pp_parser_t** parsers = parser->data.sequence.parsers;
+
+    if (state.flags & PP_RECOGNIZE) {
+      for (int i = 0; i < num_parsers; ++i) {
+        const pp_result_t result = parse(parsers[i], state);
+        if (result.status != PP_OK) {
+          return err(state.pos, result.status);
+        }
+        state.pos = result.pos;
+      }
+      return ok(state.pos, none(), input + state.pos);
+    }
+
+    // children push above the reserved slots, and a failed sequence leaves
+    // nothing behind in the arena
+    pp_scratch_t* scratch = &state.ctx->scratch;
+    const int base = scratch_reserve(scratch, num_parsers);
+
+    for (int i = 0; i < num_parsers; ++i) {
+      pp_parser_t* p = parsers[i];
+      pp_result_t result = parse(p, state);
+
+      if (result.status != PP_OK) {
+        scratch->len = base;
+        return err(state.pos, result.status);
+      }
+
+      scratch->values[base + i] = result.output;
+      state.pos = result.pos;
+    }
+
+    const pp_output_t output = array(num_parsers, scratch->values + base);
+    scratch->len = base;
+    return ok(state.pos, output, input + state.pos);
+  }
+  case PP_OP_MAP: {
+    const pp_map_t* map = &parser->data.map;
+    pp_result_t result = parse(map->parser, state);
+    if (result.status != PP_OK || (state.flags & PP_RECOGNIZE))
+      return result;
+    // concat_string is given the input it consumed, so chars can be sliced
+    if (map->map == concat_string)
+      result.output =
+        concat_text(result.output, input + pos, input + result.pos);
+    else
+      result.output = map->map(result.output, map->arg);
+    return result;
+  }
+  case PP_OP_TAP: {
+    if (state.flags & PP_RECOGNIZE) {
+      if (state.flags & PP_RECOGNIZE_TAPS) {
+        pp_state_t tap_state = state;
+        tap_state.flags = 0;
+        pp_result_t result = parse(parser->data.tap.parser, tap_state);
+        if (result.status == PP_OK) {
+          parser->data.tap.tap(result.output, parser->data.tap.arg);
+          result.output = none();
+        }
+        return result;
+      }
+      return parse(parser->data.tap.parser, state);
+    }
+
+    pp_result_t result = parse(parser->data.tap.parser, state);
+    if (result.status == PP_OK) {
+      parser->data.tap.tap(result.output, parser->data.tap.arg);
+    }
+    return result;
+  }
+  // per node stats would be written by every thread sharing the grammar, so
+  // they are only kept in the default context. the child is not parsed
+  // through parse_node, so its name is pushed here.
+  case PP_OP_MEMO:
+    return parse_memo(parser, state);
+  case PP_OP_PARALLEL_LIST:
+    return parallel_list(&parser->data.parallel_list, state);
+  case PP_OP_REF:
+    if (parser->data.ref.parser == NULL)
+      return err(pos, PP_ERROR_UNEXPECTED_TOK);
+    return parse(parser->data.ref.parser, state);
+  case PP_OP_EXPR:
+    return parse_expr_node(parser, state);
+  // events inside still count, everything else about the output is dropped
+  case PP_OP_RECOGNIZE: {
+    pp_state_t inner = state;
+    inner.flags = (state.flags & PP_EVENTS) | PP_RECOGNIZE;
+    pp_result_t result = parse(parser->data.recognize.parser, inner);
+    result.output = none();
+    return result;
+  }
+  // a token is a leaf as far as events go, so its inside is only recognized
+  case PP_OP_TAGGED: {
+    const pp_tagged_t* tagged = &parser->data.tagged;
+    if (!(state.flags & PP_EVENTS))
+      return parse(tagged->parser, state);
+    if (tagged->token) {
+      pp_state_t token_state = state;
+      token_state.flags &= ~PP_EVENTS;
+      const pp_result_t result = parse(tagged->parser, token_state);
+      if (result.status == PP_OK)
+        event_push(state, PP_EVENT_TOKEN, tagged->tag, pos, result.pos - pos);
+      return result;
+    }
+    event_push(state, PP_EVENT_ENTER, tagged->tag, pos, 0);
+    const pp_result_t result = parse(tagged->parser, state);
+    if (result.status == PP_OK)
+      event_push(state, PP_EVENT_LEAVE, tagged->tag, pos, result.pos - pos);
+    return result;
+  }
+  default:
+    return err(pos, PP_ERROR_UNKNOWN_OP);
+  }
+  // only leaves get here
+  note_failure(state.ctx, pos, parser);
+  return err(pos, PP_ERROR_UNEXPECTED_TOK);
+}
+
+// the child is parsed without parse_node, so its name is tracked here
+static pp_result_t parse_memo(pp_parser_t* parser, pp_state_t state) {
+  pp_parser_t* child = parser->data.memo.parser;
+  if (state.flags & PP_EVENTS)
+    return parse(child, state);
+  if (child->name != NULL)
+    name_push(state.ctx, child, state.pos);
+  const pp_result_t result = memoized(
+    child, state, state.ctx == &default_ctx ? &parser->data.memo.stats : NULL
+  );
+  if (child->name != NULL)
+    state.ctx->names.len--;
+  return result;
+}
+
+// operators skipped for the next byte are not noted as they are passed, so
+// an expression that fails is expected as a whole
+static pp_result_t parse_expr_node(pp_parser_t* parser, pp_state_t state) {
+  const pp_result_t result = parse_expr(&parser->data.expr, state, INT_MIN);
+  if (result.status == PP_ERROR_UNEXPECTED_TOK)
+    note_failure(state.ctx, state.pos, parser);
+  return result;
+}
+
+// precedence climbing: an operand, then every operator after it that binds
+// at least as tightly as min. an infix operator takes the operand to its
+// right at its own precedence, one higher when it is left associative, and
+// an operator whose right operand does not parse ends the expression before
+// it, as an iteration of a many would.
+static pp_result_t
+parse_expr(const pp_expr_t* expr, pp_state_t state, int min) {
+  pp_result_t lhs = parse_operand(expr, state);
+  if (lhs.status != PP_OK)
+    return lhs;
+
+  for (;;) {
+    state.pos = lhs.pos;
+    const int mark = events_mark(state);
+    const int outer = scope_begin(state.ctx);
+    pp_result_t token;
+    const int i = match_operator(expr, state, 0, &token);
+    if (i == -1 || expr->operators[i].precedence < min) {
+      const int cut = scope_end(state.ctx, outer);
+      events_release(state, mark, 0);
+      if (i == -1 && cut)
+        return err(state.pos, PP_ERROR_UNEXPECTED_TOK);
+      return lhs;
+    }
+
+    const pp_operator_t* op = &expr->operators[i];
+    if (op->fixity == PP_POSTFIX) {
+      scope_end(state.ctx, outer);
+      events_release(state, mark, 1);
+      lhs.output =
+        expr_output(state, 2, (pp_output_t[]){lhs.output, token.output});
+      lhs.pos = token.pos;
+      lhs.rest = state.input + token.pos;
+      continue;
+    }
+
+    pp_state_t right = state;
+    right.pos = token.pos;
+    const pp_result_t rhs = parse_expr(
+      expr, right,
+      op->fixity == PP_INFIX_LEFT ? op->precedence + 1 : op->precedence
+    );
+    const int cut = scope_end(state.ctx, outer);
+    events_release(state, mark, rhs.status == PP_OK);
+    if (rhs.status != PP_OK)
+      return cut ? rhs : lhs;
+    lhs.output = expr_output(
+      state, 3, (pp_output_t[]){lhs.output, token.output, rhs.output}
+    );
+    lhs.pos = rhs.pos;
+    lhs.rest = rhs.rest;
+  }
+}
+
+// a prefix operator and what it applies to, or else the atom
+static pp_result_t parse_operand(const pp_expr_t* expr, pp_state_t state) {
+  const int mark = events_mark(state);
+  const int outer = scope_begin(state.ctx);
+  pp_result_t token;
+  pp_result_t operand = err(state.pos, PP_ERROR_UNEXPECTED_TOK);
+  const int i = match_operator(expr, state, 1, &token);
+  if (i != -1) {
+    pp_state_t right = state;
+    right.pos = token.pos;
+    operand = parse_expr(expr, right, expr->operators[i].precedence);
+  }
+  const int cut = scope_end(state.ctx, outer);
+  events_release(state, mark, operand.status == PP_OK);
+  if (operand.status == PP_OK) {
+    operand.output = expr_output(
+      state, 2, (pp_output_t[]){token.output, operand.output}
+    );
+    return operand;
+  }
+  if (cut)
+    return operand;
+  return parse(expr->parsers[0], state);
+}
+
+// the first prefix operator, or the first of the others, that consumes input
+// at state.pos, or -1. only the operators that can start with the next byte
+// are tried, and none after one that failed past a cut.
+static int match_operator(
+  const pp_expr_t* expr, pp_state_t state, int prefix, pp_result_t* result
+) {
+  if (state.pos >= state.len) {
+    state.ctx->hit_end = 1;
+    return -1;
+  }
+  const unsigned char c = state.input[state.pos];
+  if (!class_has(prefix ? &expr->prefixes : &expr->suffixes, c))
+    return -1;
+
+  for (int i = 0; i < expr->num_operators; ++i) {
+    if ((expr->operators[i].fixity == PP_PREFIX) != prefix ||
+        !class_has(&expr->firsts[i], c))
+      continue;
+    const int mark = events_mark(state);
+    *result = parse(expr->parsers[i + 1], state);
+    const int matched = result->status == PP_OK && result->pos > state.pos;
+    events_release(state, mark, matched);
+    if (matched)
+      return i;
+    if (state.ctx->cut)
+      break;
+  }
+  return -1;
+}
+
+static pp_output_t expr_output(pp_state_t state, int len, pp_output_t* values) {
+  if (state.flags & PP_RECOGNIZE)
+    return none();
+  return array(len, values);
+}
+
+// the outputs go to the tape, and what every parser returns is the entry it
+// wrote at the old end of the tape. a parser that fails leaves the tape as it
+// found it.
+static pp_result_t parse_tape(pp_parser_t* parser, pp_state_t state) {
+  pp_tape_t* tape = state.ctx->tape;
+  const char* input = state.input;
+  const int pos = state.pos;
+  const int at = tape->len;
+
+  switch (parser->op) {
+  case PP_OP_OPTIONAL: {
+    const int outer = scope_begin(state.ctx);
+    pp_result_t result = parse(parser->data.optional.parser, state);
+    const int cut = scope_end(state.ctx, outer);
+    if (result.status == PP_ERROR_UNEXPECTED_TOK && !cut) {
+      tape_push(tape, PP_OUTPUT_NONE, 0, 0, 0);
+      return ok(pos, none(), input + pos);
+    }
+    return result;
+  }
+
+  // a failed alternative leaves nothing behind, so the choice is unchanged
+  case PP_OP_CHOICE:
+  case PP_OP_TAGGED:
+  case PP_OP_REF:
+    return parse_op(parser, state);
+
+  case PP_OP_MANY: {
+    tape_push(tape, PP_OUTPUT_ARRAY, 0, 0, 0);
+    int len = 0;
+    while (state.pos < state.len) {
+      const int item = tape->len;
+      const int outer = scope_begin(state.ctx);
+      const pp_result_t result = parse(parser->data.many.parser, state);
+      if (scope_end(state.ctx, outer) && result.status != PP_OK) {
+        tape->len = at;
+        return err(state.pos, result.status);
+      }
+      if (result.status != PP_OK || result.pos == state.pos) {
+        tape->len = item;
+        break;
+      }
+      len++;
+      state.pos = result.pos;
+    }
+    state.ctx->hit_end |= state.pos >= state.len;
+    tape->entries[at].len = len;
+    tape->entries[at].skip = tape->len - at - 1;
+    return ok(state.pos, none(), input + pos);
+  }
+
+  case PP_OP_SEQUENCE: {
+    const int num_parsers = parser->data.sequence.num_parsers;
+    tape_push(tape, PP_OUTPUT_ARRAY, 0, num_parsers, 0);
+    for (int i = 0; i < num_parsers; ++i) {
+      const pp_result_t result =
+        parse(parser->data.sequence.parsers[i], state);
+      if (result.status != PP_OK) {
+        tape->len = at;
+        return err(state.pos, result.status);
+      }
+      state.pos = result.pos;
+    }
+    tape->entries[at].skip = tape->len - at - 1;
+    return ok(state.pos, none(), input + state.pos);
+  }
+
+  case PP_OP_MAP: {
+    const pp_result_t result = parse(parser->data.map.parser, state);
+    if (result.status == PP_OK)
+      tape_map(tape, at, &parser->data.map, state.pos, result.pos);
+    return result;
+  }
+
+  case PP_OP_TAP: {
+    const pp_result_t result = parse(parser->data.tap.parser, state);
+    if (result.status == PP_OK)
+      parser->data.tap.tap(pp_tape_output(tape, at), parser->data.tap.arg);
+    return result;
+  }
+
+  // an operand is wrapped only once the operator after it is seen, which a
+  // pre-order tape cannot do in place, so the tree is built and then copied
+  case PP_OP_EXPR: {
+    pp_state_t tree_state = state;
+    tree_state.flags &= ~PP_TAPE;
+    pp_result_t result = parse_op(parser, tree_state);
+    if (result.status == PP_OK) {
+      pp_tape_push_output(tape, result.output);
+      result.output = none();
+    }
+    return result;
+  }
+
+  // cached results would need their entries copied, and the pieces of a
+  // parallel list are parsed with contexts of their own
+  case PP_OP_MEMO:
+    return parse(parser->data.memo.parser, state);
+  case PP_OP_PARALLEL_LIST:
+    return parse(parser->data.parallel_list.list, state);
+
+  default: {
+    pp_result_t result = parse_op(parser, state);
+    if (result.status == PP_OK) {
+      pp_tape_push_output(tape, result.output);
+      result.output = none();
+    }
+    return result;
+  }
+  }
+}
+
+// every parse starts here, outside of any alternative
+static void memo_begin(pp_ctx_t* ctx) {
+  pp_memo_table_t* memo = &ctx->memo;
+  if (memo->owner != ctx->allocator.sweeper) {
+    memo->owner = ctx->allocator.sweeper;
+    memo->entries = NULL;
+    memo->cap = 0;
+  }
+  memo_drop(memo);
+  ctx->cut = 0;
+  ctx->backtracks = 0;
+}
+
+// bumping the generation invalidates every entry
+static void memo_drop(pp_memo_table_t* memo) {
+  memo->len = 0;
+  if (++memo->generation == 0) {
+    if (memo->entries != NULL)
+      memset(memo->entries, 0, memo->cap * sizeof(pp_memo_entry_t));
+    memo->generation = 1;
+  }
+}
+
+// a cut inside parser is seen as one of its own, whether or not the
+// alternative it is in was cut already, so the entry records it
+static pp_result_t
+memoized(pp_parser_t* parser, pp_state_t state, pp_memo_stats_t* stats) {
+  pp_ctx_t* ctx = state.ctx;
+  pp_memo_table_t* memo = &ctx->memo;
+  pp_memo_entry_t* entry = memo_slot(memo, parser, state.pos, state.flags);
+  if (entry != NULL && entry->generation == memo->generation) {
+    memo->stats.hits++;
+    if (stats != NULL)
+      stats->hits++;
+    if (entry->cut)
+      pass_cut(ctx);
+    return entry->result;
+  }
+
+  memo->stats.misses++;
+  if (stats != NULL)
+    stats->misses++;
+
+  // with the alternative already cut, the count is raised for the cut
+  // inside to take back
+  const int outer = ctx->cut;
+  ctx->cut = 0;
+  ctx->backtracks += outer;
+  const pp_result_t result = parse_op(parser, state);
+  const int cut = ctx->cut;
+  ctx->backtracks -= outer && !cut;
+  ctx->cut = outer || cut;
+
+  // the table may have grown or moved while parsing the child
+  if (memo->len * 2 >= memo->cap)
+    memo_grow(state.ctx);
+  entry = memo_slot(memo, parser, state.pos, state.flags);
+  if (entry != NULL) {
+    *entry = (pp_memo_entry_t){
+      .parser = parser,
+      .pos = state.pos,
+      .flags = state.flags,
+      .generation = memo->generation,
+      .cut = cut,
+      .result = result,
+    };
+    memo->len++;
+  }
+  return result;
+}
+
+// the entry for parser at pos, or the empty slot where it belongs. results
+// from recognizing are kept apart from full parses.
+static pp_memo_entry_t* memo_slot(
+  pp_memo_table_t* memo, const pp_parser_t* parser, int pos, int flags
+) {
+  if (memo->entries == NULL)
+    return NULL;
+
+  const unsigned long hash =
+    ((unsigned long)parser >> 4) * 0x9e3779b97f4a7c15ul ^ pos * 0x85ebca6bul;
+  const int mask = memo->cap - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    pp_memo_entry_t* entry = &memo->entries[i];
+    if (entry->generation != memo->generation ||
+        (entry->parser == parser && entry->pos == pos && entry->flags == flags))
+      return entry;
+  }
+}
+
+static void memo_grow(pp_ctx_t* ctx) {
+  pp_memo_table_t* memo = &ctx->memo;
+  const int old_cap = memo->cap;
+  pp_memo_entry_t* old_entries = memo->entries;
+
+  memo->cap = old_cap == 0 ? MEMO_INIT_CAP : old_cap * 2;
+  memo->entries =
+    aa_sweeper_alloc(&ctx->allocator, memo->cap * sizeof(pp_memo_entry_t));
+  if (memo->entries == NULL) {
+    memo->cap = 0;
+    return;
+  }
+  memset(memo->entries, 0, memo->cap * sizeof(pp_memo_entry_t));
+
+  for (int i = 0; i < old_cap; ++i) {
+    const pp_memo_entry_t* entry = &old_entries[i];
+    if (entry->generation == memo->generation)
+      *memo_slot(memo, entry->parser, entry->pos, entry->flags) = *entry;
+  }
+}
+
+// every parse starts with nothing expected at the start of the input
+static void failure_begin(pp_ctx_t* ctx, const char* input, int len) {
+  pp_failure_t* failure = &ctx->failure;
+  failure->input = input;
+  failure->len = len;
+  failure->pos = 0;
+  failure->num_expected = 0;
+  ctx->names.len = 0;
+}
+
+// only the farthest failure is kept, so one behind it costs a compare. most
+// of the others move it on to the next byte or repeat the last one noted,
+// which are done here too.
+static inline void
+note_failure(pp_ctx_t* ctx, int pos, const pp_parser_t* parser) {
+  pp_failure_t* failure = &ctx->failure;
+  if (pos < failure->pos)
+    return;
+  const pp_name_stack_t* names = &ctx->names;
+  if (names->len > 0 && names->frames[names->len - 1].pos == pos) {
+    note_farthest(ctx, pos, parser);
+  } else if (pos > failure->pos) {
+    failure->pos = pos;
+    failure->expected[0] = parser;
+    failure->num_expected = 1;
+  } else if (failure->num_expected == 0 ||
+             failure->expected[failure->num_expected - 1] != parser) {
+    note_farthest(ctx, pos, parser);
+  }
+}
+
+// the failure a program held back, if there is one
+__attribute__((noinline)) static void
+note_held(pp_ctx_t* ctx, int pos, const pp_parser_t* parser) {
+  if (parser != NULL)
+    note_failure(ctx, pos, parser);
+}
+
+// the outermost named node that starts at pos fails with parser
+static void note_farthest(pp_ctx_t* ctx, int pos, const pp_parser_t* parser) {
+  pp_failure_t* failure = &ctx->failure;
+  if (pos > failure->pos) {
+    failure->pos = pos;
+    failure->num_expected = 0;
+  }
+  const pp_name_stack_t* names = &ctx->names;
+  for (int i = names->len - 1; i >= 0 && names->frames[i].pos == pos; --i) {
+    parser = names->frames[i].parser;
+  }
+  for (int i = 0; i < failure->num_expected; ++i) {
+    if (failure->expected[i] == parser)
+      return;
+  }
+  if (failure->num_expected < PP_MAX_EXPECTED)
+    failure->expected[failure->num_expected++] = parser;
+}
+
+static void name_push(pp_ctx_t* ctx, const pp_parser_t* parser, int pos) {
+  pp_name_stack_t* names = &ctx->names;
+  if (names->len == names->cap) {
+    names->cap = names->cap ? names->cap * 2 : NAMES_INIT_CAP;
+    names->frames =
+      realloc(names->frames, names->cap * sizeof(pp_name_frame_t));
+  }
+  names->frames[names->len++] = (pp_name_frame_t){.parser = parser, .pos = pos};
+}
+
+// what parser starts with, as items of error. a choice stands for all of its
+// alternatives and a sequence for its children up to the first that has to
+// consume input.
+static void
+add_expected(pp_error_t* error, const pp_parser_t* parser, int depth) {
+  if (depth > EXPECTED_MAX_DEPTH)
+    return;
+  pp_expected_t item = {.parser = parser};
+  if (parser->name != NULL) {
+    item.type = PP_EXPECTED_NAME;
+    item.text = parser->name;
+    item.len = strlen(parser->name);
+    add_item(error, item);
+    return;
+  }
+
+  switch (parser->op) {
+  case PP_OP_EOF:
+    item.type = PP_EXPECTED_END;
+    break;
+
+  case PP_OP_EXPECT:
+    item.type = PP_EXPECTED_LITERAL;
+    item.text = &parser->data.expect.c;
+    item.len = 1;
+    break;
+
+  case PP_OP_CHAR:
+    item.type = PP_EXPECTED_LITERAL;
+    item.text = &parser->data.chr.c;
+    item.len = 1;
+    break;
+
+  case PP_OP_STRING:
+    item.type = PP_EXPECTED_LITERAL;
+    item.text = parser->data.string.string;
+    item.len = parser->data.string.len;
+    if (item.len == 0)
+      return;
+    break;
+
+  case PP_OP_STRING_NO_CASE:
+    item.type = PP_EXPECTED_LITERAL;
+    item.text = parser->data.string_no_case.string;
+    item.len = parser->data.string_no_case.len;
+    if (item.len == 0)
+      return;
+    break;
+
+  // keywords are given as the bytes they start with. like the empty string,
+  // a leaf that can match nothing is not expected, since it does not fail.
+  case PP_OP_ANY_OF:
+  case PP_OP_NONE_OF:
+  case PP_OP_SPAN:
+  case PP_OP_KEYWORDS: {
+    int nullable;
+    item.type = PP_EXPECTED_CLASS;
+    first_set(parser, &item.cls, &nullable);
+    if (nullable)
+      return;
+    break;
+  }
+
+  case PP_OP_CHOICE:
+    for (int i = 0; i < parser->data.choice.num_parsers; ++i) {
+      add_expected(error, parser->data.choice.parsers[i], depth + 1);
+    }
+    return;
+
+  case PP_OP_SEQUENCE:
+    for (int i = 0; i < parser->data.sequence.num_parsers; ++i) {
+      const pp_parser_t* child = parser->data.sequence.parsers[i];
+      add_expected(error, child, depth + 1);
+      if (!may_match_empty(child, 0))
+        break;
+    }
+    return;
+
+  case PP_OP_EXPR: {
+    const pp_expr_t* expr = &parser->data.expr;
+    add_expected(error, expr->parsers[0], depth + 1);
+    for (int i = 0; i < expr->num_operators; ++i) {
+      if (expr->operators[i].fixity == PP_PREFIX)
+        add_expected(error, expr->parsers[i + 1], depth + 1);
+    }
+    return;
+  }
+
+  case PP_OP_REF:
+    if (parser->data.ref.parser != NULL)
+      add_expected(error, parser->data.ref.parser, depth + 1);
+    return;
+
+  default: {
+    int num;
+    pp_parser_t** parsers = children((pp_parser_t*)parser, &num);
+    if (num > 0)
+      add_expected(error, parsers[0], depth + 1);
+    return;
+  }
+  }
+  add_item(error, item);
+}
+
+// like the nullable of first_set, but without marking refs busy, so errors
+// can be worked out while other threads parse with the grammar. a grammar
+// deeper than the limit counts as matching nothing.
+static int may_match_empty(const pp_parser_t* parser, int depth) {
+  if (depth > EXPECTED_MAX_DEPTH)
+    return 1;
+
+  switch (parser->op) {
+  case PP_OP_PURE:
+  case PP_OP_EOF:
+  case PP_OP_OPTIONAL:
+  case PP_OP_MANY:
+  case PP_OP_CUT:
+    return 1;
+  case PP_OP_STRING:
+    return parser->data.string.len == 0;
+  case PP_OP_STRING_NO_CASE:
+    return parser->data.string_no_case.len == 0;
+  case PP_OP_SPAN:
+    return parser->data.span.min == 0;
+  case PP_OP_KEYWORDS:
+    return parser->data.keywords.trie->terminals[0] != -1;
+  case PP_OP_CHOICE:
+    for (int i = 0; i < parser->data.choice.num_parsers; ++i) {
+      if (may_match_empty(parser->data.choice.parsers[i], depth + 1))
+        return 1;
+    }
+    return 0;
+  case PP_OP_SEQUENCE:
+    for (int i = 0; i < parser->data.sequence.num_parsers; ++i) {
+      if (!may_match_empty(parser->data.sequence.parsers[i], depth + 1))
+        return 0;
+    }
+    return 1;
+  case PP_OP_REF:
+    return parser->data.ref.parser == NULL ||
+           may_match_empty(parser->data.ref.parser, depth + 1);
+  case PP_OP_EXPR:
+    return may_match_empty(parser->data.expr.parsers[0], depth + 1);
+  default: {
+    int num;
+    pp_parser_t** parsers = children((pp_parser_t*)parser, &num);
+    return num > 0 && may_match_empty(parsers[0], depth + 1);
+  }
+  }
+}
+
+// items that read the same are listed once
+static void add_item(pp_error_t* error, pp_expected_t item) {
+  for (int i = 0; i < error->num_expected; ++i) {
+    const pp_expected_t* other = &error->expected[i];
+    if (other->type == item.type && other->len == item.len &&
+        (item.len == 0 || memcmp(other->text, item.text, item.len) == 0) &&
+        memcmp(&other->cls, &item.cls, sizeof(pp_class_t)) == 0)
+      return;
+  }
+  if (error->num_expected < PP_MAX_EXPECTED)
+    error->expected[error->num_expected++] = item;
+}
+
+// appends to the message in buf as snprintf would, given its length so far
+static int append(char* buf, int size, int len, const char* format, ...) {
+  const int at = len < size ? len : size;
+  va_list args;
+  va_start(args, format);
+  const int n = vsnprintf(buf + at, size - at, format, args);
+  va_end(args);
+  return len + n;
+}
+
+// bytes that would not read well are escaped, and so are the ones in special
+static int append_char(
+  char* buf, int size, int len, unsigned char c, const char* special
+) {
+  switch (c) {
+  case '\n':
+    return append(buf, size, len, "\\n");
+  case '\t':
+    return append(buf, size, len, "\\t");
+  case '\r':
+    return append(buf, size, len, "\\r");
+  }
+  if (c < 0x20 || c >= 0x7f)
+    return append(buf, size, len, "\\x%02x", c);
+  if (strchr(special, c) != NULL)
+    return append(buf, size, len, "\\%c", c);
+  return append(buf, size, len, "%c", c);
+}
+
+// literals are quoted and classes written as ranges, with ^ when that is
+// shorter
+static int
+append_expected(char* buf, int size, int len, const pp_expected_t* item) {
+  switch (item->type) {
+  case PP_EXPECTED_LITERAL:
+    len = append(buf, size, len, "\"");
+    for (int i = 0; i < item->len; ++i) {
+      len = append_char(buf, size, len, item->text[i], "\"\\");
+    }
+    return append(buf, size, len, "\"");
+
+  case PP_EXPECTED_CLASS: {
+    int count = 0;
+    for (int c = 0; c < 256; ++c) {
+      count += class_has(&item->cls, c);
+    }
+    if (count == 256)
+      return append(buf, size, len, "any byte");
+    const int invert = count > 128;
+    const pp_class_t cls =
+      invert ? pp_class_complement(item->cls) : item->cls;
+    len = append(buf, size, len, invert ? "[^" : "[");
+    for (int c = 0; c < 256;) {
+      if (!class_has(&cls, c)) {
+        c++;
+        continue;
+      }
+      int hi = c;
+      while (hi < 255 && class_has(&cls, hi + 1))
+        hi++;
+      len = append_char(buf, size, len, c, "]\\-^");
+      if (hi > c + 1)
+        len = append(buf, size, len, "-");
+      if (hi > c)
+        len = append_char(buf, size, len, hi, "]\\-^");
+      c = hi + 1;
+    }
+    return append(buf, size, len, "]");
+  }
+
+  case PP_EXPECTED_NAME:
+    return append(buf, size, len, "%.*s", item->len, item->text);
+
+  default:
+    return append(buf, size, len, "end of input");
+  }
+}
+
+// a new copy of node, with the strings and parser arrays it points to. while
+// interning, an equal node made before from the same allocator is returned
+// instead, and nothing is allocated.
+static pp_parser_t* make_node(const pp_parser_t* node) {
+  pp_ctx_t* ctx = current_ctx();
+  pp_intern_table_t* intern = &ctx->intern;
+  pp_parser_t** slot = NULL;
+  if (intern->enabled) {
+    if (intern->owner != ctx->allocator.sweeper) {
+      intern->owner = ctx->allocator.sweeper;
+      intern->entries = NULL;
+      intern->cap = 0;
+      intern->len = 0;
+    }
+    if (intern->len * 2 >= intern->cap)
+      intern_grow(ctx);
+    slot = intern_slot(intern, node);
+    if (slot != NULL && *slot != NULL)
+      return *slot;
+  }
+
+  pp_parser_t* p = pp_init_parser();
+  *p = *node;
+  switch (p->op) {
+  case PP_OP_STRING:
+  case PP_OP_STRING_NO_CASE:
+    p->data.string.string =
+      pp_strndup(node->data.string.string, node->data.string.len);
+    break;
+  case PP_OP_CHOICE:
+  case PP_OP_SEQUENCE: {
+    const int num_parsers = node->data.sequence.num_parsers;
+    pp_parser_t** parsers = pp_alloc(num_parsers * sizeof(void*));
+    memcpy(parsers, node->data.sequence.parsers, num_parsers * sizeof(void*));
+    p->data.sequence.parsers = parsers;
+    if (p->op == PP_OP_CHOICE)
+      build_dispatch(&p->data.choice);
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (slot != NULL) {
+    *slot = p;
+    intern->len++;
+  }
+  return p;
+}
+
+static int is_interned(const pp_parser_t* node) {
+  pp_ctx_t* ctx = current_ctx();
+  if (ctx->intern.owner != ctx->allocator.sweeper)
+    return 0;
+  pp_parser_t** slot = intern_slot(&ctx->intern, node);
+  return slot != NULL && *slot == node;
+}
+
+// the interned node equal to node, or the empty slot where it belongs
+static pp_parser_t**
+intern_slot(pp_intern_table_t* intern, const pp_parser_t* node) {
+  if (intern->entries == NULL)
+    return NULL;
+
+  const int mask = intern->cap - 1;
+  for (int i = node_hash(node) & mask;; i = (i + 1) & mask) {
+    pp_parser_t** entry = &intern->entries[i];
+    if (*entry == NULL || node_equal(*entry, node))
+      return entry;
+  }
+}
+
+static void intern_grow(pp_ctx_t* ctx) {
+  pp_intern_table_t* intern = &ctx->intern;
+  const int old_cap = intern->cap;
+  pp_parser_t** old_entries = intern->entries;
+
+  intern->cap = old_cap == 0 ? INTERN_INIT_CAP : old_cap * 2;
+  intern->entries =
+    aa_sweeper_alloc(&ctx->allocator, intern->cap * sizeof(pp_parser_t*));
+  if (intern->entries == NULL) {
+    intern->cap = 0;
+    return;
+  }
+  memset(intern->entries, 0, intern->cap * sizeof(pp_parser_t*));
+
+  for (int i = 0; i < old_cap; ++i) {
+    if (old_entries[i] != NULL)
+      *intern_slot(intern, old_entries[i]) = old_entries[i];
+  }
+}
+
+static unsigned long hash_bytes(unsigned long hash, const void* ptr, int len) {
+  const unsigned char* bytes = ptr;
+  for (int i = 0; i < len; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ul;
+  }
+  return hash;
+}
+
+// hashes the fields node_equal compares
+static unsigned long node_hash(const pp_parser_t* node) {
+  const pp_op_data_t* data = &node->data;
+  unsigned long hash = hash_bytes(0xcbf29ce484222325ul, &node->op, sizeof(int));
+  switch (node->op) {
+  case PP_OP_EXPECT:
+    return hash_bytes(hash, &data->expect.c, 1);
+  case PP_OP_CHAR:
+    return hash_bytes(hash, &data->chr.c, 1);
+  case PP_OP_STRING:
+  case PP_OP_STRING_NO_CASE:
+    return hash_bytes(hash, data->string.string, data->string.len);
+  case PP_OP_ANY_OF:
+  case PP_OP_NONE_OF:
+    return hash_bytes(hash, &data->any_of.cls, sizeof(pp_class_t));
+  case PP_OP_SPAN:
+    hash = hash_bytes(hash, &data->span.cls, sizeof(pp_class_t));
+    return hash_bytes(hash, &data->span.min, sizeof(int));
+  case PP_OP_CHOICE:
+  case PP_OP_SEQUENCE:
+    return hash_bytes(
+      hash, data->sequence.parsers,
+      data->sequence.num_parsers * sizeof(pp_parser_t*)
+    );
+  case PP_OP_MAP:
+    return hash_bytes(hash, &data->map, sizeof(pp_map_t));
+  case PP_OP_TAP:
+    return hash_bytes(hash, &data->tap, sizeof(pp_tap_t));
+  case PP_OP_TAGGED:
+    hash = hash_bytes(hash, &data->tagged.parser, sizeof(pp_parser_t*));
+    hash = hash_bytes(hash, &data->tagged.tag, sizeof(int));
+    return hash_bytes(hash, &data->tagged.token, sizeof(int));
+  case PP_OP_OPTIONAL:
+  case PP_OP_MANY:
+  case PP_OP_MEMO:
+  case PP_OP_RECOGNIZE: {
+    int num;
+    pp_parser_t** parsers = children((pp_parser_t*)node, &num);
+    return hash_bytes(hash, parsers, sizeof(pp_parser_t*));
+  }
+  default:
+    return hash;
+  }
+}
+
+// the same op and data, with children compared by identity
+static int node_equal(const pp_parser_t* a, const pp_parser_t* b) {
+  if (a->op != b->op)
+    return 0;
+  const pp_op_data_t* x = &a->data;
+  const pp_op_data_t* y = &b->data;
+  switch (a->op) {
+  case PP_OP_PURE:
+  case PP_OP_FAIL:
+  case PP_OP_EOF:
+  case PP_OP_CUT:
+    return 1;
+  case PP_OP_EXPECT:
+    return x->expect.c == y->expect.c;
+  case PP_OP_CHAR:
+    return x->chr.c == y->chr.c;
+  case PP_OP_STRING:
+  case PP_OP_STRING_NO_CASE:
+    return x->string.len == y->string.len &&
+           memcmp(x->string.string, y->string.string, x->string.len) == 0;
+  case PP_OP_ANY_OF:
+  case PP_OP_NONE_OF:
+    return memcmp(&x->any_of.cls, &y->any_of.cls, sizeof(pp_class_t)) == 0;
+  case PP_OP_SPAN:
+    return x->span.min == y->span.min &&
+           memcmp(&x->span.cls, &y->span.cls, sizeof(pp_class_t)) == 0;
+  case PP_OP_CHOICE:
+  case PP_OP_SEQUENCE:
+    return x->sequence.num_parsers == y->sequence.num_parsers &&
+           memcmp(
+             x->sequence.parsers, y->sequence.parsers,
+             x->sequence.num_parsers * sizeof(pp_parser_t*)
+           ) == 0;
+  case PP_OP_MAP:
+    return x->map.parser == y->map.parser && x->map.map == y->map.map &&
+           x->map.arg == y->map.arg;
+  case PP_OP_TAP:
+    return x->tap.parser == y->tap.parser && x->tap.tap == y->tap.tap &&
+           x->tap.arg == y->tap.arg;
+  case PP_OP_TAGGED:
+    return x->tagged.parser == y->tagged.parser &&
+           x->tagged.tag == y->tagged.tag &&
+           x->tagged.token == y->tagged.token;
+  case PP_OP_OPTIONAL:
+  case PP_OP_MANY:
+  case PP_OP_MEMO:
+  case PP_OP_RECOGNIZE: {
+    int num;
+    pp_parser_t* child = *children((pp_parser_t*)a, &num);
+    return child == *children((pp_parser_t*)b, &num);
+  }
+  // keywords and parallel lists are never interned
+  default:
+    return 0;
+  }
+}
+
+static pp_parser_t* tagged(pp_parser_t* parser, int tag, int token) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_TAGGED,
+    .data.tagged = {.parser = parser, .tag = tag, .token = token},
+  });
+}
+
+// pushes n slots and returns the index of the first. the stack may move, so
+// slots are addressed by index across nested parses.
+static int scratch_reserve(pp_scratch_t* scratch, int n) {
+  if (scratch->values == NULL || scratch->len + n > scratch->cap) {
+    int cap = scratch->cap ? scratch->cap : SCRATCH_INIT_CAP;
+    while (cap < scratch->len + n) {
+      cap *= 2;
+    }
+    scratch->values = realloc(scratch->values, cap * sizeof(pp_output_t));
+    scratch->cap = cap;
+  }
+  const int at = scratch->len;
+  scratch->len += n;
+  return at;
+}
+
+// starts an alternative, optional or many iteration, which a cut inside
+// commits to. returns the state of the enclosing one for scope_end.
+static inline int scope_begin(pp_ctx_t* ctx) {
+  const int outer = ctx->cut;
+  ctx->cut = 0;
+  ctx->backtracks++;
+  return outer;
+}
+
+// ends the scope begun with outer and returns whether it was cut
+static inline int scope_end(pp_ctx_t* ctx, int outer) {
+  const int cut = ctx->cut;
+  ctx->backtracks -= !cut;
+  ctx->cut = outer;
+  return cut;
+}
+
+// commits the innermost scope. with none left that could backtrack, no
+// memo entry before the cut can be looked up again.
+static void pass_cut(pp_ctx_t* ctx) {
+  if (ctx->cut)
+    return;
+  ctx->cut = 1;
+  if (ctx->backtracks > 0)
+    ctx->backtracks--;
+  if (ctx->backtracks == 0 && ctx->memo.len > 0)
+    memo_drop(&ctx->memo);
+}
+
+// starts a stretch of events that may be taken back. returns where it starts
+// in the log, or -1 when not parsing for events.
+static inline int events_mark(pp_state_t state) {
+  if (!(state.flags & PP_EVENTS))
+    return -1;
+  state.ctx->events.depth++;
+  return state.ctx->events.len;
+}
+
+// drops the events since mark unless keep is set. once no stretch is left
+// open nothing can take the events back, so they go to the handler.
+static inline void events_release(pp_state_t state, int mark, int keep) {
+  if (mark < 0)
+    return;
+  pp_event_log_t* log = &state.ctx->events;
+  log->depth--;
+  if (!keep)
+    log->len = mark;
+  else if (log->depth == 0 && log->len > 0)
+    events_flush(log);
+}
+
+static void event_push(
+  pp_state_t state, pp_event_type_t type, int tag, int pos, int len
+) {
+  pp_event_log_t* log = &state.ctx->events;
+  const pp_event_t event = {
+    .type = type,
+    .tag = tag,
+    .ptr = state.input + pos,
+    .len = len,
+  };
+  if (log->depth == 0) {
+    log->handler(&event, log->arg);
+    return;
+  }
+  if (log->len == log->cap) {
+    log->cap = log->cap ? log->cap * 2 : SCRATCH_INIT_CAP;
+    log->events = realloc(log->events, log->cap * sizeof(pp_event_t));
+  }
+  log->events[log->len++] = event;
+}
+
+static void events_flush(pp_event_log_t* log) {
+  for (int i = 0; i < log->len; ++i) {
+    log->handler(&log->events[i], log->arg);
+  }
+  log->len = 0;
+}
+
+static int tape_push(
+  pp_tape_t* tape, pp_output_type_t type, int offset, int len, int skip
+) {
+  if (tape->len == tape->cap) {
+    tape->cap = tape->cap ? tape->cap * 2 : SCRATCH_INIT_CAP;
+    tape->entries =
+      realloc(tape->entries, tape->cap * sizeof(pp_tape_entry_t));
+  }
+  tape->entries[tape->len] = (pp_tape_entry_t){
+    .type = type,
+    .offset = offset,
+    .len = len,
+    .skip = skip,
+  };
+  return tape->len++;
+}
+
+// room for len bytes and a null at the end of the strings
+static int tape_reserve_string(pp_tape_t* tape, int len) {
+  if (tape->strings_len + len + 1 > tape->strings_cap) {
+    int cap = tape->strings_cap ? tape->strings_cap : SCRATCH_INIT_CAP;
+    while (cap < tape->strings_len + len + 1) {
+      cap *= 2;
+    }
+    tape->strings = realloc(tape->strings, cap);
+    tape->strings_cap = cap;
+  }
+  const int offset = tape->strings_len;
+  tape->strings[offset + len] = '\0';
+  tape->strings_len += len + 1;
+  return offset;
+}
+
+// the maps of the library are done on the tape itself. any other map is
+// given the tree and its output replaces the entries at.
+static void
+tape_map(pp_tape_t* tape, int at, const pp_map_t* map, int begin, int end) {
+  if (map->map == skip) {
+    tape->len = at;
+    tape_push(tape, PP_OUTPUT_NONE, 0, 0, 0);
+  } else if (map->map == select_item) {
+    tape_select(tape, at, (int)(long long)map->arg);
+  } else if (map->map == concat_array) {
+    tape_concat_array(tape, at);
+  } else if (map->map == prepend_item) {
+    tape_prepend_item(tape, at);
+  } else if (map->map == concat_string) {
+    tape_concat_string(tape, at, begin, end);
+  } else {
+    const pp_output_t output = map->map(pp_tape_output(tape, at), map->arg);
+    tape->len = at;
+    pp_tape_push_output(tape, output);
+  }
+}
+
+static void tape_select(pp_tape_t* tape, int at, int pos) {
+  if (tape->entries[at].type != PP_OUTPUT_ARRAY) {
+    return;
+  }
+  int child = at + 1;
+  for (int i = 0; i < pos; ++i) {
+    child = pp_tape_skip(tape, child);
+  }
+  const int len = pp_tape_skip(tape, child) - child;
+  memmove(
+    &tape->entries[at], &tape->entries[child], len * sizeof(pp_tape_entry_t)
+  );
+  tape->len = at + len;
+}
+
+// the headers of arrays among the children are dropped, which moves their
+// children up a level
+static void tape_concat_array(pp_tape_t* tape, int at) {
+  if (tape->entries[at].type != PP_OUTPUT_ARRAY) {
+    return;
+  }
+  int len = 0;
+  int to = at + 1;
+  const int end = tape->len;
+  for (int from = at + 1; from < end;) {
+    const pp_tape_entry_t* child = &tape->entries[from];
+    const int next = pp_tape_skip(tape, from);
+    int first = from;
+    if (child->type == PP_OUTPUT_ARRAY) {
+      len += child->len;
+      first++;
+    } else {
+      len++;
+    }
+    memmove(
+      &tape->entries[to], &tape->entries[first],
+      (next - first) * sizeof(pp_tape_entry_t)
+    );
+    to += next - first;
+    from = next;
+  }
+  tape->entries[at].len = len;
+  tape->entries[at].skip = to - at - 1;
+  tape->len = to;
+}
+
+static void tape_prepend_item(pp_tape_t* tape, int at) {
+  if (tape->entries[at].type != PP_OUTPUT_ARRAY) {
+    return;
+  }
+  const int items = pp_tape_skip(tape, at + 1);
+  const int len = tape->entries[items].len;
+  memmove(
+    &tape->entries[items], &tape->entries[items + 1],
+    (tape->len - items - 1) * sizeof(pp_tape_entry_t)
+  );
+  tape->len--;
+  tape->entries[at].len = len + 1;
+  tape->entries[at].skip = tape->len - at - 1;
+}
+
+// the same as concat_text over the input from begin to limit: one slice when
+// the text is contiguous in the input, otherwise a string
+static void tape_concat_string(pp_tape_t* tape, int at, int begin, int limit) {
+  int start = -1;
+  int end = -1;
+  int len = 0;
+  int contiguous = 1;
+  for (int i = at; i < tape->len; ++i) {
+    const pp_tape_entry_t* e = &tape->entries[i];
+    switch (e->type) {
+    case PP_OUTPUT_SLICE:
+    case PP_OUTPUT_KEYWORD:
+      if (e->len > 0) {
+        if (start < 0)
+          start = e->offset;
+        else if (end != e->offset)
+          contiguous = 0;
+        end = e->offset + e->len;
+      }
+      len += e->len;
+      break;
+    case PP_OUTPUT_CHAR:
+      if (start < 0)
+        start = end = begin;
+      if (end >= limit || (unsigned char)tape->input[end] != e->offset)
+        contiguous = 0;
+      end++;
+      len += e->len;
+      break;
+    case PP_OUTPUT_STRING:
+      contiguous = 0;
+      len += e->len;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (contiguous) {
+    tape->len = at;
+    tape_push(
+      tape, PP_OUTPUT_SLICE, start < 0 ? 0 : start, start < 0 ? 0 : end - start,
+      0
+    );
+    return;
+  }
+
+  const int offset = tape_reserve_string(tape, len);
+  char* dst = tape->strings + offset;
+  for (int i = at; i < tape->len; ++i) {
+    const pp_tape_entry_t* e = &tape->entries[i];
+    if (e->type == PP_OUTPUT_CHAR) {
+      *dst++ = e->offset;
+    } else if (e->type != PP_OUTPUT_ARRAY && e->type != PP_OUTPUT_NONE) {
+      memcpy(dst, pp_tape_text(tape, i), e->len);
+      dst += e->len;
+    }
+  }
+  tape->len = at;
+  tape_push(tape, PP_OUTPUT_STRING, offset, len, 0);
+}
+
+static void* batch_worker(void* arg) {
+  const batch_worker_t* worker = arg;
+  batch_job_t* job = worker->job;
+  pp_ctx_t* ctx = &job->batch->ctxs[worker->id];
+
+  int begin, end;
+  while (batch_take(job, worker->id, &begin, &end)) {
+    for (int i = begin; i < end; ++i) {
+      job->results[i] =
+        pp_ctx_parse(ctx, job->parser, job->inputs[i], job->lens[i]);
+      // worked out before the next parse overwrites the failure, and kept
+      // in the worker's arena with the outputs
+      if (job->results[i].status != PP_OK) {
+        pp_error_t* error =
+          aa_sweeper_alloc(&ctx->allocator, sizeof(pp_error_t));
+        *error = pp_ctx_error(ctx);
+        job->batch->errors[i] = error;
+      }
+    }
+  }
+  return NULL;
+}
+
+// takes up to BATCH_CHUNK inputs from the front of the worker's own queue.
+// once that is empty it steals the back half of the first queue that still
+// has work. returns 0 when every queue is empty, which is final since no work
+// is added during a batch.
+static int batch_take(batch_job_t* job, int id, int* begin, int* end) {
+  const int num_workers = job->batch->num_workers;
+  batch_queue_t* own = &job->queues[id];
+
+  for (int i = 0; i < num_workers; ++i) {
+    batch_queue_t* victim = &job->queues[(id + i) % num_workers];
+
+    pthread_mutex_lock(&victim->lock);
+    const int left = victim->end - victim->begin;
+    if (left > 0 && victim == own) {
+      *begin = own->begin;
+      *end = own->begin + (left < BATCH_CHUNK ? left : BATCH_CHUNK);
+      own->begin = *end;
+      pthread_mutex_unlock(&own->lock);
+      return 1;
+    }
+    if (left > 0) {
+      const int mid = victim->end - (left + 1) / 2;
+      *begin = mid;
+      *end = victim->end;
+      victim->end = mid;
+      pthread_mutex_unlock(&victim->lock);
+
+      // what is left of the stolen half goes back on the worker's own queue
+      // where others can steal it in turn
+      if (*end - *begin > BATCH_CHUNK) {
+        pthread_mutex_lock(&own->lock);
+        own->begin = *begin + BATCH_CHUNK;
+        own->end = *end;
+        pthread_mutex_unlock(&own->lock);
+        *end = *begin + BATCH_CHUNK;
+      }
+      return 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return 0;
+}
+
+// the item before the first cut is parsed here, the rest of each piece on a
+// thread of its own. every piece gets a fresh context so memo entries made
+// against a shortened input never leak into the caller's table.
+static pp_result_t
+parallel_list(const pp_parallel_list_t* list, pp_state_t state) {
+  int num_chunks = list->num_threads > 0 ? list->num_threads
+                                         : sysconf(_SC_NPROCESSORS_ONLN);
+  if ((state.len - state.pos) / PARALLEL_LIST_MIN_LEN < num_chunks) {
+    num_chunks = (state.len - state.pos) / PARALLEL_LIST_MIN_LEN;
+  }
+  // events have to come out in order, from this context
+  if (num_chunks < 2 || state.flags & PP_EVENTS) {
+    return parse(list->list, state);
+  }
+
+  const pp_result_t first = parse(list->item, state);
+  if (first.status != PP_OK) {
+    return err(state.pos, first.status);
+  }
+
+  int* cuts = malloc((num_chunks + 1) * sizeof(int));
+  num_chunks = find_cuts(list, state, first.pos, num_chunks, cuts);
+  if (num_chunks < 2) {
+    free(cuts);
+    return parse(list->list, state);
+  }
+
+  list_chunk_t* chunks = malloc(num_chunks * sizeof(list_chunk_t));
+  pthread_t* threads = malloc(num_chunks * sizeof(pthread_t));
+  int* started = calloc(num_chunks, sizeof(int));
+  for (int i = 0; i < num_chunks; ++i) {
+    list_chunk_t* chunk = &chunks[i];
+    chunk->parser = list->next;
+    pp_ctx_init(&chunk->ctx);
+    chunk->ctx.memo.all = state.ctx->memo.all;
+    chunk->state = state;
+    chunk->state.pos = cuts[i];
+    chunk->state.len = cuts[i + 1];
+    chunk->state.end = state.input + cuts[i + 1];
+    chunk->state.ctx = &chunk->ctx;
+    if (i > 0) {
+      started[i] = pthread_create(&threads[i], NULL, parse_chunk, chunk) == 0;
+    }
+  }
+  // the first piece and any whose thread could not be created are parsed here
+  for (int i = 0; i < num_chunks; ++i) {
+    if (!started[i])
+      parse_chunk(&chunks[i]);
+  }
+  for (int i = 1; i < num_chunks; ++i) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+
+  // every piece but the last has to end exactly at the next cut, and only
+  // its last item may have run into the cut
+  int split_ok = 1;
+  for (int i = 0; i < num_chunks && split_ok; ++i) {
+    const list_chunk_t* chunk = &chunks[i];
+    if (chunk->result.status != PP_OK)
+      split_ok = 0;
+    else if (i < num_chunks - 1)
+      split_ok = chunk->result.pos == cuts[i + 1] && !chunk->cut_short &&
+                 (!chunk->last_hit_end ||
+                  seam_holds(list, state, chunk, cuts[i + 1]));
+  }
+
+  pp_result_t result;
+  if (split_ok) {
+    pp_output_t output = none();
+    if (!(state.flags & PP_RECOGNIZE)) {
+      int len = 1;
+      for (int i = 0; i < num_chunks; ++i) {
+        len += chunks[i].result.output.output.array.len;
+      }
+      pp_output_t* values = pp_alloc(len * sizeof(pp_output_t));
+      values[0] = first.output;
+      for (int i = 0, j = 1; i < num_chunks; ++i) {
+        const pp_output_t items = chunks[i].result.output;
+        memcpy(
+          &values[j], items.output.array.values,
+          items.output.array.len * sizeof(pp_output_t)
+        );
+        j += items.output.array.len;
+      }
+      output = (pp_output_t){
+        .type = PP_OUTPUT_ARRAY,
+        .output.array = {.len = len, .values = values},
+      };
+    }
+    const int end = chunks[num_chunks - 1].result.pos;
+    state.ctx->hit_end |= chunks[num_chunks - 1].ctx.hit_end;
+    // the pieces note their failures in their own contexts. those of the
+    // last are past the others', so they are the list's.
+    const pp_failure_t* failure = &chunks[num_chunks - 1].ctx.failure;
+    for (int i = 0; i < failure->num_expected; ++i) {
+      note_failure(state.ctx, failure->pos, failure->expected[i]);
+    }
+    result = ok(end, output, state.input + end);
+  }
+
+  for (int i = 0; i < num_chunks; ++i) {
+    release_chunk(state.ctx, &chunks[i], split_ok);
+  }
+  free(started);
+  free(threads);
+  free(chunks);
+  free(cuts);
+
+  return split_ok ? result : parse(list->list, state);
+}
+
+// cuts the input after from into at most num_chunks pieces of about the same
+// size. cuts[i] is where piece i starts and cuts[num_chunks] the end of the
+// input. returns the number of pieces.
+static int find_cuts(
+  const pp_parallel_list_t* list, pp_state_t state, int from, int num_chunks,
+  int* cuts
+) {
+  const char* scanned = state.input + state.pos;
+  int split_state = 0;
+  int n = 1;
+
+  cuts[0] = from;
+  for (int i = 1; i < num_chunks; ++i) {
+    int target = state.pos + (long)(state.len - state.pos) * i / num_chunks;
+    if (target <= cuts[n - 1])
+      target = cuts[n - 1] + 1;
+
+    const char* at = state.input + target;
+    for (;;) {
+      at = at < state.end ? memchr(at, list->split_char, state.end - at) : NULL;
+      if (at == NULL)
+        goto done;
+      const int safe = list->split == NULL ||
+                       list->split(scanned, at, &split_state, list->arg);
+      scanned = at;
+      if (safe)
+        break;
+      at++;
+    }
+    cuts[n++] = at - state.input;
+  }
+
+done:
+  cuts[n] = state.len;
+  return n;
+}
+
+// the items of a piece one by one, as pp_many parses them, noting which of
+// them ran out of input. with the input ending at the next cut, those may
+// have stopped short of where they end in the whole input.
+static void* parse_chunk(void* arg) {
+  list_chunk_t* chunk = arg;
+  pp_ctx_t* ctx = &chunk->ctx;
+  pp_ctx_t* const previous = pp_ctx_use(ctx);
+  memo_begin(ctx);
+  failure_begin(ctx, chunk->state.input, chunk->state.len);
+
+  pp_state_t state = chunk->state;
+  pp_scratch_t* scratch = &ctx->scratch;
+  const int base = scratch_reserve(scratch, 0);
+  int hit_end = 0;
+  chunk->last = -1;
+  chunk->last_hit_end = 0;
+  chunk->cut_short = 0;
+  chunk->result.status = PP_OK;
+
+  while (state.pos < state.len) {
+    ctx->hit_end = 0;
+    const int outer = scope_begin(ctx);
+    const pp_result_t result = parse(chunk->parser, state);
+    hit_end |= ctx->hit_end;
+    if (scope_end(ctx, outer) && result.status != PP_OK) {
+      chunk->result = err(state.pos, result.status);
+      break;
+    }
+    if (result.status != PP_OK || result.pos == state.pos)
+      break;
+
+    chunk->cut_short |= chunk->last_hit_end;
+    chunk->last = state.pos;
+    chunk->last_hit_end = ctx->hit_end;
+    if (!(state.flags & PP_RECOGNIZE)) {
+      const int at = scratch_reserve(scratch, 1);
+      scratch->values[at] = result.output;
+    }
+    state.pos = result.pos;
+  }
+  ctx->hit_end = hit_end | (state.pos >= state.len);
+
+  if (chunk->result.status == PP_OK) {
+    const pp_output_t output =
+      state.flags & PP_RECOGNIZE
+        ? none()
+        : array(scratch->len - base, scratch->values + base);
+    chunk->result = ok(state.pos, output, state.input + state.pos);
+  }
+  scratch->len = base;
+  pp_ctx_use(previous);
+  return NULL;
+}
+
+// the last item of a piece that ran into the cut, parsed again over the
+// whole input. the seam holds when it ends at the cut as it did before.
+static int seam_holds(
+  const pp_parallel_list_t* list, pp_state_t state, const list_chunk_t* chunk,
+  int cut
+) {
+  state.pos = chunk->last;
+  const pp_result_t result = parse(list->next, state);
+  if (result.status != PP_OK || result.pos != cut)
+    return 0;
+  if (state.flags & PP_RECOGNIZE)
+    return 1;
+  const pp_output_t items = chunk->result.output;
+  return pp_output_equal(
+    result.output, items.output.array.values[items.output.array.len - 1]
+  );
+}
+
+// the outputs of a piece live in its arena, which ctx keeps until it is swept
+static void release_chunk(pp_ctx_t* ctx, list_chunk_t* chunk, int keep) {
+  free(chunk->ctx.scratch.values);
+  free(chunk->ctx.names.frames);
+  if (keep) {
+    pp_arena_list_t* retained = malloc(sizeof(pp_arena_list_t));
+    retained->arena = chunk->ctx.arena;
+    retained->next = ctx->retained;
+    ctx->retained = retained;
+  } else {
+    aa_arena_deinit(&chunk->ctx.arena);
+  }
+}
+
+static void release_retained(pp_ctx_t* ctx) {
+  while (ctx->retained != NULL) {
+    pp_arena_list_t* retained = ctx->retained;
+    ctx->retained = retained->next;
+    aa_arena_deinit(&retained->arena);
+    free(retained);
+  }
+}
+
+// emits the complete items at the front of the buffer and drops their input.
+// unless this is the final call, an item that ran out of input may still
+// change with the next chunk, so it is left in the buffer. maps and taps
+// inside it run again when it is retried.
+static void stream_parse(pp_stream_t* stream, int final) {
+  pp_ctx_t* ctx = &stream->ctx;
+  pp_ctx_t* const previous = pp_ctx_use(ctx);
+  int pos = 0;
+
+  while (stream->status == PP_NEED_MORE) {
+    if (stream->many && pos >= stream->len) {
+      if (final)
+        stream->status = PP_OK;
+      break;
+    }
+
+    const pp_state_t state = pp_init_state_n(stream->buffer, stream->len, pos);
+    ctx->hit_end = 0;
+    memo_begin(ctx);
+    failure_begin(ctx, stream->buffer, stream->len);
+    const pp_result_t result = parse(stream->item, state);
+    if (!final && ctx->hit_end)
+      break;
+
+    if (result.status != PP_OK || (stream->many && result.pos == pos)) {
+      stream->status =
+        result.status != PP_OK ? result.status : PP_ERROR_UNEXPECTED_TOK;
+      stream_error(stream, pos);
+      break;
+    }
+
+    if (stream->emit != NULL)
+      stream->emit(result.output, stream->arg);
+    pos = result.pos;
+    if (!stream->many)
+      stream->status = PP_OK;
+  }
+  pp_ctx_use(previous);
+
+  if (pos > 0)
+    memmove(stream->buffer, stream->buffer + pos, stream->len - pos);
+  stream->len -= pos;
+  stream->consumed += pos;
+  pp_ctx_sweep(ctx);
+}
+
+// the failure of the item that stopped the stream, counted from pos, where
+// the item starts. nothing is noted before it, so a failure behind it is one
+// where nothing was expected.
+static void stream_error(pp_stream_t* stream, int pos) {
+  pp_failure_t* failure = &stream->ctx.failure;
+  if (failure->pos < pos)
+    failure->pos = pos;
+  failure->input += pos;
+  failure->len -= pos;
+  failure->pos -= pos;
+  stream->error = pp_ctx_error(&stream->ctx);
+}
+
+// the mapping is read front to back, so the kernel is told to read ahead and
+// drop pages behind. an empty file cannot be mapped and gets an empty string.
+static int map_file(const char* path, pp_file_t* file) {
+  *file = (pp_file_t){.data = ""};
+
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return 0;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 0;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  file->data = data;
+  file->size = st.st_size;
+  return 1;
+}
+
+// the parsers that parser runs, as an array of num pointers into it
+static pp_parser_t** children(pp_parser_t* parser, int* num) {
+  *num = 1;
+  switch (parser->op) {
+  case PP_OP_OPTIONAL:
+    return &parser->data.optional.parser;
+  case PP_OP_CHOICE:
+    *num = parser->data.choice.num_parsers;
+    return parser->data.choice.parsers;
+  case PP_OP_MANY:
+    return &parser->data.many.parser;
+  case PP_OP_SEQUENCE:
+    *num = parser->data.sequence.num_parsers;
+    return parser->data.sequence.parsers;
+  case PP_OP_MAP:
+    return &parser->data.map.parser;
+  case PP_OP_TAP:
+    return &parser->data.tap.parser;
+  case PP_OP_MEMO:
+    return &parser->data.memo.parser;
+  case PP_OP_PARALLEL_LIST:
+    return &parser->data.parallel_list.list;
+  case PP_OP_TAGGED:
+    return &parser->data.tagged.parser;
+  case PP_OP_RECOGNIZE:
+    return &parser->data.recognize.parser;
+  case PP_OP_REF:
+    *num = parser->data.ref.parser != NULL;
+    return &parser->data.ref.parser;
+  case PP_OP_EXPR:
+    *num = parser->data.expr.num_operators + 1;
+    return parser->data.expr.parsers;
+  default:
+    *num = 0;
+    return NULL;
+  }
+}
+
+// in pre-order
+static void collect_nodes(node_list_t* list, pp_parser_t* parser) {
+  if (!node_list_add(list, parser)) {
+    return;
+  }
+  int num;
+  pp_parser_t** parsers = children(parser, &num);
+  for (int i = 0; i < num; ++i) {
+    collect_nodes(list, parsers[i]);
+  }
+}
+
+// 0 when parser is already in the list
+static int node_list_add(node_list_t* list, pp_parser_t* parser) {
+  if (list->len * 2 >= list->num_slots) {
+    const int num_slots = list->num_slots ? list->num_slots * 2 : 64;
+    free(list->slots);
+    list->slots = calloc(num_slots, sizeof(pp_parser_t*));
+    list->num_slots = num_slots;
+    for (int i = 0; i < list->len; ++i) {
+      unsigned long h = (unsigned long)list->nodes[i] >> 4;
+      while (list->slots[h & (num_slots - 1)] != NULL)
+        h++;
+      list->slots[h & (num_slots - 1)] = list->nodes[i];
+    }
+  }
+
+  unsigned long h = (unsigned long)parser >> 4;
+  for (;; h++) {
+    pp_parser_t** slot = &list->slots[h & (list->num_slots - 1)];
+    if (*slot == parser)
+      return 0;
+    if (*slot == NULL) {
+      *slot = parser;
+      break;
+    }
+  }
+
+  if (list->len == list->cap) {
+    list->cap = list->cap ? list->cap * 2 : 64;
+    list->nodes = realloc(list->nodes, list->cap * sizeof(pp_parser_t*));
+  }
+  list->nodes[list->len++] = parser;
+  return 1;
+}
+
+static void node_list_free(node_list_t* list) {
+  free(list->nodes);
+  free(list->slots);
+  *list = (node_list_t){0};
+}
+
+static int node_list_has(const node_list_t* list, const pp_parser_t* parser) {
+  if (list->num_slots == 0)
+    return 0;
+  for (unsigned long h = (unsigned long)parser >> 4;; h++) {
+    const pp_parser_t* slot = list->slots[h & (list->num_slots - 1)];
+    if (slot == parser || slot == NULL)
+      return slot == parser;
+  }
+}
+
+// the nodes under parser that can succeed without consuming input. refs can
+// close cycles, so the set is grown until no node is added.
+static void nullable_nodes(node_list_t* nullable, pp_parser_t* parser) {
+  node_list_t list = {0};
+  collect_nodes(&list, parser);
+  for (int added = 1; added;) {
+    added = 0;
+    for (int i = list.len - 1; i >= 0; --i) {
+      pp_parser_t* node = list.nodes[i];
+      if (!node_list_has(nullable, node) && is_nullable(node, nullable)) {
+        node_list_add(nullable, node);
+        added = 1;
+      }
+    }
+  }
+  node_list_free(&list);
+}
+
+// whether parser can succeed without consuming input, given the nodes found
+// to so far
+static int is_nullable(pp_parser_t* parser, const node_list_t* nullable) {
+  int num;
+  pp_parser_t** parsers = children(parser, &num);
+  switch (parser->op) {
+  // expect only peeks, so it never consumes even though its first set is
+  // not empty
+  case PP_OP_EXPECT:
+  case PP_OP_OPTIONAL:
+  case PP_OP_MANY:
+    return 1;
+  case PP_OP_CHOICE:
+    for (int i = 0; i < num; ++i) {
+      if (node_list_has(nullable, parsers[i]))
+        return 1;
+    }
+    return 0;
+  case PP_OP_SEQUENCE:
+    for (int i = 0; i < num; ++i) {
+      if (!node_list_has(nullable, parsers[i]))
+        return 0;
+    }
+    return 1;
+  // a ref that is not set fails
+  case PP_OP_REF:
+    return num > 0 && node_list_has(nullable, parsers[0]);
+  default: {
+    if (num > 0)
+      return node_list_has(nullable, parsers[0]);
+    pp_class_t first;
+    int leaf_nullable;
+    first_set(parser, &first, &leaf_nullable);
+    return leaf_nullable;
+  }
+  }
+}
+
+// whether parser can run ref before consuming any input
+static int left_reaches(
+  pp_parser_t* parser, const pp_parser_t* ref, const node_list_t* nullable,
+  node_list_t* seen
+) {
+  if (parser == ref)
+    return 1;
+  if (!node_list_add(seen, parser))
+    return 0;
+  int num;
+  pp_parser_t** parsers = children(parser, &num);
+  for (int i = 0; i < num; ++i) {
+    if (left_reaches(parsers[i], ref, nullable, seen))
+      return 1;
+    // the rest of a sequence runs after input was consumed
+    if (parser->op == PP_OP_SEQUENCE && !node_list_has(nullable, parsers[i]))
+      break;
+  }
+  return 0;
+}
+
+// choices and expressions built before a ref under them was set could not
+// see through it, so their first sets are built again from the leaves up
+static void refresh_dispatch(node_list_t* seen, pp_parser_t* parser) {
+  if (!node_list_add(seen, parser))
+    return;
+  int num;
+  pp_parser_t** parsers = children(parser, &num);
+  for (int i = 0; i < num; ++i) {
+    refresh_dispatch(seen, parsers[i]);
+  }
+  if (parser->op == PP_OP_CHOICE)
+    build_dispatch(&parser->data.choice);
+  if (parser->op == PP_OP_EXPR)
+    build_operators(&parser->data.expr);
+}
+
+static int has_taps(pp_parser_t* parser) {
+  node_list_t list = {0};
+  collect_nodes(&list, parser);
+  int taps = 0;
+  for (int i = 0; i < list.len && !taps; ++i) {
+    taps = list.nodes[i]->op == PP_OP_TAP;
+  }
+  node_list_free(&list);
+  return taps;
+}
+
+// whether parser can pass a cut that commits the alternative parser is in,
+// rather than one inside it
+static int has_cut(pp_parser_t* parser) {
+  node_list_t seen = {0};
+  const int cut = reaches_cut(parser, &seen);
+  node_list_free(&seen);
+  return cut;
+}
+
+static int reaches_cut(pp_parser_t* parser, node_list_t* seen) {
+  if (!node_list_add(seen, parser))
+    return 0;
+  switch (parser->op) {
+  case PP_OP_CUT:
+    return 1;
+  // a ref that is not set yet may be set to anything
+  case PP_OP_REF:
+    return parser->data.ref.parser == NULL ||
+           reaches_cut(parser->data.ref.parser, seen);
+  // the cuts inside these commit their own alternatives and iterations
+  case PP_OP_OPTIONAL:
+  case PP_OP_CHOICE:
+  case PP_OP_MANY:
+    return 0;
+  // so do the ones in operators and what follows them, but not in the atom
+  case PP_OP_EXPR:
+    return reaches_cut(parser->data.expr.parsers[0], seen);
+  default: {
+    int num;
+    pp_parser_t** parsers = children(parser, &num);
+    for (int i = 0; i < num; ++i) {
+      if (reaches_cut(parsers[i], seen))
+        return 1;
+    }
+    return 0;
+  }
+  }
+}
+
+static pp_parser_t*
+optimize(optimizer_t* opt, pp_parser_t* parser, opt_use_t use) {
+  const opt_entry_t* entry = opt_slot(opt, parser, use);
+  if (entry->parser != NULL) {
+    return entry->result;
+  }
+
+  // the new ref is in the table before its target is optimized, so a cycle
+  // through the ref ends there
+  if (parser->op == PP_OP_REF) {
+    pp_parser_t* ref = pp_ref();
+    ref->name = parser->name;
+    *opt_slot(opt, parser, use) =
+      (opt_entry_t){.parser = parser, .use = use, .result = ref};
+    opt->len++;
+    if (parser->data.ref.parser != NULL)
+      pp_ref_set(ref, optimize(opt, parser->data.ref.parser, use));
+    return ref;
+  }
+
+  pp_parser_t* result = optimize_node(opt, parser, use);
+  // the node taking the place of a named one takes its name for errors, on a
+  // copy if it is shared with the original graph or has a name of its own
+  if (result != parser && parser->name != NULL &&
+      result->name != parser->name && result->op != PP_OP_REF) {
+    if (result->name != NULL || node_list_has(&opt->nodes, result)) {
+      pp_parser_t* copy = pp_init_parser();
+      *copy = *result;
+      result = copy;
+    }
+    result->name = parser->name;
+  }
+
+  // the table may have grown while optimizing the children
+  opt_entry_t* slot = opt_slot(opt, parser, use);
+  *slot = (opt_entry_t){.parser = parser, .use = use, .result = result};
+  opt->len++;
+  return result;
+}
+
+// children are optimized first. a node whose children did not change is
+// kept as it is.
+static pp_parser_t*
+optimize_node(optimizer_t* opt, pp_parser_t* parser, opt_use_t use) {
+  switch (parser->op) {
+  case PP_OP_OPTIONAL: {
+    pp_parser_t* child = optimize(opt, parser->data.optional.parser, use);
+    return child == parser->data.optional.parser ? parser : pp_optional(child);
+  }
+
+  case PP_OP_CHOICE:
+    return optimize_choice(opt, parser, use);
+
+  case PP_OP_MANY: {
+    pp_parser_t* child = optimize(opt, parser->data.many.parser, use);
+    return child == parser->data.many.parser ? parser : many_node(child, use);
+  }
+
+  case PP_OP_SEQUENCE:
+    return optimize_sequence(opt, parser, use);
+
+  // maps do not run while recognizing
+  case PP_OP_MAP: {
+    const pp_map_t* map = &parser->data.map;
+    if (use == USE_NOTHING) {
+      return optimize(opt, map->parser, USE_NOTHING);
+    }
+    if (map->map == skip && !has_taps(map->parser)) {
+      return recognize_node(optimize(opt, map->parser, USE_NOTHING));
+    }
+    pp_parser_t* child = optimize(
+      opt, map->parser, map->map == concat_string ? USE_TEXT : USE_OUTPUT
+    );
+    return child == map->parser ? parser : pp_map(child, map->map, map->arg);
+  }
+
+  case PP_OP_TAP: {
+    const pp_tap_t* tap = &parser->data.tap;
+    pp_parser_t* child = optimize(opt, tap->parser, USE_OUTPUT);
+    return child == tap->parser ? parser : pp_tap(child, tap->tap, tap->arg);
+  }
+
+  case PP_OP_MEMO: {
+    pp_parser_t* child = optimize(opt, parser->data.memo.parser, use);
+    return child == parser->data.memo.parser ? parser : pp_memo(child);
+  }
+
+  case PP_OP_TAGGED: {
+    const pp_tagged_t* tagged = &parser->data.tagged;
+    pp_parser_t* child = optimize(opt, tagged->parser, use);
+    if (child == tagged->parser) {
+      return parser;
+    }
+    return tagged->token ? pp_token(child, tagged->tag)
+                         : pp_node(child, tagged->tag);
+  }
+
+  case PP_OP_RECOGNIZE: {
+    pp_parser_t* child =
+      optimize(opt, parser->data.recognize.parser, USE_NOTHING);
+    return child == parser->data.recognize.parser ? parser
+                                                  : recognize_node(child);
+  }
+
+  // the operators are part of the tree unless nothing is
+  case PP_OP_EXPR: {
+    const pp_expr_t* expr = &parser->data.expr;
+    const opt_use_t inner = use == USE_NOTHING ? USE_NOTHING : USE_OUTPUT;
+    pp_parser_t* atom = optimize(opt, expr->parsers[0], inner);
+    int changed = atom != expr->parsers[0];
+    pp_operator_t* operators =
+      malloc(expr->num_operators * sizeof(pp_operator_t));
+    for (int i = 0; i < expr->num_operators; ++i) {
+      operators[i] = expr->operators[i];
+      operators[i].parser = optimize(opt, expr->parsers[i + 1], inner);
+      changed |= operators[i].parser != expr->parsers[i + 1];
+    }
+    pp_parser_t* result =
+      changed ? pp_expr(atom, expr->num_operators, operators) : parser;
+    free(operators);
+    return result;
+  }
+
+  default:
+    return parser;
+  }
+}
+
+// the slot for parser and use, or the empty slot where it belongs
+static opt_entry_t*
+opt_slot(optimizer_t* opt, const pp_parser_t* parser, opt_use_t use) {
+  if (opt->len * 2 >= opt->num_slots) {
+    const int num_slots = opt->num_slots ? opt->num_slots * 2 : 64;
+    opt_entry_t* slots = calloc(num_slots, sizeof(opt_entry_t));
+    for (int i = 0; i < opt->num_slots; ++i) {
+      const opt_entry_t* entry = &opt->slots[i];
+      if (entry->parser == NULL)
+        continue;
+      unsigned long h = ((unsigned long)entry->parser >> 4) * 3 + entry->use;
+      while (slots[h & (num_slots - 1)].parser != NULL)
+        h++;
+      slots[h & (num_slots - 1)] = *entry;
+    }
+    free(opt->slots);
+    opt->slots = slots;
+    opt->num_slots = num_slots;
+  }
+
+  unsigned long h = ((unsigned long)parser >> 4) * 3 + use;
+  for (;; h++) {
+    opt_entry_t* entry = &opt->slots[h & (opt->num_slots - 1)];
+    if (entry->parser == NULL ||
+        (entry->parser == parser && entry->use == use))
+      return entry;
+  }
+}
+
+// nested choices are spliced in before the alternatives are merged
+static pp_parser_t*
+optimize_choice(optimizer_t* opt, pp_parser_t* parser, opt_use_t use) {
+  const pp_choice_t* choice = &parser->data.choice;
+  int num_parsers = 0;
+  int changed = 0;
+  for (int i = 0; i < choice->num_parsers; ++i) {
+    pp_parser_t* child = optimize(opt, choice->parsers[i], use);
+    num_parsers += splices(opt, child) ? child->data.choice.num_parsers : 1;
+    changed |= child != choice->parsers[i];
+  }
+
+  pp_parser_t** parsers = malloc(num_parsers * sizeof(pp_parser_t*));
+  for (int i = 0, j = 0; i < choice->num_parsers; ++i) {
+    pp_parser_t* child = optimize(opt, choice->parsers[i], use);
+    if (splices(opt, child)) {
+      memcpy(
+        &parsers[j], child->data.choice.parsers,
+        child->data.choice.num_parsers * sizeof(pp_parser_t*)
+      );
+      j += child->data.choice.num_parsers;
+    } else {
+      parsers[j++] = child;
+    }
+  }
+
+  pp_parser_t* result = make_choice(opt, num_parsers, parsers, use);
+  free(parsers);
+  if (result->op == PP_OP_CHOICE && !changed &&
+      result->data.choice.num_parsers == choice->num_parsers) {
+    return parser;
+  }
+  return result;
+}
+
+// a cut in a nested choice commits to an alternative of it, after which the
+// alternatives of the parent are still tried. a named choice is kept for its
+// errors.
+static int splices(const optimizer_t* opt, pp_parser_t* child) {
+  if (child->op != PP_OP_CHOICE || child->name != NULL)
+    return 0;
+  if (!opt->cuts)
+    return 1;
+  for (int i = 0; i < child->data.choice.num_parsers; ++i) {
+    if (has_cut(child->data.choice.parsers[i]))
+      return 0;
+  }
+  return 1;
+}
+
+// a choice of optimized alternatives. runs of single byte alternatives become
+// one class, and runs of sequences starting with the same parser become that
+// parser followed by a choice of the rest. an alternative that can pass a cut
+// is left where it is, since the cut commits to the choice it is in, and so
+// is a named one, which is kept whole for its errors.
+static pp_parser_t* make_choice(
+  const optimizer_t* opt, int num_parsers, pp_parser_t** parsers,
+  opt_use_t use
+) {
+  pp_parser_t** merged = malloc(num_parsers * sizeof(pp_parser_t*));
+  int len = 0;
+  for (int i = 0; i < num_parsers;) {
+    int end = i + 1;
+    if (is_byte_class(parsers[i])) {
+      pp_class_t cls = {0};
+      while (end < num_parsers && is_byte_class(parsers[end]))
+        end++;
+      for (int j = i; j < end; ++j) {
+        cls = pp_class_union(cls, byte_class(parsers[j]));
+      }
+      merged[len++] = end - i > 1 ? pp_class(cls) : parsers[i];
+      i = end;
+      continue;
+    }
+
+    const pp_parser_t* first = hoistable(opt, parsers[i])
+                                 ? parsers[i]->data.sequence.parsers[0]
+                                 : NULL;
+    while (first != NULL && end < num_parsers &&
+           hoistable(opt, parsers[end]) &&
+           same_node(first, parsers[end]->data.sequence.parsers[0]))
+      end++;
+    // the first parser would run once instead of once per alternative
+    if (end - i < 2 || has_taps((pp_parser_t*)first)) {
+      merged[len++] = parsers[i];
+      i++;
+      continue;
+    }
+
+    pp_parser_t** rests = malloc((end - i) * sizeof(pp_parser_t*));
+    for (int j = i; j < end; ++j) {
+      const pp_sequence_t* seq = &parsers[j]->data.sequence;
+      pp_parser_t** rest = malloc(seq->num_parsers * sizeof(pp_parser_t*));
+      memcpy(
+        rest, seq->parsers + 1, (seq->num_parsers - 1) * sizeof(pp_parser_t*)
+      );
+      const int rest_len = fuse_literals(rest, seq->num_parsers - 1, use);
+      rests[j - i] = use == USE_NOTHING && rest_len == 0 ? pp_pure()
+                   : use == USE_NOTHING && rest_len == 1
+                     ? rest[0]
+                     : pp_sequence(rest_len, rest);
+      free(rest);
+    }
+    pp_parser_t* hoisted = pp_sequence(
+      2,
+      (pp_parser_t*[]){
+        parsers[i]->data.sequence.parsers[0],
+        make_choice(opt, end - i, rests, use),
+      }
+    );
+    free(rests);
+    // [first, [rest...]] is what the alternatives gave as [first, rest...]
+    merged[len++] =
+      use == USE_OUTPUT ? pp_map(hoisted, prepend_item, NULL) : hoisted;
+    i = end;
+  }
+
+  pp_parser_t* result =
+    len == 1 && !(opt->cuts && has_cut(merged[0])) ? merged[0]
+                                                   : pp_choice(len, merged);
+  free(merged);
+  return result;
+}
+
+// sequences whose output is not used as is are flattened into their parent,
+// unless they are named
+static pp_parser_t*
+optimize_sequence(optimizer_t* opt, pp_parser_t* parser, opt_use_t use) {
+  const pp_sequence_t* seq = &parser->data.sequence;
+  int num_parsers = 0;
+  int changed = 0;
+  for (int i = 0; i < seq->num_parsers; ++i) {
+    pp_parser_t* child = optimize(opt, seq->parsers[i], use);
+    const int splice = use != USE_OUTPUT && child->op == PP_OP_SEQUENCE &&
+                       child->name == NULL;
+    num_parsers += splice ? child->data.sequence.num_parsers : 1;
+    changed |= child != seq->parsers[i] || splice;
+  }
+
+  pp_parser_t** parsers = malloc(num_parsers * sizeof(pp_parser_t*));
+  for (int i = 0, j = 0; i < seq->num_parsers; ++i) {
+    pp_parser_t* child = optimize(opt, seq->parsers[i], use);
+    if (use != USE_OUTPUT && child->op == PP_OP_SEQUENCE &&
+        child->name == NULL) {
+      memcpy(
+        &parsers[j], child->data.sequence.parsers,
+        child->data.sequence.num_parsers * sizeof(pp_parser_t*)
+      );
+      j += child->data.sequence.num_parsers;
+    } else {
+      parsers[j++] = child;
+    }
+  }
+
+  const int len = fuse_literals(parsers, num_parsers, use);
+  pp_parser_t* result = parser;
+  if (use == USE_NOTHING && len == 0) {
+    result = pp_pure();
+  } else if (use == USE_NOTHING && len == 1) {
+    result = parsers[0];
+  } else if (changed || len != num_parsers) {
+    result = pp_sequence(len, parsers);
+  }
+  free(parsers);
+  return result;
+}
+
+// joins adjacent literals in place and returns the new length. when the
+// output is only text, strings next to each other are contiguous slices either
+// way. chars are only joined when the output is dropped, since a char breaks a
+// slice into a string. empty sequences and pure are dropped then too. named
+// literals are left alone.
+static int
+fuse_literals(pp_parser_t** parsers, int num_parsers, opt_use_t use) {
+  if (use == USE_OUTPUT) {
+    return num_parsers;
+  }
+
+  int len = 0;
+  for (int i = 0; i < num_parsers;) {
+    const pp_op_t op = parsers[i]->op;
+    const int fusable = parsers[i]->name == NULL &&
+                        (op == PP_OP_STRING ||
+                         (use == USE_NOTHING && op == PP_OP_STRING_NO_CASE) ||
+                         (use == USE_NOTHING && op == PP_OP_CHAR &&
+                          parsers[i]->data.chr.c != '\0'));
+    if (use == USE_NOTHING && op == PP_OP_PURE) {
+      i++;
+      continue;
+    }
+    if (!fusable) {
+      parsers[len++] = parsers[i++];
+      continue;
+    }
+
+    // chars and strings go together, strings without case only with their own
+    const int no_case = op == PP_OP_STRING_NO_CASE;
+    int end = i;
+    int text_len = 0;
+    while (end < num_parsers) {
+      const pp_parser_t* p = parsers[end];
+      if (p->name != NULL)
+        break;
+      if (no_case ? p->op != PP_OP_STRING_NO_CASE
+                  : !(p->op == PP_OP_STRING ||
+                      (use == USE_NOTHING && p->op == PP_OP_CHAR &&
+                       p->data.chr.c != '\0')))
+        break;
+      text_len += p->op == PP_OP_CHAR ? 1 : p->data.string.len;
+      end++;
+    }
+    if (end - i == 1) {
+      parsers[len++] = parsers[i++];
+      continue;
+    }
+
+    char* text = malloc(text_len + 1);
+    char* dst = text;
+    for (int j = i; j < end; ++j) {
+      const pp_parser_t* p = parsers[j];
+      if (p->op == PP_OP_CHAR) {
+        *dst++ = p->data.chr.c;
+      } else {
+        memcpy(dst, p->data.string.string, p->data.string.len);
+        dst += p->data.string.len;
+      }
+    }
+    *dst = '\0';
+    parsers[len++] = no_case ? pp_string_no_case(text) : pp_string(text);
+    free(text);
+    i = end;
+  }
+  return len;
+}
+
+// the same node, or leaves matching the same thing
+static int same_node(const pp_parser_t* a, const pp_parser_t* b) {
+  if (a == b) {
+    return 1;
+  }
+  if (a->op != b->op) {
+    return 0;
+  }
+  switch (a->op) {
+  case PP_OP_PURE:
+  case PP_OP_FAIL:
+  case PP_OP_EOF:
+    return 1;
+  case PP_OP_EXPECT:
+    return a->data.expect.c == b->data.expect.c;
+  case PP_OP_CHAR:
+    return a->data.chr.c == b->data.chr.c;
+  case PP_OP_STRING:
+  case PP_OP_STRING_NO_CASE:
+    return a->data.string.len == b->data.string.len &&
+           memcmp(
+             a->data.string.string, b->data.string.string, a->data.string.len
+           ) == 0;
+  case PP_OP_ANY_OF:
+  case PP_OP_NONE_OF: {
+    const pp_class_t x = byte_class(a);
+    const pp_class_t y = byte_class(b);
+    return memcmp(&x, &y, sizeof(pp_class_t)) == 0;
+  }
+  case PP_OP_SPAN:
+    return a->data.span.min == b->data.span.min &&
+           memcmp(
+             &a->data.span.cls, &b->data.span.cls, sizeof(pp_class_t)
+           ) == 0;
+  default:
+    return 0;
+  }
+}
+
+// parsers that consume one byte in a class and output it as a char
+static int is_byte_class(const pp_parser_t* parser) {
+  return parser->name == NULL &&
+         (parser->op == PP_OP_CHAR || parser->op == PP_OP_ANY_OF ||
+          parser->op == PP_OP_NONE_OF);
+}
+
+static int hoistable(const optimizer_t* opt, pp_parser_t* parser) {
+  return parser->op == PP_OP_SEQUENCE &&
+         parser->data.sequence.num_parsers > 0 && parser->name == NULL &&
+         !(opt->cuts && has_cut(parser));
+}
+
+static pp_class_t byte_class(const pp_parser_t* parser) {
+  switch (parser->op) {
+  case PP_OP_CHAR:
+    return pp_class_range(parser->data.chr.c, parser->data.chr.c);
+  case PP_OP_ANY_OF:
+    return parser->data.any_of.cls;
+  default:
+    return parser->data.none_of.cls;
+  }
+}
+
+// pp_many turns a many over a byte class into a span, which outputs a slice
+// instead of an array of chars. that is only the same when nothing looks at
+// the output.
+static pp_parser_t* many_node(pp_parser_t* parser, opt_use_t use) {
+  if (use == USE_NOTHING) {
+    return pp_many(parser);
+  }
+  return make_node(
+    &(pp_parser_t){.op = PP_OP_MANY, .data.many.parser = parser}
+  );
+}
+
+static pp_parser_t* recognize_node(pp_parser_t* parser) {
+  return make_node(&(pp_parser_t){
+    .op = PP_OP_RECOGNIZE,
+    .data.recognize.parser = parser,
+  });
+}
+
+#ifdef PP_PROFILE
+
+// nodes are shared by every thread parsing with them
+#define PROFILE_ADD(field, n) \
+  __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+
+// the time of the nodes run inside parser is gathered in the context while
+// it runs, so what is left of its own time is self time
+static pp_result_t profiled(pp_parser_t* parser, pp_state_t state) {
+  pp_ctx_t* ctx = state.ctx;
+  const long outer_child_ns = ctx->profile_child_ns;
+  const int outer_reach = ctx->profile_reach;
+  ctx->profile_child_ns = 0;
+  ctx->profile_reach = state.pos;
+
+  const long start = profile_now();
+  const pp_result_t result = parse_node(parser, state);
+  const long elapsed = profile_now() - start;
+
+  pp_profile_t* profile = &parser->profile;
+  PROFILE_ADD(profile->calls, 1);
+  if (result.status == PP_OK) {
+    PROFILE_ADD(profile->successes, 1);
+    PROFILE_ADD(profile->bytes, result.pos - state.pos);
+    if (result.pos > ctx->profile_reach)
+      ctx->profile_reach = result.pos;
+  } else {
+    PROFILE_ADD(profile->failures, 1);
+    PROFILE_ADD(profile->backtracked, ctx->profile_reach - state.pos);
+  }
+  PROFILE_ADD(profile->total_ns, elapsed);
+  PROFILE_ADD(profile->self_ns, elapsed - ctx->profile_child_ns);
+
+  ctx->profile_child_ns = outer_child_ns + elapsed;
+  if (outer_reach > ctx->profile_reach)
+    ctx->profile_reach = outer_reach;
+  return result;
+}
+
+static long profile_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static const char* op_names[] = {
+  [PP_OP_PURE] = "pure",
+  [PP_OP_FAIL] = "fail",
+  [PP_OP_EOF] = "eof",
+  [PP_OP_EXPECT] = "expect",
+  [PP_OP_SELECT] = "select",
+  [PP_OP_CHAR] = "char",
+  [PP_OP_STRING] = "string",
+  [PP_OP_STRING_NO_CASE] = "string_no_case",
+  [PP_OP_ANY_OF] = "any_of",
+  [PP_OP_NONE_OF] = "none_of",
+  [PP_OP_SPAN] = "span",
+  [PP_OP_KEYWORDS] = "keywords",
+  [PP_OP_OPTIONAL] = "optional",
+  [PP_OP_CHOICE] = "choice",
+  [PP_OP_MANY] = "many",
+  [PP_OP_SEQUENCE] = "sequence",
+  [PP_OP_MAP] = "map",
+  [PP_OP_TAP] = "tap",
+  [PP_OP_MEMO] = "memo",
+  [PP_OP_PARALLEL_LIST] = "parallel_list",
+  [PP_OP_TAGGED] = "tagged",
+  [PP_OP_RECOGNIZE] = "recognize",
+  [PP_OP_REF] = "ref",
+  [PP_OP_EXPR] = "expr",
+  [PP_OP_CUT] = "cut",
+};
+
+// unnamed nodes are labelled with their op under the nearest named node
+// above them, e.g. select_list/choice
+static void profile_label(
+  pp_parser_t* parser, const char* outer, const char** labels,
+  node_list_t* list, char* buffer, int len
+) {
+  if (!node_list_add(list, parser)) {
+    return;
+  }
+  const int at = list->len - 1;
+  if (parser->name != NULL) {
+    outer = parser->name;
+    labels[at] = parser->name;
+  } else {
+    labels[at] = buffer + at * len;
+    snprintf(
+      buffer + at * len, len, "%s%s%s", outer ? outer : "", outer ? "/" : "",
+      op_names[parser->op]
+    );
+  }
+
+  int num;
+  pp_parser_t** parsers = children(parser, &num);
+  for (int i = 0; i < num; ++i) {
+    profile_label(parsers[i], outer, labels, list, buffer, len);
+  }
+}
+
+static int by_self_time(const void* a, const void* b) {
+  const long x = ((const profile_row_t*)a)->parser->profile.self_ns;
+  const long y = ((const profile_row_t*)b)->parser->profile.self_ns;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+#endif
+
+// named nodes are tracked for the errors of failures at their start
+static void compile(compiler_t* compiler, const pp_parser_t* parser) {
+  if (parser->name != NULL)
+    emit(compiler, PP_I_ENTER, 0, parser);
+
+  switch (parser->op) {
+  case PP_OP_PURE:
+    emit(compiler, PP_I_PURE, 0, parser);
+    break;
+
+  case PP_OP_FAIL:
+    emit(compiler, PP_I_FAIL, 0, parser);
+    break;
+
+  case PP_OP_EOF:
+    emit(compiler, PP_I_EOF, 0, parser);
+    break;
+
+  case PP_OP_EXPECT:
+    emit(compiler, PP_I_EXPECT, parser->data.expect.c, parser);
+    break;
+
+  case PP_OP_CHAR:
+    emit(compiler, PP_I_CHAR, parser->data.chr.c, parser);
+    break;
+
+  case PP_OP_STRING:
+    emit(compiler, PP_I_STRING, 0, parser);
+    break;
+
+  case PP_OP_STRING_NO_CASE:
+    emit(compiler, PP_I_STRING_NO_CASE, 0, parser);
+    break;
+
+  case PP_OP_ANY_OF:
+  case PP_OP_NONE_OF:
+    emit(compiler, PP_I_CLASS, 0, parser);
+    break;
+
+  case PP_OP_SPAN:
+    emit(compiler, PP_I_SPAN, 0, parser);
+    break;
+
+  case PP_OP_KEYWORDS:
+    emit(compiler, PP_I_KEYWORDS, 0, parser);
+    break;
+
+  case PP_OP_CUT:
+    emit(compiler, PP_I_CUT, 0, parser);
+    break;
+
+  case PP_OP_OPTIONAL: {
+    const int choice = emit(compiler, PP_I_CHOICE, 0, parser);
+    compile(compiler, parser->data.optional.parser);
+    const int commit = emit(compiler, PP_I_COMMIT, 0, parser);
+    patch(compiler, choice);
+    emit(compiler, PP_I_PURE, 0, parser);
+    patch(compiler, commit);
+    break;
+  }
+
+  // every alternative but the last pushes a backtrack entry. the commits are
+  // chained through their args until the end of the choice is known. the
+  // last gets one too when it can pass a cut, which must not reach the
+  // entries of the alternatives around the choice.
+  case PP_OP_CHOICE: {
+    const int num_parsers = parser->data.choice.num_parsers;
+    if (num_parsers == 0) {
+      emit(compiler, PP_I_FAIL, 0, parser);
+      break;
+    }
+
+    int commits = -1;
+    for (int i = 0; i < num_parsers - 1; ++i) {
+      const pp_class_t* first = &parser->data.choice.firsts[i];
+      const int test = class_is_full(first) ? -1 : emit_test(compiler, first);
+      const int choice = emit(compiler, PP_I_CHOICE, 0, parser);
+      compile(compiler, parser->data.choice.parsers[i]);
+      commits = emit(compiler, PP_I_COMMIT, commits, parser);
+      patch(compiler, choice);
+      if (test != -1)
+        patch(compiler, test);
+    }
+    pp_parser_t* last = parser->data.choice.parsers[num_parsers - 1];
+    if (has_cut(last)) {
+      const int choice = emit(compiler, PP_I_CHOICE, 0, parser);
+      compile(compiler, last);
+      commits = emit(compiler, PP_I_COMMIT, commits, parser);
+      patch(compiler, choice);
+      emit(compiler, PP_I_FAIL, 0, parser);
+    } else {
+      compile(compiler, last);
+    }
+
+    while (commits != -1) {
+      const int next = compiler->code[commits].arg;
+      patch(compiler, commits);
+      commits = next;
+    }
+    break;
+  }
+
+  // one backtrack entry for the whole loop, moved forward after every
+  // iteration. a failed iteration pops it and lands on the collect.
+  case PP_OP_MANY: {
+    emit(compiler, PP_I_MARK, 0, parser);
+    const int choice = emit(compiler, PP_I_CHOICE, 0, parser);
+    const int loop = emit(compiler, PP_I_NOT_AT_END, 0, parser);
+    compile(compiler, parser->data.many.parser);
+    emit(compiler, PP_I_PARTIAL_COMMIT, loop, parser);
+    patch(compiler, choice);
+    emit(compiler, PP_I_COLLECT, 0, parser);
+    break;
+  }
+
+  case PP_OP_SEQUENCE: {
+    const int num_parsers = parser->data.sequence.num_parsers;
+    for (int i = 0; i < num_parsers; ++i) {
+      compile(compiler, parser->data.sequence.parsers[i]);
+    }
+    emit(compiler, PP_I_ARRAY, num_parsers, parser);
+    break;
+  }
+
+  // concat_string is given the input its parser consumed, from a position
+  // pushed before it
+  case PP_OP_MAP:
+    if (parser->data.map.map == concat_string) {
+      emit(compiler, PP_I_POSITION, 0, parser);
+      compile(compiler, parser->data.map.parser);
+      emit(compiler, PP_I_CONCAT_STRING, 0, parser);
+      break;
+    }
+    compile(compiler, parser->data.map.parser);
+    emit(compiler, PP_I_MAP, 0, parser);
+    break;
 
-pp_parser_t* pp_skip(pp_parser_t* parser) {
-  return pp_map(parser, skip, NULL);
-}
+  case PP_OP_TAP:
+    compile(compiler, parser->data.tap.parser);
+    emit(compiler, PP_I_TAP, 0, parser);
+    break;
 
-pp_parser_t* pp_concat_string(int num_parsers, pp_parser_t** parsers) {
-  return pp_map(pp_sequence(num_parsers, parsers), concat_string, NULL);
-}
+  // programs do not report events
+  case PP_OP_TAGGED:
+    compile(compiler, parser->data.tagged.parser);
+    break;
 
-pp_parser_t* pp_concat_array(int num_parsers, pp_parser_t** parsers) {
-  return pp_map(pp_sequence(num_parsers, parsers), concat_array, NULL);
-}
+  // programs always build outputs, so this is the same as a skip
+  case PP_OP_RECOGNIZE:
+    compile(compiler, parser->data.recognize.parser);
+    emit(compiler, PP_I_MAP, 0, &skip_parser);
+    break;
 
-pp_parser_t* pp_select(pp_parser_t* parser, int pos) {
-  return pp_map(parser, select, (void*)(long long)1);
-}
+  case PP_OP_REF: {
+    if (parser->data.ref.parser == NULL) {
+      emit(compiler, PP_I_FAIL, 0, parser);
+      break;
+    }
+    int i = 0;
+    while (i < compiler->num_refs && compiler->refs[i].ref != parser)
+      i++;
+    if (i == compiler->num_refs) {
+      if (compiler->num_refs == compiler->refs_cap) {
+        compiler->refs_cap = compiler->refs_cap ? compiler->refs_cap * 2 : 8;
+        compiler->refs = realloc(
+          compiler->refs, compiler->refs_cap * sizeof(compiler_ref_t)
+        );
+      }
+      compiler->refs[compiler->num_refs++] =
+        (compiler_ref_t){.ref = parser, .body = -1, .calls = -1};
+    }
+    compiler_ref_t* ref = &compiler->refs[i];
+    if (ref->body != -1) {
+      emit(compiler, PP_I_CALL, ref->body, parser);
+    } else {
+      ref->calls = emit(compiler, PP_I_CALL, ref->calls, parser);
+    }
+    break;
+  }
 
-pp_parser_t* pp_whitespace() {
-  return pp_many(pp_any_of(" \t\n\r"));
-}
+  default:
+    emit(compiler, PP_I_TREE, 0, parser);
+    break;
+  }
 
-pp_parser_t* pp_alpha() {
-  return pp_any_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
+  if (parser->name != NULL)
+    emit(compiler, PP_I_LEAVE, 0, parser);
 }
 
-pp_parser_t* pp_alphanumeric_or_underscore() {
-  return pp_any_of(
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_"
-  );
+static int emit(
+  compiler_t* compiler, pp_opcode_t op, int arg, const pp_parser_t* parser
+) {
+  if (compiler->len >= compiler->cap) {
+    compiler->cap = compiler->cap == 0 ? 64 : compiler->cap * 2;
+    compiler->code =
+      realloc(compiler->code, compiler->cap * sizeof(pp_inst_t));
+  }
+  compiler->code[compiler->len] =
+    (pp_inst_t){.op = op, .arg = arg, .parser = parser};
+  return compiler->len++;
 }
 
-pp_parser_t* pp_skip_whitespace() {
-  return pp_map(pp_whitespace(), skip, NULL);
+static int emit_test(compiler_t* compiler, const pp_class_t* cls) {
+  const int at = emit(compiler, PP_I_TEST, 0, NULL);
+  compiler->code[at].cls = cls;
+  return at;
 }
 
-pp_parser_t* pp_whitespace_delimited(pp_parser_t* parser) {
-  return pp_select(
-    pp_sequence(
-      3,
-      (pp_parser_t*[]){
-        pp_skip_whitespace(),
-        parser,
-        pp_skip_whitespace(),
-      }
-    ),
-    2
-  );
+static void patch(compiler_t* compiler, int at) {
+  compiler->code[at].arg = compiler->len;
 }
 
-pp_parser_t* pp_separated_list(pp_parser_t* item, pp_parser_t* separator) {
-  return pp_concat_array(
-    2,
-    (pp_parser_t*[]){
-      item,
-      pp_many(pp_select(
-        pp_sequence(
-          2,
-          (pp_parser_t*[]){
-            separator,
-            item,
-          }
-        ),
-        0
-      )),
-    }
-  );
+static void* grow(void* data, int* cap, size_t size, void* inline_data) {
+  void* new_data;
+  if (data == inline_data) {
+    new_data = malloc(*cap * 2 * size);
+    memcpy(new_data, data, *cap * size);
+  } else {
+    new_data = realloc(data, *cap * 2 * size);
+  }
+  *cap *= 2;
+  return new_data;
 }
 
-pp_parser_t* pp_comma_separated_list(pp_parser_t* parser) {
-  return pp_separated_list(parser, pp_string(","));
+static inline int class_has(const pp_class_t* cls, unsigned char c) {
+  return (cls->bits[c >> 5] >> (c & 31)) & 1;
 }
 
-pp_parser_t* pp_copy_string_ref(pp_parser_t* parser, const char** str_ref) {
-  return pp_tap(parser, copy_string_ref, (void*)str_ref);
+static int class_is_full(const pp_class_t* cls) {
+  for (int i = 0; i < 8; ++i) {
+    if (cls->bits[i] != ~0u)
+      return 0;
+  }
+  return 1;
 }
 
-pp_parser_t* pp_copy_string_array_ref(pp_parser_t* parser, void* len_arr_ref) {
-  return pp_tap(parser, copy_string_array_ref, (void*)len_arr_ref);
+// writes at most PP_SPAN_MAX_RANGES ranges and returns how many the class
+// needs, so a result above the maximum means the class did not fit
+static int class_ranges(const pp_class_t* cls, pp_byte_range_t* ranges) {
+  int num_ranges = 0;
+  for (int c = 0; c < 256; ++c) {
+    if (!class_has(cls, c))
+      continue;
+    const int lo = c;
+    while (c + 1 < 256 && class_has(cls, c + 1))
+      c++;
+    if (num_ranges < PP_SPAN_MAX_RANGES)
+      ranges[num_ranges] = (pp_byte_range_t){.lo = lo, .hi = c};
+    num_ranges++;
+  }
+  return num_ranges;
 }
 
-static pp_result_t parse(pp_parser_t* parser, pp_state_t state) {
-  const char* input = state.input;
-  const int pos = state.pos;
-  const int input_len = strlen(input);
+// conservative: first holds every byte the parser can start with and
+// nullable is set when it may succeed without consuming a byte
+static void
+first_set(const pp_parser_t* parser, pp_class_t* first, int* nullable) {
+  *first = (pp_class_t){0};
+  *nullable = 0;
 
   switch (parser->op) {
-  case PP_OP_PURE:
-    return ok(pos, none(), input + pos);
+  case PP_OP_FAIL:
+    break;
 
+  case PP_OP_PURE:
   case PP_OP_EOF:
-    if (input[pos] == '\0')
-      return ok(pos, none(), input + pos);
+    *nullable = 1;
     break;
 
   case PP_OP_EXPECT:
-    if (input[pos] == parser->data.expect.c)
-      return ok(pos, none(), input + pos + 1);
+    *first = pp_class_range(parser->data.expect.c, parser->data.expect.c);
     break;
 
   case PP_OP_CHAR:
-    if (input[pos] == parser->data.chr.c)
-      return ok(pos + 1, chr(input[pos]), input + pos + 1);
+    *first = pp_class_range(parser->data.chr.c, parser->data.chr.c);
     break;
 
   case PP_OP_STRING: {
-    const char* str = parser->data.string.string;
-    const size_t len = strlen(str);
-    if (strncmp(input + pos, str, len) == 0)
-      return ok(pos + len, string(len, &input[pos]), input + pos + len);
+    const char c = parser->data.string.string[0];
+    *first = pp_class_range(c, c);
+    *nullable = parser->data.string.len == 0;
     break;
   }
 
   case PP_OP_STRING_NO_CASE: {
-    const char* str = parser->data.string.string;
-    const size_t len = strlen(str);
-    if (strncasecmp(input + pos, str, len) == 0)
-      return ok(pos + len, string(len, &input[pos]), input + pos + len);
+    const unsigned char c = parser->data.string_no_case.string[0];
+    *first = pp_class_union(
+      pp_class_range(tolower(c), tolower(c)),
+      pp_class_range(toupper(c), toupper(c))
+    );
+    *nullable = parser->data.string_no_case.len == 0;
     break;
   }
 
-  case PP_OP_ANY_OF: {
-    const char* chars = parser->data.any_of.chars;
-    if (strchr(chars, input[pos]) != NULL)
-      return ok(pos + 1, chr(input[pos]), input + pos + 1);
+  case PP_OP_ANY_OF:
+    *first = parser->data.any_of.cls;
     break;
-  }
 
-  case PP_OP_NONE_OF: {
-    const char* chars = parser->data.none_of.chars;
-    if (strchr(chars, input[pos]) == NULL)
-      return ok(pos + 1, chr(input[pos]), input + pos + 1);
+  case PP_OP_NONE_OF:
+    *first = parser->data.none_of.cls;
     break;
-  }
 
-  case PP_OP_OPTIONAL: {
-    pp_result_t result = parse(parser->data.optional.parser, state);
-    if (result.status == PP_ERROR_UNEXPECTED_TOK)
-      return ok(pos, none(), input + pos);
-    else
-      return result;
+  case PP_OP_SPAN:
+    *first = parser->data.span.cls;
+    *nullable = parser->data.span.min == 0;
+    break;
+
+  case PP_OP_KEYWORDS: {
+    const pp_keywords_t* keywords = &parser->data.keywords;
+    for (int c = 0; c < 256; ++c) {
+      if (keywords->trie->root[c] == -1)
+        continue;
+      *first = pp_class_union(*first, pp_class_range(c, c));
+      if (keywords->flags & PP_KEYWORDS_NO_CASE)
+        *first =
+          pp_class_union(*first, pp_class_range(toupper(c), toupper(c)));
+    }
+    *nullable = keywords->trie->terminals[0] != -1;
+    break;
   }
 
+  case PP_OP_OPTIONAL:
+    first_set(parser->data.optional.parser, first, nullable);
+    *nullable = 1;
+    break;
+
   case PP_OP_CHOICE: {
-    for (size_t i = 0; i < parser->data.choice.num_parsers; ++i) {
-      pp_parser_t* p = parser->data.choice.parsers[i];
-      pp_result_t result = parse(p, state);
-      if (result.status == PP_OK) {
-        return result;
-      }
+    const pp_choice_t* choice = &parser->data.choice;
+    for (int i = 0; i < choice->num_parsers; ++i) {
+      *first = pp_class_union(*first, choice->firsts[i]);
     }
+    *nullable = choice->dispatch[257] > choice->dispatch[256];
     break;
   }
 
-  case PP_OP_MANY: {
-    int len = 0;
-    int max_len = 4096;
-    // using C malloc because I am lazy. Could use linked list.
-    // Also this creates less garbage on the arena.
-    pp_output_t* outputs = malloc(max_len * sizeof(pp_output_t*));
+  case PP_OP_MANY:
+    first_set(parser->data.many.parser, first, nullable);
+    *nullable = 1;
+    break;
 
-    while (state.pos < input_len) {
-      const pp_result_t result = parse(parser->data.many.parser, state);
-      if (result.status != PP_OK) {
+  // a child that may be a cut is reached without consuming anything, and
+  // the sequence has to be tried even at the end of the input
+  case PP_OP_SEQUENCE: {
+    *nullable = 1;
+    for (int i = 0; i < parser->data.sequence.num_parsers && *nullable; ++i) {
+      pp_class_t child;
+      first_set(parser->data.sequence.parsers[i], &child, nullable);
+      *first = pp_class_union(*first, child);
+      if (*nullable && class_is_full(&child))
         break;
-      }
+    }
+    break;
+  }
 
-      if (len >= max_len) {
-        outputs = realloc(outputs, max_len * 2 * sizeof(pp_output_t*));
-        max_len = max_len * 2;
-      }
+  case PP_OP_MAP:
+    first_set(parser->data.map.parser, first, nullable);
+    break;
 
-      outputs[len++] = result.output;
-      state.pos = result.pos;
+  case PP_OP_TAP:
+    first_set(parser->data.tap.parser, first, nullable);
+    break;
+
+  case PP_OP_MEMO:
+    first_set(parser->data.memo.parser, first, nullable);
+    break;
+
+  case PP_OP_PARALLEL_LIST:
+    first_set(parser->data.parallel_list.item, first, nullable);
+    break;
+
+  case PP_OP_TAGGED:
+    first_set(parser->data.tagged.parser, first, nullable);
+    break;
+
+  case PP_OP_RECOGNIZE:
+    first_set(parser->data.recognize.parser, first, nullable);
+    break;
+
+  // a ref that is not set yet, or is met again through itself, could start
+  // with anything
+  case PP_OP_REF: {
+    pp_ref_t* ref = (pp_ref_t*)&parser->data.ref;
+    if (ref->parser == NULL || ref->busy) {
+      *first = pp_class_complement((pp_class_t){0});
+      *nullable = 1;
+      break;
+    }
+    ref->busy = 1;
+    first_set(ref->parser, first, nullable);
+    ref->busy = 0;
+    break;
+  }
+
+  // operators have to consume, so only the atom can match nothing. when it
+  // does, the operators after an operand come first.
+  case PP_OP_EXPR:
+    first_set(parser->data.expr.parsers[0], first, nullable);
+    *first = pp_class_union(*first, parser->data.expr.prefixes);
+    if (*nullable)
+      *first = pp_class_union(*first, parser->data.expr.suffixes);
+    break;
+
+  // an alternative that starts with a cut is committed to before any byte
+  // is looked at, so it is tried whatever comes next
+  case PP_OP_CUT:
+    *first = pp_class_complement((pp_class_t){0});
+    *nullable = 1;
+    break;
+
+  default:
+    *first = pp_class_complement((pp_class_t){0});
+    *nullable = 1;
+    break;
+  }
+}
+
+static void build_dispatch(pp_choice_t* choice) {
+  const int n = choice->num_parsers;
+  int* nullable = malloc((n + 1) * sizeof(int));
+
+  choice->firsts = pp_alloc(n * sizeof(pp_class_t));
+  for (int i = 0; i < n; ++i) {
+    first_set(choice->parsers[i], &choice->firsts[i], &nullable[i]);
+    if (nullable[i])
+      choice->firsts[i] = pp_class_complement((pp_class_t){0});
+  }
+
+  choice->dispatch = pp_alloc(258 * sizeof(int));
+  int len = 0;
+  for (int c = 0; c < 257; ++c) {
+    choice->dispatch[c] = len;
+    for (int i = 0; i < n; ++i) {
+      len += c < 256 ? class_has(&choice->firsts[i], c) : nullable[i];
     }
+  }
+  choice->dispatch[257] = len;
 
-    const pp_result_t result = ok(state.pos, array(len, outputs), input + pos);
-    free(outputs);
-    return result;
+  choice->alternatives = pp_alloc((len + 1) * sizeof(int));
+  for (int c = 0, j = 0; c < 257; ++c) {
+    for (int i = 0; i < n; ++i) {
+      if (c < 256 ? class_has(&choice->firsts[i], c) : nullable[i])
+        choice->alternatives[j++] = i;
+    }
   }
+  free(nullable);
+}
 
-  case PP_OP_SEQUENCE: {
-    int num_parsers = parser->data.sequence.num_parsers;
-    pp_parser_t** parsers = parser->data.sequence.parsers;
-    pp_output_t* outputs = malloc(num_parsers * sizeof(pp_output_t));
+static void build_operators(pp_expr_t* expr) {
+  expr->firsts = pp_alloc(expr->num_operators * sizeof(pp_class_t));
+  expr->prefixes = (pp_class_t){0};
+  expr->suffixes = (pp_class_t){0};
+  for (int i = 0; i < expr->num_operators; ++i) {
+    int nullable;
+    first_set(expr->parsers[i + 1], &expr->firsts[i], &nullable);
+    pp_class_t* all = expr->operators[i].fixity == PP_PREFIX
+                        ? &expr->prefixes
+                        : &expr->suffixes;
+    *all = pp_class_union(*all, expr->firsts[i]);
+  }
+}
 
-    for (int i = 0; i < num_parsers; ++i) {
-      pp_parser_t* p = parsers[i];
-      pp_result_t result = parse(p, state);
+// the trie is built with sibling lists on the heap and then flattened into
+// the current allocator. words are lowercased for PP_KEYWORDS_NO_CASE.
+static const pp_trie_t*
+build_trie(int num_words, const char** words, int flags) {
+  typedef struct {
+    int child;
+    int sibling;
+    int terminal;
+    unsigned char c;
+  } node_t;
 
-      if (result.status != PP_OK) {
-        free(outputs);
-        return err(state.pos, result.status);
+  int num_nodes = 1, cap = 64;
+  node_t* nodes = malloc(cap * sizeof(node_t));
+  nodes[0] = (node_t){.child = -1, .sibling = -1, .terminal = -1};
+
+  for (int i = 0; i < num_words; ++i) {
+    int node = 0;
+    for (const unsigned char* w = (const unsigned char*)words[i]; *w; ++w) {
+      const unsigned char c =
+        flags & PP_KEYWORDS_NO_CASE ? tolower(*w) : *w;
+
+      // grown before taking a pointer into it
+      if (num_nodes == cap) {
+        cap *= 2;
+        nodes = realloc(nodes, cap * sizeof(node_t));
       }
 
-      outputs[i] = result.output;
-      state.pos = result.pos;
+      // children are kept sorted by byte
+      int* link = &nodes[node].child;
+      while (*link != -1 && nodes[*link].c < c)
+        link = &nodes[*link].sibling;
+
+      if (*link == -1 || nodes[*link].c != c) {
+        nodes[num_nodes] =
+          (node_t){.child = -1, .sibling = *link, .terminal = -1, .c = c};
+        *link = num_nodes++;
+      }
+      node = *link;
     }
+    if (nodes[node].terminal == -1)
+      nodes[node].terminal = i;
+  }
 
-    // we can make a non copying array function and just pass the allocated
-    // array. this avoids malloc
-    pp_result_t result =
-      ok(state.pos, array(num_parsers, outputs), input + state.pos);
-    free(outputs);
-    return result;
+  pp_trie_t* trie = pp_alloc(sizeof(pp_trie_t));
+  trie->num_nodes = num_nodes;
+  trie->terminals = pp_alloc(num_nodes * sizeof(int));
+  trie->edge_starts = pp_alloc((num_nodes + 1) * sizeof(int));
+  trie->edge_bytes = pp_alloc(num_nodes * sizeof(unsigned char));
+  trie->edge_targets = pp_alloc(num_nodes * sizeof(int));
+
+  for (int c = 0; c < 256; ++c) {
+    trie->root[c] = -1;
   }
-  case PP_OP_MAP: {
-    pp_result_t result = parse(parser->data.tap.parser, state);
-    if (result.status == PP_OK) {
-      result.output = parser->data.map.map(result.output, parser->data.map.arg);
+  for (int child = nodes[0].child; child != -1; child = nodes[child].sibling) {
+    trie->root[nodes[child].c] = child;
+  }
+
+  int num_edges = 0;
+  for (int node = 0; node < num_nodes; ++node) {
+    trie->terminals[node] = nodes[node].terminal;
+    trie->edge_starts[node] = num_edges;
+    for (int child = nodes[node].child; child != -1;
+         child = nodes[child].sibling) {
+      trie->edge_bytes[num_edges] = nodes[child].c;
+      trie->edge_targets[num_edges] = child;
+      num_edges++;
     }
-    return result;
   }
-  case PP_OP_TAP: {
-    pp_result_t result = parse(parser->data.tap.parser, state);
-    if (result.status == PP_OK) {
-      parser->data.tap.tap(result.output, parser->data.tap.arg);
+  trie->edge_starts[num_nodes] = num_edges;
+
+  free(nodes);
+  return trie;
+}
+
+// returns the length of the winning keyword and stores its index, or -1.
+// at_end is set when a longer keyword could still match past end.
+static int match_keywords(
+  const pp_keywords_t* keywords, const char* ptr, const char* end, int* index,
+  int* at_end
+) {
+  const pp_trie_t* trie = keywords->trie;
+  const int no_case = keywords->flags & PP_KEYWORDS_NO_CASE;
+  const int longest = keywords->flags & PP_KEYWORDS_LONGEST;
+
+  int best_len = trie->terminals[0] == -1 ? -1 : 0;
+  *index = trie->terminals[0];
+
+  int node = 0;
+  for (const char* p = ptr; p < end; ++p) {
+    const unsigned char c =
+      no_case ? tolower((unsigned char)*p) : (unsigned char)*p;
+
+    if (node == 0) {
+      node = trie->root[c];
+    } else {
+      int edge = trie->edge_starts[node];
+      const int edges_end = trie->edge_starts[node + 1];
+      while (edge < edges_end && trie->edge_bytes[edge] < c)
+        edge++;
+      node = edge < edges_end && trie->edge_bytes[edge] == c
+               ? trie->edge_targets[edge]
+               : -1;
+    }
+    if (node == -1)
+      break;
+
+    const int terminal = trie->terminals[node];
+    if (terminal != -1 && (longest || best_len == -1 || terminal < *index)) {
+      best_len = p + 1 - ptr;
+      *index = terminal;
     }
-    return result;
   }
-  default:
-    return err(pos, PP_ERROR_UNKNOWN_OP);
+  if (at_end != NULL)
+    *at_end = node != -1;
+  return best_len;
+}
+
+static pp_parser_t* span(pp_class_t cls, int min) {
+  pp_parser_t p = {.op = PP_OP_SPAN, .data.span = {.cls = cls, .min = min}};
+
+  // scan for whichever of the class and its complement has fewer ranges
+  pp_byte_range_t ranges[PP_SPAN_MAX_RANGES];
+  const pp_class_t complement = pp_class_complement(cls);
+  const int num_ranges = class_ranges(&cls, p.data.span.ranges);
+  const int num_inverted = class_ranges(&complement, ranges);
+
+  p.data.span.invert = 0;
+  p.data.span.num_ranges = num_ranges;
+  if (num_inverted < num_ranges) {
+    memcpy(p.data.span.ranges, ranges, sizeof(ranges));
+    p.data.span.invert = 1;
+    p.data.span.num_ranges = num_inverted;
   }
-  return err(pos, PP_ERROR_UNEXPECTED_TOK);
+  if (p.data.span.num_ranges > PP_SPAN_MAX_RANGES) {
+    p.data.span.num_ranges = 0;
+  }
+  return make_node(&p);
+}
+
+// returns the end of the run of bytes in the span's class starting at ptr.
+// most runs are short or empty, so the first byte is checked before picking a
+// vectorised scan.
+static const char*
+scan_span(const pp_span_t* span, const char* ptr, const char* end) {
+  if (ptr >= end || !class_has(&span->cls, *ptr))
+    return ptr;
+
+#ifdef SIMD_X86
+  if (span->num_ranges > 0) {
+    if (__builtin_cpu_supports("avx2"))
+      return scan_span_avx2(span, ptr + 1, end);
+    if (__builtin_cpu_supports("sse2"))
+      return scan_span_sse2(span, ptr + 1, end);
+  }
+#endif
+  return scan_span_scalar(span, ptr + 1, end);
+}
+
+static const char*
+scan_span_scalar(const pp_span_t* span, const char* ptr, const char* end) {
+  while (ptr < end && class_has(&span->cls, *ptr))
+    ptr++;
+  return ptr;
+}
+
+#ifdef SIMD_X86
+
+// a byte is in [lo, hi] when min(byte - lo, hi - lo) == byte - lo, which only
+// needs unsigned compares available since SSE2
+__attribute__((target("sse2"))) static const char*
+scan_span_sse2(const pp_span_t* span, const char* ptr, const char* end) {
+  __m128i lo[PP_SPAN_MAX_RANGES];
+  __m128i width[PP_SPAN_MAX_RANGES];
+  for (int i = 0; i < span->num_ranges; ++i) {
+    lo[i] = _mm_set1_epi8(span->ranges[i].lo);
+    width[i] = _mm_set1_epi8(span->ranges[i].hi - span->ranges[i].lo);
+  }
+  const unsigned int invert = span->invert ? 0xffff : 0;
+
+  while (end - ptr >= 16) {
+    const __m128i bytes = _mm_loadu_si128((const __m128i*)ptr);
+    __m128i in = _mm_setzero_si128();
+    for (int i = 0; i < span->num_ranges; ++i) {
+      const __m128i offset = _mm_sub_epi8(bytes, lo[i]);
+      in = _mm_or_si128(
+        in, _mm_cmpeq_epi8(_mm_min_epu8(offset, width[i]), offset)
+      );
+    }
+    const unsigned int mask = (_mm_movemask_epi8(in) ^ invert) & 0xffff;
+    if (mask != 0xffff)
+      return ptr + __builtin_ctz(~mask);
+    ptr += 16;
+  }
+  return scan_span_scalar(span, ptr, end);
+}
+
+__attribute__((target("avx2"))) static const char*
+scan_span_avx2(const pp_span_t* span, const char* ptr, const char* end) {
+  __m256i lo[PP_SPAN_MAX_RANGES];
+  __m256i width[PP_SPAN_MAX_RANGES];
+  for (int i = 0; i < span->num_ranges; ++i) {
+    lo[i] = _mm256_set1_epi8(span->ranges[i].lo);
+    width[i] = _mm256_set1_epi8(span->ranges[i].hi - span->ranges[i].lo);
+  }
+  const unsigned int invert = span->invert ? 0xffffffff : 0;
+
+  while (end - ptr >= 32) {
+    const __m256i bytes = _mm256_loadu_si256((const __m256i*)ptr);
+    __m256i in = _mm256_setzero_si256();
+    for (int i = 0; i < span->num_ranges; ++i) {
+      const __m256i offset = _mm256_sub_epi8(bytes, lo[i]);
+      in = _mm256_or_si256(
+        in, _mm256_cmpeq_epi8(_mm256_min_epu8(offset, width[i]), offset)
+      );
+    }
+    const unsigned int mask = (unsigned int)_mm256_movemask_epi8(in) ^ invert;
+    if (mask != 0xffffffff)
+      return ptr + __builtin_ctz(~mask);
+    ptr += 32;
+  }
+  return scan_span_sse2(span, ptr, end);
 }
 
+#endif
+
 static pp_output_t none() {
   return (pp_output_t){.type = PP_OUTPUT_NONE, .output.none = NULL};
 }
@@ -429,10 +5249,17 @@ static pp_output_t chr(char chr) {
   return (pp_output_t){.type = PP_OUTPUT_CHAR, .output.chr = chr};
 }
 
-static pp_output_t string(int len, const char* string) {
+static pp_output_t slice(int len, const char* ptr) {
+  return (pp_output_t){
+    .type = PP_OUTPUT_SLICE,
+    .output.slice = {.ptr = ptr, .len = len},
+  };
+}
+
+static pp_output_t keyword(int index, int len, const char* ptr) {
   return (pp_output_t){
-    .type = PP_OUTPUT_STRING,
-    .output.string = pp_strndup(string, len),
+    .type = PP_OUTPUT_KEYWORD,
+    .output.keyword = {.ptr = ptr, .len = len, .index = index},
   };
 }
 
@@ -467,38 +5294,112 @@ static pp_output_t skip(pp_output_t output, void* arg) {
   return output;
 }
 
-// TODO: this should not concatenate recursively
+// the map given to pp_map. the parsers pass the input consumed to concat_text
+// themselves, so this only runs when a map is called on its own.
 static pp_output_t concat_string(pp_output_t output, void* arg) {
-  switch (output.type) {
-  case PP_OUTPUT_NONE:
-    return string(0, "");
-  case PP_OUTPUT_CHAR: {
-    char str[] = {output.output.chr, '\0'};
-    return string(1, str);
+  return concat_text(output, NULL, NULL);
+}
+
+// text that is the input from begin on, or follows from its first slice, is
+// returned as one slice over the input. anything else is copied once into a
+// new string.
+static pp_output_t
+concat_text(pp_output_t output, const char* begin, const char* limit) {
+  const char* start = NULL;
+  const char* end = NULL;
+  if (contiguous_text(output, begin, limit, &start, &end)) {
+    return start == NULL ? slice(0, "") : slice(end - start, start);
   }
+
+  const int len = text_len(output);
+  char* result = (char*)pp_alloc(len + 1);
+  *write_text(output, result) = '\0';
+  return (pp_output_t){.type = PP_OUTPUT_STRING, .output.string = result};
+}
+
+static int text_len(pp_output_t output) {
+  switch (output.type) {
+  case PP_OUTPUT_CHAR:
+    return 1;
   case PP_OUTPUT_STRING:
-    return output;
+    return strlen(output.output.string);
+  case PP_OUTPUT_SLICE:
+  case PP_OUTPUT_KEYWORD:
+    return output.output.slice.len;
   case PP_OUTPUT_ARRAY: {
     int len = 0;
     for (int i = 0; i < output.output.array.len; ++i) {
-      pp_output_t ele = ((pp_output_t*)output.output.array.values)[i];
-      len += strlen(concat_string(ele, NULL).output.string);
+      len += text_len(output.output.array.values[i]);
     }
+    return len;
+  }
+  default:
+    return 0;
+  }
+}
 
-    char* result = (char*)pp_alloc(len + 1);
-    int offset = 0;
+static char* write_text(pp_output_t output, char* dst) {
+  switch (output.type) {
+  case PP_OUTPUT_CHAR:
+    *dst = output.output.chr;
+    return dst + 1;
+  case PP_OUTPUT_STRING: {
+    const size_t len = strlen(output.output.string);
+    memcpy(dst, output.output.string, len);
+    return dst + len;
+  }
+  case PP_OUTPUT_SLICE:
+  case PP_OUTPUT_KEYWORD:
+    memcpy(dst, output.output.slice.ptr, output.output.slice.len);
+    return dst + output.output.slice.len;
+  case PP_OUTPUT_ARRAY:
     for (int i = 0; i < output.output.array.len; ++i) {
-      pp_output_t ele = ((pp_output_t*)output.output.array.values)[i];
-      pp_output_t concat_ele = concat_string(ele, NULL);
-      strcpy(result + offset, concat_ele.output.string);
-      offset += strlen(concat_ele.output.string);
+      dst = write_text(output.output.array.values[i], dst);
     }
-
-    result[offset] = '\0';
-    return string(len, result);
+    return dst;
+  default:
+    return dst;
   }
+}
+
+// true when every piece of text in output follows the previous one in the
+// input. chars carry no position, so they are matched against the input
+// before limit, from begin when the text starts with one. start stays NULL
+// when there is no text at all.
+static int contiguous_text(
+  pp_output_t output, const char* begin, const char* limit, const char** start,
+  const char** end
+) {
+  switch (output.type) {
+  case PP_OUTPUT_NONE:
+    return 1;
+  case PP_OUTPUT_CHAR:
+    if (*start == NULL)
+      *start = *end = begin;
+    if (limit == NULL || *end >= limit || **end != output.output.chr)
+      return 0;
+    (*end)++;
+    return 1;
+  case PP_OUTPUT_SLICE:
+  case PP_OUTPUT_KEYWORD:
+    if (output.output.slice.len == 0)
+      return 1;
+    if (*start == NULL)
+      *start = output.output.slice.ptr;
+    else if (*end != output.output.slice.ptr)
+      return 0;
+    *end = output.output.slice.ptr + output.output.slice.len;
+    return 1;
+  case PP_OUTPUT_ARRAY:
+    for (int i = 0; i < output.output.array.len; ++i) {
+      if (!contiguous_text(
+            output.output.array.values[i], begin, limit, start, end
+          ))
+        return 0;
+    }
+    return 1;
   default:
-    return none();
+    return 0;
   }
 }
 
@@ -518,18 +5419,18 @@ static pp_output_t concat_array(pp_output_t output, void* arg) {
   }
 
   pp_output_t* values = pp_alloc(len * sizeof(pp_output_t));
-  for (int i = 0; i < len;) {
+  for (int i = 0, j = 0; i < output.output.array.len; i++) {
     const pp_output_t ele = output.output.array.values[i];
     switch (ele.type) {
     case PP_OUTPUT_ARRAY:
       memcpy(
-        &values[i], ele.output.array.values,
+        &values[j], ele.output.array.values,
         ele.output.array.len * sizeof(pp_output_t)
       );
-      i += ele.output.array.len;
+      j += ele.output.array.len;
       break;
     default:
-      values[i++] = ele;
+      values[j++] = ele;
       break;
     }
   }
@@ -537,7 +5438,29 @@ static pp_output_t concat_array(pp_output_t output, void* arg) {
   return array(len, values);
 }
 
-static pp_output_t select(pp_output_t output, void* arg) {
+// [item, [items...]] to [item, items...]. unlike concat_array the first
+// item is kept whole when it is an array itself.
+static pp_output_t prepend_item(pp_output_t output, void* arg) {
+  if (output.type != PP_OUTPUT_ARRAY) {
+    return output;
+  }
+
+  const pp_output_t item = output.output.array.values[0];
+  const pp_output_t items = output.output.array.values[1];
+  pp_output_t* values =
+    pp_alloc((items.output.array.len + 1) * sizeof(pp_output_t));
+  values[0] = item;
+  memcpy(
+    &values[1], items.output.array.values,
+    items.output.array.len * sizeof(pp_output_t)
+  );
+  return (pp_output_t){
+    .type = PP_OUTPUT_ARRAY,
+    .output.array = {.len = items.output.array.len + 1, .values = values},
+  };
+}
+
+static pp_output_t select_item(pp_output_t output, void* arg) {
   if (output.type != PP_OUTPUT_ARRAY) {
     return output;
   }
@@ -548,8 +5471,9 @@ static pp_output_t select(pp_output_t output, void* arg) {
 
 static void copy_string_ref(pp_output_t output, void* arg) {
   const char** ref = (const char**)arg;
-  if (output.type == PP_OUTPUT_STRING) {
-    *ref = output.output.string;
+  if (output.type == PP_OUTPUT_STRING || output.type == PP_OUTPUT_SLICE ||
+      output.type == PP_OUTPUT_KEYWORD) {
+    *ref = pp_materialize_string(output);
   } else {
     *ref = NULL;
   }
@@ -567,8 +5491,10 @@ static void copy_string_array_ref(pp_output_t output, void* arg) {
 
     for (int i = 0; i < len; i++) {
       pp_output_t string_output = output.output.array.values[i];
-      if (string_output.type == PP_OUTPUT_STRING) {
-        arr[i] = string_output.output.string;
+      if (string_output.type == PP_OUTPUT_STRING ||
+          string_output.type == PP_OUTPUT_SLICE ||
+          string_output.type == PP_OUTPUT_KEYWORD) {
+        arr[i] = pp_materialize_string(string_output);
       } else {
         arr[i] = NULL;
       }
@@ -4,12 +4,28 @@
 #include "aa.h"
 
 typedef struct pp_parser pp_parser_t;
+typedef struct pp_ctx pp_ctx_t;
 
 // state
 
+typedef enum {
+  // build no outputs and run no maps or taps
+  PP_RECOGNIZE = 1 << 0,
+  // with PP_RECOGNIZE, still build the outputs under taps and run them
+  PP_RECOGNIZE_TAPS = 1 << 1,
+  // with PP_RECOGNIZE, report tagged nodes to the context's event handler
+  PP_EVENTS = 1 << 2,
+  // write the outputs to the context's tape instead of the arena
+  PP_TAPE = 1 << 3,
+} pp_flags_t;
+
 typedef struct {
   const char* input;
+  const char* end;
   int pos;
+  int len;
+  int flags;
+  pp_ctx_t* ctx;
 } pp_state_t;
 
 // result
@@ -18,6 +34,15 @@ typedef enum {
   PP_OK,
   PP_ERROR_UNEXPECTED_TOK,
   PP_ERROR_UNKNOWN_OP,
+  // a stream that can go on with more input
+  PP_NEED_MORE,
+  // a file that could not be mapped
+  PP_ERROR_IO,
+  // a ref set to a parser that can reach the ref again without consuming
+  // input
+  PP_ERROR_LEFT_RECURSION,
+  // a ref that was set before
+  PP_ERROR_REF_SET,
 } pp_status_t;
 
 typedef enum {
@@ -25,6 +50,8 @@ typedef enum {
   PP_OUTPUT_CHAR,
   PP_OUTPUT_STRING,
   PP_OUTPUT_ARRAY,
+  PP_OUTPUT_SLICE,
+  PP_OUTPUT_KEYWORD,
 } pp_output_type_t;
 
 typedef struct pp_output pp_output_t;
@@ -39,6 +66,17 @@ struct pp_output {
       int len;
       pp_output_t* values;
     } array;
+    // points into the parsed input, not null terminated
+    struct {
+      const char* ptr;
+      int len;
+    } slice;
+    // a slice plus the index of the keyword that matched
+    struct {
+      const char* ptr;
+      int len;
+      int index;
+    } keyword;
   } output;
 };
 
@@ -49,6 +87,81 @@ typedef struct {
   const char* rest;
 } pp_result_t;
 
+// tape
+
+// one output of a tape, in pre-order. the children of an array follow it.
+typedef struct {
+  pp_output_type_t type;
+  // where the text starts, in the input for slices and keywords and in the
+  // tape's strings for strings. chars hold the char itself.
+  int offset;
+  // bytes of text, or children of an array
+  int len;
+  // entries below an array, so the next sibling is skip + 1 entries on. the
+  // index of the word for keywords.
+  int skip;
+} pp_tape_entry_t;
+
+// outputs as one array of entries with no pointers, so a tape can be copied,
+// written out or handed to another thread as is. entry 0 is the root.
+typedef struct {
+  const char* input;
+  int input_len;
+  int len;
+  int cap;
+  pp_tape_entry_t* entries;
+  // the text of every string, each null terminated
+  int strings_len;
+  int strings_cap;
+  char* strings;
+} pp_tape_t;
+
+// the children of one array entry
+typedef struct {
+  const pp_tape_t* tape;
+  int at;
+  int next;
+  int end;
+} pp_tape_iter_t;
+
+// character classes
+
+// one bit per byte value
+typedef struct {
+  unsigned int bits[8];
+} pp_class_t;
+
+// errors
+
+#define PP_MAX_EXPECTED 16
+
+typedef enum {
+  PP_EXPECTED_LITERAL,
+  PP_EXPECTED_CLASS,
+  PP_EXPECTED_NAME,
+  PP_EXPECTED_END,
+} pp_expected_type_t;
+
+// one thing that would have let a parse go on. text is the literal, not null
+// terminated, or the name given with pp_name. parser is the node expected.
+typedef struct {
+  pp_expected_type_t type;
+  const char* text;
+  int len;
+  pp_class_t cls;
+  const pp_parser_t* parser;
+} pp_expected_t;
+
+// the farthest position a parse failed at and what was expected there, each
+// item once. line and column count from 1, and columns count bytes.
+typedef struct {
+  int pos;
+  int line;
+  int column;
+  int num_expected;
+  pp_expected_t expected[PP_MAX_EXPECTED];
+} pp_error_t;
+
 // ops
 
 typedef enum {
@@ -62,12 +175,21 @@ typedef enum {
   PP_OP_STRING_NO_CASE,
   PP_OP_ANY_OF,
   PP_OP_NONE_OF,
+  PP_OP_SPAN,
+  PP_OP_KEYWORDS,
   PP_OP_OPTIONAL,
   PP_OP_CHOICE,
   PP_OP_MANY,
   PP_OP_SEQUENCE,
   PP_OP_MAP,
   PP_OP_TAP,
+  PP_OP_MEMO,
+  PP_OP_PARALLEL_LIST,
+  PP_OP_TAGGED,
+  PP_OP_RECOGNIZE,
+  PP_OP_REF,
+  PP_OP_EXPR,
+  PP_OP_CUT,
 } pp_op_t;
 
 // op data
@@ -81,6 +203,9 @@ typedef struct {
 typedef struct {
 } pp_eof_t;
 
+typedef struct {
+} pp_cut_t;
+
 typedef struct {
   char c;
 } pp_expect_t;
@@ -91,20 +216,64 @@ typedef struct {
 
 typedef struct {
   const char* string;
+  int len;
 } pp_string_t;
 
 typedef struct {
   const char* string;
+  int len;
 } pp_string_no_case_t;
 
 typedef struct {
-  const char* chars;
+  pp_class_t cls;
 } pp_any_of_t;
 
+// cls holds the complement of the given chars
 typedef struct {
-  const char* chars;
+  pp_class_t cls;
 } pp_none_of_t;
 
+#define PP_SPAN_MAX_RANGES 8
+
+typedef struct {
+  unsigned char lo;
+  unsigned char hi;
+} pp_byte_range_t;
+
+// the ranges describe the class (or its complement when invert is set) for
+// the vectorised scan. num_ranges is 0 when the class needs too many ranges.
+typedef struct {
+  pp_class_t cls;
+  int min;
+  int invert;
+  int num_ranges;
+  pp_byte_range_t ranges[PP_SPAN_MAX_RANGES];
+} pp_span_t;
+
+typedef enum {
+  PP_KEYWORDS_FIRST = 0,
+  PP_KEYWORDS_LONGEST = 1 << 0,
+  PP_KEYWORDS_NO_CASE = 1 << 1,
+} pp_keywords_flags_t;
+
+// node 0 is the root and its transitions are a direct table. every other
+// node lists its edges sorted by byte in edge_starts[node]..edge_starts[node
+// + 1]. terminals hold the index of the first keyword ending at a node or -1.
+typedef struct {
+  int root[256];
+  int num_nodes;
+  int* terminals;
+  int* edge_starts;
+  unsigned char* edge_bytes;
+  int* edge_targets;
+} pp_trie_t;
+
+typedef struct {
+  int num_words;
+  int flags;
+  const pp_trie_t* trie;
+} pp_keywords_t;
+
 typedef struct {
   pp_parser_t* parser;
 } pp_optional_t;
@@ -112,6 +281,14 @@ typedef struct {
 typedef struct {
   int num_parsers;
   pp_parser_t** parsers;
+  // bytes each alternative can start with, or every byte when it can succeed
+  // without consuming input
+  pp_class_t* firsts;
+  // alternatives worth trying for each byte, in order, as the ranges
+  // dispatch[c]..dispatch[c + 1] of alternatives. c == 256 stands for the end
+  // of the input.
+  int* dispatch;
+  int* alternatives;
 } pp_choice_t;
 
 typedef struct {
@@ -135,6 +312,83 @@ typedef struct {
   void* arg;
 } pp_tap_t;
 
+typedef struct {
+  long hits;
+  long misses;
+} pp_memo_stats_t;
+
+typedef struct {
+  pp_parser_t* parser;
+  pp_memo_stats_t stats;
+} pp_memo_t;
+
+// called on consecutive stretches of a list, each ending at a candidate
+// separator byte at, and returns nonzero when the list can be split there.
+// state starts at 0 for every parse and carries over between calls, e.g. to
+// track whether at is inside quotes.
+typedef int (*pp_split_t)(
+  const char* from, const char* at, int* state, void* arg
+);
+
+typedef struct {
+  pp_parser_t* item;
+  // separator then item
+  pp_parser_t* next;
+  // the sequential list, for short input and splits that turned out wrong
+  pp_parser_t* list;
+  char split_char;
+  pp_split_t split;
+  void* arg;
+  int num_threads;
+} pp_parallel_list_t;
+
+typedef struct {
+  pp_parser_t* parser;
+  int tag;
+  // a single token event instead of enter and leave around the events inside
+  int token;
+} pp_tagged_t;
+
+// parser only recognizes, and the output is PP_OUTPUT_NONE
+typedef struct {
+  pp_parser_t* parser;
+} pp_recognize_t;
+
+// stands for parser, which is NULL until pp_ref_set. busy is set while
+// first sets are computed through it.
+typedef struct {
+  pp_parser_t* parser;
+  int busy;
+} pp_ref_t;
+
+typedef enum {
+  PP_PREFIX,
+  PP_POSTFIX,
+  // a op b op c is (a op b) op c
+  PP_INFIX_LEFT,
+  // a op b op c is a op (b op c)
+  PP_INFIX_RIGHT,
+} pp_fixity_t;
+
+// an operator of pp_expr. higher precedences bind tighter.
+typedef struct {
+  pp_parser_t* parser;
+  pp_fixity_t fixity;
+  int precedence;
+} pp_operator_t;
+
+// parsers holds the atom and then the parser of every operator. firsts are
+// the bytes each operator can start with, and prefixes and suffixes their
+// union over the prefix operators and over the others.
+typedef struct {
+  int num_operators;
+  pp_parser_t** parsers;
+  pp_operator_t* operators;
+  pp_class_t* firsts;
+  pp_class_t prefixes;
+  pp_class_t suffixes;
+} pp_expr_t;
+
 typedef union {
   pp_pure_t pure;
   pp_fail_t fail;
@@ -144,23 +398,351 @@ typedef union {
   pp_string_no_case_t string_no_case;
   pp_any_of_t any_of;
   pp_none_of_t none_of;
+  pp_span_t span;
+  pp_keywords_t keywords;
   pp_optional_t optional;
   pp_choice_t choice;
   pp_many_t many;
   pp_sequence_t sequence;
   pp_map_t map;
   pp_tap_t tap;
+  pp_memo_t memo;
+  pp_parallel_list_t parallel_list;
+  pp_tagged_t tagged;
+  pp_recognize_t recognize;
+  pp_ref_t ref;
+  pp_expr_t expr;
 } pp_op_data_t;
 
+// profile
+
+#ifdef PP_PROFILE
+#include <stdio.h>
+
+// counts for one parser node. bytes are what its successes consumed and
+// backtracked bytes how far its failures got before giving up. self time
+// leaves out the time spent in the nodes it ran.
+typedef struct {
+  long calls;
+  long successes;
+  long failures;
+  long bytes;
+  long backtracked;
+  long total_ns;
+  long self_ns;
+} pp_profile_t;
+#endif
+
 // parser
 
 struct pp_parser {
   pp_op_t op;
   pp_op_data_t data;
+  // set by pp_name, or NULL
+  const char* name;
+#ifdef PP_PROFILE
+  pp_profile_t profile;
+#endif
 };
 
+// program
+
+typedef enum {
+  PP_I_HALT,
+  PP_I_FAIL,
+  PP_I_PURE,
+  PP_I_EOF,
+  PP_I_EXPECT,
+  PP_I_CHAR,
+  PP_I_STRING,
+  PP_I_STRING_NO_CASE,
+  PP_I_CLASS,
+  PP_I_SPAN,
+  PP_I_KEYWORDS,
+  PP_I_TEST,
+  PP_I_CHOICE,
+  PP_I_COMMIT,
+  PP_I_PARTIAL_COMMIT,
+  PP_I_NOT_AT_END,
+  PP_I_MARK,
+  PP_I_COLLECT,
+  PP_I_ARRAY,
+  PP_I_MAP,
+  PP_I_POSITION,
+  PP_I_CONCAT_STRING,
+  PP_I_TAP,
+  PP_I_TREE,
+  PP_I_CALL,
+  PP_I_RETURN,
+  PP_I_CUT,
+  PP_I_ENTER,
+  PP_I_LEAVE,
+} pp_opcode_t;
+
+// arg is a jump target, a character or an element count depending on the
+// opcode. parser points back at the node the instruction was lowered from,
+// except for tests which point at the class to test.
+typedef struct {
+  pp_opcode_t op;
+  int arg;
+  union {
+    const pp_parser_t* parser;
+    const pp_class_t* cls;
+  };
+} pp_inst_t;
+
+typedef struct {
+  int len;
+  pp_inst_t* code;
+} pp_program_t;
+
+// context
+
+typedef struct {
+  const pp_parser_t* parser;
+  int pos;
+  int flags;
+  unsigned int generation;
+  // whether the parser passed a cut of the alternative it is in, which a
+  // hit passes again
+  int cut;
+  pp_result_t result;
+} pp_memo_entry_t;
+
+// open addressing table. entries from an older generation count as empty, so
+// starting a new parse does not touch the table.
+typedef struct {
+  void* owner;
+  int all;
+  int cap;
+  int len;
+  unsigned int generation;
+  pp_memo_entry_t* entries;
+  pp_memo_stats_t stats;
+} pp_memo_table_t;
+
+// open addressing table of the nodes made while interning. like the memo
+// table it belongs to the allocator the nodes came from and is dropped when
+// that is swept.
+typedef struct {
+  void* owner;
+  int enabled;
+  int cap;
+  int len;
+  pp_parser_t** entries;
+} pp_intern_table_t;
+
+// outputs of the many and sequence parsers that are still running. nested
+// parsers push above their parent and pop back when done, so the stack only
+// grows to the deepest nesting and is reused by every parse.
+typedef struct {
+  int len;
+  int cap;
+  pp_output_t* values;
+} pp_scratch_t;
+
+// arenas of other threads holding outputs that belong to this context
+typedef struct pp_arena_list {
+  aa_arena_t arena;
+  struct pp_arena_list* next;
+} pp_arena_list_t;
+
+typedef enum {
+  PP_EVENT_ENTER,
+  PP_EVENT_LEAVE,
+  PP_EVENT_TOKEN,
+} pp_event_type_t;
+
+// leave and token events hold the input the node matched. enter events hold
+// where it starts, with len 0.
+typedef struct {
+  pp_event_type_t type;
+  int tag;
+  const char* ptr;
+  int len;
+} pp_event_t;
+
+typedef void (*pp_handler_t)(const pp_event_t* event, void* arg);
+
+// events that an enclosing optional, choice or many could still take back.
+// they are handed to the handler once the last of those has succeeded.
+typedef struct {
+  int len;
+  int cap;
+  pp_event_t* events;
+  // optionals, choices and many iterations the parse is inside of
+  int depth;
+  pp_handler_t handler;
+  void* arg;
+} pp_event_log_t;
+
+// a named node being parsed and where it started
+typedef struct {
+  const pp_parser_t* parser;
+  int pos;
+} pp_name_frame_t;
+
+// named nodes the parse is inside of, innermost last
+typedef struct {
+  int len;
+  int cap;
+  pp_name_frame_t* frames;
+} pp_name_stack_t;
+
+// the farthest position a leaf failed at in the last parse, and the nodes
+// that failed there. a choice that skipped alternatives at the position is
+// one of them, and stands for what its alternatives start with.
+typedef struct {
+  const char* input;
+  int len;
+  int pos;
+  int num_expected;
+  const pp_parser_t* expected[PP_MAX_EXPECTED];
+} pp_failure_t;
+
+// everything a parse writes to. parsers are only read while parsing, so one
+// grammar can be shared by many threads that each have their own context.
+struct pp_ctx {
+  aa_sweeper_t allocator;
+  aa_sweeper_t default_allocator;
+  aa_arena_t arena;
+  pp_scratch_t scratch;
+  pp_memo_table_t memo;
+  pp_intern_table_t intern;
+  pp_arena_list_t* retained;
+  pp_event_log_t events;
+  pp_tape_t* tape;
+#ifdef PP_PROFILE
+  // time spent in the nodes run by the node being profiled, and the furthest
+  // any of them got
+  long profile_child_ns;
+  int profile_reach;
+#endif
+  // set when a parser ran out of input. streams use it to tell an item that
+  // is finished from one that may go on in the next chunk.
+  int hit_end;
+  // whether the innermost alternative, optional or many iteration being
+  // parsed has passed a cut, and how many of the enclosing ones have not
+  int cut;
+  int backtracks;
+  pp_name_stack_t names;
+  pp_failure_t failure;
+};
+
+// a context that allocates from an arena of its own
+void pp_ctx_init(pp_ctx_t* ctx);
+// a context that allocates from sweeper, which stays owned by the caller
+void pp_ctx_init_allocator(pp_ctx_t* ctx, aa_sweeper_t sweeper);
+void pp_ctx_deinit(pp_ctx_t* ctx);
+// makes ctx current on the calling thread and returns the previous one. the
+// functions without a context argument, including the combinators, use the
+// current context. NULL goes back to the default context, which is shared by
+// all threads and not safe to use from two of them at once.
+pp_ctx_t* pp_ctx_use(pp_ctx_t* ctx);
+void pp_ctx_sweep(pp_ctx_t* ctx);
+pp_result_t
+pp_ctx_parse(pp_ctx_t* ctx, pp_parser_t* parser, const char* input, int len);
+pp_result_t pp_ctx_recognize(
+  pp_ctx_t* ctx, pp_parser_t* parser, const char* input, int len
+);
+pp_result_t
+pp_ctx_run(pp_ctx_t* ctx, pp_program_t* program, const char* input, int len);
+
+// batch
+
+// one context per worker. the outputs of a batch live in their arenas.
+typedef struct {
+  int num_workers;
+  pp_ctx_t* ctxs;
+  // errors[i] is what pp_error gave after inputs[i] failed, or NULL when it
+  // parsed. the errors live in the arenas with the outputs.
+  pp_error_t** errors;
+} pp_batch_t;
+
+// parses inputs[i] into results[i] on num_threads threads, or one per cpu
+// when num_threads is 0. each worker starts with an equal share of the inputs
+// and steals from the others when it runs out. the results stay valid until
+// the returned batch is swept.
+pp_batch_t* pp_parse_batch(
+  pp_parser_t* parser, const char** inputs, const int* lens, int n,
+  pp_result_t* results, int num_threads
+);
+// frees the outputs and the batch itself
+void pp_batch_sweep(pp_batch_t* batch);
+
+// streaming
+
+typedef void (*pp_emit_t)(pp_output_t output, void* arg);
+
+// input that arrives in chunks. only the bytes of the item being parsed are
+// buffered, and the outputs passed to emit are only valid during the call.
+typedef struct {
+  pp_parser_t* item;
+  int many;
+  pp_emit_t emit;
+  void* arg;
+  pp_ctx_t ctx;
+  char* buffer;
+  int len;
+  int cap;
+  // bytes parsed and dropped from the front of the buffer
+  int consumed;
+  pp_status_t status;
+  // where the item that stopped the stream with an error failed. pos, line
+  // and column count from the start of that item, which is consumed bytes
+  // into the stream and the pos pp_stream_end returns. it is kept by
+  // pp_stream_end.
+  pp_error_t error;
+} pp_stream_t;
+
+// when parser is a pp_many every item is emitted as soon as it is complete.
+// any other parser is emitted once, when it completes.
+void pp_stream_begin(
+  pp_stream_t* stream, pp_parser_t* parser, pp_emit_t emit, void* arg
+);
+// PP_NEED_MORE while more input can still be parsed. PP_OK once a parser
+// that is not a pp_many has completed, or the error that stopped the stream.
+// an item cut off by the last chunk is parsed again from its start, so it is
+// emitted by the chunk that completes it.
+pp_status_t pp_stream_feed(pp_stream_t* stream, const char* chunk, int len);
+// parses what is left as the end of the input and frees the stream. pos
+// counts every byte parsed and the output is always PP_OUTPUT_NONE.
+pp_result_t pp_stream_end(pp_stream_t* stream);
+
+// files
+
+// a file mapped read only. slices in the outputs point into data.
+typedef struct {
+  const char* data;
+  size_t size;
+  // one entry per record after pp_parse_file_records
+  int num_records;
+  const char** records;
+  int* lens;
+  pp_result_t* results;
+  pp_batch_t* batch;
+} pp_file_t;
+
+// maps the file at path and parses all of it in place. the outputs stay
+// valid until pp_file_close. files of INT_MAX bytes or more can only be
+// parsed as records.
+pp_result_t
+pp_parse_file(pp_parser_t* parser, const char* path, pp_file_t* file);
+// maps the file at path, cuts it into records ending at separator and parses
+// them with pp_parse_batch. the separators are not part of the records.
+pp_status_t pp_parse_file_records(
+  pp_parser_t* parser, const char* path, char separator, int num_threads,
+  pp_file_t* file
+);
+// unmaps the file and frees what the parse kept in it. after PP_ERROR_IO
+// from either function above nothing is left open and closing does nothing.
+// after any other status, a failed parse included, the file has to be closed.
+void pp_file_close(pp_file_t* file);
+
 // allocation
 
+// the default context. there is one per process, so threads that parse at the
+// same time need contexts of their own.
 void pp_init_default_allocator();
 void pp_deinit_default_allocator();
 void pp_set_default_allocator();
@@ -169,15 +751,93 @@ void* pp_alloc(size_t size);
 void pp_sweep();
 char* pp_strdup(const char* str);
 char* pp_strndup(const char* str, size_t len);
+// null terminated copy of the text in an output. strings are returned as is.
+const char* pp_materialize_string(pp_output_t output);
+// same type and contents. slices and keywords are compared by their text.
+int pp_output_equal(pp_output_t a, pp_output_t b);
 
 // parser
 
 pp_result_t pp_parse(pp_parser_t* parser, const char* input);
+// input does not need to be null terminated
+pp_result_t pp_parse_n(pp_parser_t* parser, const char* input, int len);
+// status and end position only. the output is always PP_OUTPUT_NONE and
+// nothing is allocated.
+pp_result_t pp_recognize(pp_parser_t* parser, const char* input, int len);
+pp_result_t
+pp_recognize_taps(pp_parser_t* parser, const char* input, int len);
+// recognizes input and passes the events of the pp_node and pp_token parsers
+// to handler in input order. events inside an alternative that fails are
+// dropped before they reach the handler, but a parse that fails as a whole
+// may already have reported the part before the error. memoization is off
+// while parsing for events, since a cached result would skip them.
+pp_result_t pp_parse_events(
+  pp_parser_t* parser, const char* input, int len, pp_handler_t handler,
+  void* arg
+);
 pp_parser_t* pp_init_parser();
 
+// errors
+
+// where the last parse on the current context got farthest before failing,
+// and what the parsers that failed there expected. a failure at the start of
+// a node named with pp_name is reported as that name, and a choice as what
+// its alternatives start with. the items are worked out here rather than
+// while parsing, from the input and grammar of that parse, which have to
+// still be around. a successful parse leaves what its alternatives that
+// failed on the way expected.
+pp_error_t pp_error();
+pp_error_t pp_ctx_error(pp_ctx_t* ctx);
+// writes a message such as
+//   line 3, column 7: expected "FROM", [0-9] or table
+// to buf as snprintf does, and returns its length
+int pp_error_message(const pp_error_t* error, char* buf, int size);
+
+// tape
+
+void pp_tape_init(pp_tape_t* tape);
+void pp_tape_deinit(pp_tape_t* tape);
+// parses input into tape, replacing what it held. the output of the result
+// is always PP_OUTPUT_NONE. maps other than the ones pp_skip, pp_select,
+// pp_concat_string, pp_concat_array and pp_separated_list use, and taps, are
+// given their input as a tree built from the tape. memoization is off while
+// parsing to a tape.
+pp_result_t pp_parse_tape(
+  pp_parser_t* parser, const char* input, int len, pp_tape_t* tape
+);
+// appends output to the end of tape. slices with text that do not point
+// into the tape's input are stored as strings.
+void pp_tape_push_output(pp_tape_t* tape, pp_output_t output);
+// the entry as a tree allocated with the current context. strings are copied
+// out of the tape.
+pp_output_t pp_tape_output(const pp_tape_t* tape, int entry);
+// the entry after the one at entry and everything below it
+int pp_tape_skip(const pp_tape_t* tape, int entry);
+const char* pp_tape_text(const pp_tape_t* tape, int entry);
+// for (pp_tape_iter_t it = pp_tape_children(tape, 0); pp_tape_next(&it);)
+// visits it.at for every child of the array at entry 0
+pp_tape_iter_t pp_tape_children(const pp_tape_t* tape, int entry);
+int pp_tape_next(pp_tape_iter_t* iter);
+
+// program
+
+// lowers the parser graph into a flat instruction array. pp_run executes it
+// without recursing on the C stack and gives the same results as pp_parse_n.
+pp_program_t* pp_compile(pp_parser_t* parser);
+pp_result_t pp_run(pp_program_t* program, const char* input, int len);
+
 // state
 
 pp_state_t pp_init_state(const char* input, int pos);
+pp_state_t pp_init_state_n(const char* input, int len, int pos);
+
+// character classes
+
+pp_class_t pp_class_of(const char* chars);
+pp_class_t pp_class_range(char lo, char hi);
+pp_class_t pp_class_union(pp_class_t a, pp_class_t b);
+pp_class_t pp_class_complement(pp_class_t cls);
+int pp_class_has(const pp_class_t* cls, char c);
 
 // combinators
 
@@ -190,6 +850,16 @@ pp_parser_t* pp_string(const char* string);
 pp_parser_t* pp_string_no_case(const char* string);
 pp_parser_t* pp_any_of(const char* chars);
 pp_parser_t* pp_none_of(const char* chars);
+pp_parser_t* pp_class(pp_class_t cls);
+pp_parser_t* pp_range(char lo, char hi);
+// longest run of bytes in cls as a single string. pp_many over a single
+// character parser is rewritten into a span.
+pp_parser_t* pp_span(pp_class_t cls);
+pp_parser_t* pp_span1(pp_class_t cls);
+// matches any of the words in one pass over the input. by default the first
+// word in the list that matches wins, as with a choice of pp_string. the
+// output is a PP_OUTPUT_KEYWORD holding the index of that word.
+pp_parser_t* pp_keywords(int num_words, const char** words, int flags);
 pp_parser_t* pp_optional(pp_parser_t* parser);
 pp_parser_t* pp_choice(int num_parsers, pp_parser_t** parsers);
 pp_parser_t* pp_many(pp_parser_t* parser);
@@ -198,6 +868,116 @@ pp_parser_t*
 pp_map(pp_parser_t* parser, pp_output_t (*map)(pp_output_t, void*), void* arg);
 pp_parser_t*
 pp_tap(pp_parser_t* parser, void (*tap)(pp_output_t, void*), void* arg);
+// enter and leave events around parser, with the events inside in between.
+// both are the same as parser outside pp_parse_events.
+pp_parser_t* pp_node(pp_parser_t* parser, int tag);
+// one token event for everything parser matched, ignoring the tags inside
+pp_parser_t* pp_token(pp_parser_t* parser, int tag);
+
+// names parser for reports and returns it. the name is not copied. a node
+// shared by pp_intern is left as it is and a named copy returned instead, so
+// the nodes equal to it keep their own reports.
+pp_parser_t* pp_name(pp_parser_t* parser, const char* name);
+
+// interning
+
+// while enabled, parsers built on the current context with the same op and
+// data return one shared node instead of a new one each. children are
+// compared by identity and strings and classes by value, so whole identical
+// subgraphs collapse into one, and their memo entries, first sets and
+// profiles are shared too. nodes are only shared with ones from the same
+// allocator, until it is swept. keywords, parallel lists and expressions are
+// always new.
+void pp_intern(int enabled);
+// the number of distinct nodes reachable from parser
+int pp_count_nodes(pp_parser_t* parser);
+
+// recursion
+
+// a parser that is set later, so a grammar can use itself:
+//   pp_parser_t* expr = pp_ref();
+//   pp_parser_t* atom = pp_choice(2, (pp_parser_t*[]){number, parens(expr)});
+//   pp_ref_set(expr, sum_of(atom));
+// a ref that was never set fails.
+pp_parser_t* pp_ref();
+// points ref at parser and returns PP_OK. a parser that can reach ref again
+// without consuming input would recurse forever, so ref stays unset and
+// PP_ERROR_LEFT_RECURSION is returned instead. a ref can only be set once,
+// since choices built over it since then depend on its parser, and setting
+// it again returns PP_ERROR_REF_SET. choices under parser that were built
+// before ref was set look through it again.
+pp_status_t pp_ref_set(pp_parser_t* ref, pp_parser_t* parser);
+
+// expressions
+
+// atoms joined by operators, parsed by precedence climbing in one pass
+// instead of one level of the grammar per precedence. prefix operators are
+// tried before an operand and the others after one. they are tried in order
+// and the first that matches is taken, so longer ones go first, and a match
+// that consumes nothing does not count. the output is
+//   [a, op, b] for infix, [op, a] for prefix and [a, op] for postfix
+// nested by precedence and associativity, with atoms as they are. a prefix
+// operator applies to everything after it that binds at least as tightly,
+// and one whose operand does not parse is tried as the atom instead.
+pp_parser_t*
+pp_expr(pp_parser_t* atom, int num_operators, const pp_operator_t* operators);
+
+// cuts
+
+// succeeds without consuming input and commits to the innermost choice
+// alternative, optional or many iteration it is in, as the cut of PEG: when
+// the rest of it fails, the choice fails without trying the alternatives
+// after it, and the optional and the many fail instead of matching less.
+// placed after the part that tells an alternative apart, it stops the parse
+// at the first error instead of retrying every alternative before giving up.
+// for an expression, an operator and its operand are one iteration. once no
+// alternative that could be backtracked into is left, the memo entries of
+// the parse are dropped, so memoizing a long input only keeps what was
+// parsed since the last such cut.
+pp_parser_t* pp_cut();
+// parser and then a cut, with the output of parser
+pp_parser_t* pp_commit(pp_parser_t* parser);
+
+// memoization
+
+// results of the wrapped parser are cached per input position for the rest
+// of the parse. the cache lives in the context's allocator and is dropped by
+// pp_sweep. taps inside a memoized parser do not run again on a hit. the
+// per node stats are only counted in the default context.
+pp_parser_t* pp_memo(pp_parser_t* parser);
+// memoize every optional, choice, many, sequence, map and tap in parses on
+// the current context
+void pp_memo_all(int enabled);
+pp_memo_stats_t pp_memo_stats();
+void pp_memo_reset_stats();
+
+// profiling
+
+#ifdef PP_PROFILE
+// with PP_PROFILE defined for pp.c and everything including pp.h, every node
+// run by the reference parser counts its calls, bytes and time. pp_run only
+// counts the nodes it hands to the reference parser.
+void pp_profile_reset(pp_parser_t* parser);
+// a line for every node reachable from parser, sorted by self time
+void pp_profile_report(pp_parser_t* parser, FILE* out);
+#endif
+
+// optimization
+
+// a copy of the graph under parser that gives the same results with less
+// work:
+// - nested choices are flattened, and adjacent single byte alternatives are
+//   merged into one class;
+// - common first parsers of adjacent sequence alternatives are parsed once;
+// - pp_skip over a parser without taps becomes a node that only recognizes;
+// - sequences whose output is dropped, or only used as text by
+//   pp_concat_string, are flattened and their adjacent literals fused.
+// a rewrite that would run a tap a different number of times, or change
+// which alternative a cut commits to, is not done. names are kept on the
+// nodes that take the place of named ones, but not on nodes merged into
+// others.
+// the original graph is not changed, and parallel lists are kept as they are.
+pp_parser_t* pp_optimize(pp_parser_t* parser);
 
 // higher order parsers
 
@@ -212,6 +992,17 @@ pp_parser_t* pp_skip_whitespace();
 pp_parser_t* pp_whitespace_delimited(pp_parser_t* parser);
 pp_parser_t* pp_separated_list(pp_parser_t* item, pp_parser_t* separator);
 pp_parser_t* pp_comma_separated_list(pp_parser_t* parser);
+// the same output as pp_separated_list, but long lists are cut at separator
+// bytes that split approves (every one when split is NULL) and the pieces are
+// parsed on num_threads threads, or one per cpu when num_threads is 0. each
+// piece sees the input end at the next cut. when a piece does not end exactly
+// there, or its last item ran into the cut and parses differently over the
+// whole input, the list is parsed again sequentially. outputs of other
+// threads stay alive until the context is swept.
+pp_parser_t* pp_parallel_separated_list(
+  pp_parser_t* item, pp_parser_t* separator, char split_char, pp_split_t split,
+  void* arg, int num_threads
+);
 pp_parser_t* pp_copy_string_ref(pp_parser_t* parser, const char** str_ref);
 // this function requires a reference to an array containing a length and a
 // string in the given order